@@ -1,7 +1,9 @@
 #define TCPSOCK_IMPLEMENTATION
+#define _GNU_SOURCE     // pthread_setaffinity_np(), CPU_SET()
 
 #include <stdio.h>      // NULL, fprintf(), perror()
 #include <stdlib.h>     // NULL, EXIT_FAILURE, EXIT_SUCCESS
+#include <stddef.h>     // offsetof()
 #include <errno.h>      // errno
 #include <unistd.h>     // close()
 #include <string.h>     // strlen(), strerror()
@@ -11,9 +13,27 @@
 #include "tcpsock.h"
 #include "libtwirc.h"
 #include "libtwirc_internal.h"
+#include "libtwirc_scan.c"
+#include "libtwirc_hash.c"
+#include "libtwirc_arena.c"
+#include "libtwirc_sendq.c"
+#include "libtwirc_chans.c"
+#include "libtwirc_limit.c"
 #include "libtwirc_cmds.c"
 #include "libtwirc_util.c"
 #include "libtwirc_evts.c"
+#include "libtwirc_timers.c"
+#include "libtwirc_reconnect.c"
+#include "libtwirc_dedup.c"
+#include "libtwirc_handover.c"
+#include "libtwirc_keepalive.c"
+#include "libtwirc_async.c"
+#include "libtwirc_reactor.c"
+#include "libtwirc_pool.c"
+#include "libtwirc_group.c"
+#include "libtwirc_workers.c"
+#include "libtwirc_copy.c"
+#include "libtwirc_handoff.c"
 
 /*
  * Sets the state's error flag to TWIRC_ERR_OUT_OF_MEMORY and returns -1.
@@ -68,8 +88,12 @@ int twirc_connect(twirc_state_t *s, const char *host, const char *port, const ch
 		return -1;
 	}
 
-	// Create epoll instance 
-	s->epfd = epoll_create(1);
+	// Create epoll instance, unless we have one already (from a previous
+	// connection) or are driven by a reactor, which brings its own
+	if (s->epfd < 0)
+	{
+		s->epfd = epoll_create(1);
+	}
 	if (s->epfd < 0)
 	{
 		s->error = TWIRC_ERR_EPOLL_CREATE;
@@ -89,14 +113,37 @@ int twirc_connect(twirc_state_t *s, const char *host, const char *port, const ch
 		return -1;
 	}
 
-	// Properly initialize the login struct and copy the login data into it
-	s->login.host = strdup(host);
-	s->login.port = strdup(port);
-	s->login.nick = strdup(nick);
-	s->login.pass = strdup(pass);
+	// Messages sent from other threads and timers need to wake us up
+	if (libtwirc_watch_inbox(s) == -1 || libtwirc_watch_timers(s) == -1)
+	{
+		return -1;
+	}
+
+	// Whatever might be left over from a previous connection is stale now,
+	// including the part of a message it was cut off in the middle of
+	libtwirc_clear_sendq(s);
+	libtwirc_clear_held(s);
+	s->buf_head = 0;
+	s->buf_scan = 0;
+	s->buf_tail = 0;
+	s->buf_skip = 0;
+
+	// Copy the login data into the login struct, replacing the data of a
+	// previous connection; that might be what we've been given, so we copy
+	// before we free
+	char *h = strdup(host);
+	char *p = strdup(port);
+	char *n = strdup(nick);
+	char *w = strdup(pass);
+	libtwirc_free_login(s);
+	s->login.host = h;
+	s->login.port = p;
+	s->login.nick = n;
+	s->login.pass = w;
+	s->quit = 0;
 
 	// Connect the socket (and handle a possible connection error)
-	if (tcpsock_connect(s->socket_fd, s->ip_type, host, port) == -1)
+	if (tcpsock_connect(s->socket_fd, s->ip_type, s->login.host, s->login.port) == -1)
 	{
 		s->error = TWIRC_ERR_SOCKET_CONNECT;
 		return -1;
@@ -155,11 +202,30 @@ int libtwirc_auth(twirc_state_t *s)
  */ 
 int twirc_disconnect(twirc_state_t *s)
 {
-	// Say bye-bye to the IRC server
+	// Don't come back, even if we were about to (see TWIRC_OPT_RECONNECT)
+	s->quit = 1;
+	if (s->reconnect_timer != 0)
+	{
+		twirc_timer_cancel(s, s->reconnect_timer);
+		s->reconnect_timer = 0;
+	}
+
+	// A new connection that was about to take over won't be needed
+	libtwirc_handover_abort(s);
+
+	// Say bye-bye to the IRC server; we might be inside a callback, where
+	// messages are only queued until it returns (see twirc_batch_begin()),
+	// or there might be other messages waiting in line, so we make sure 
+	// the QUIT actually goes out before the socket does
 	twirc_cmd_quit(s);
+	libtwirc_drain(s, TWIRC_DRAIN_TIMEOUT);
+	tcpsock_shutdown(s->socket_fd);
 	
-	// Close the socket and return if that worked
-	return tcpsock_close(s->socket_fd);
+	// Close the socket and return if that worked; the descriptor might be
+	// reused for something else right away, so we forget about it
+	int ret = tcpsock_close(s->socket_fd);
+	s->socket_fd = -1;
+	return ret;
 
 	// Note that we are NOT calling the disconnect event handlers from
 	// here; this is on purpose! We only want to call these from within
@@ -204,6 +270,7 @@ void twirc_init_callbacks(twirc_callbacks_t *cbs)
 	cbs->invalidcmd      = libtwirc_on_null;
 	cbs->other           = libtwirc_on_null;
 	cbs->outbound        = libtwirc_on_null;
+	cbs->outbound_raw    = libtwirc_on_null_raw;
 }
 
 /*
@@ -219,6 +286,26 @@ twirc_callbacks_t *twirc_get_callbacks(twirc_state_t *s)
 	return &s->cbs;
 }
 
+/*
+ * Fills sigset with the signals that should be blocked while we wait for
+ * events in epoll_pwait(). epoll_wait()/epoll_pwait() will return -1 if a 
+ * signal is caught. User code might catch "harmless" signals, like SIGWINCH,
+ * that are ignored by default. This would then cause epoll_wait() to return
+ * with -1, hence our main loop to come to a halt. This is not what a user 
+ * would expect; we should only come to a halt on "serious" signals that would
+ * cause program termination/halt by default. In order to achieve this, we 
+ * tell epoll_pwait() to block all of the signals that are ignored by default.
+ * For a list of signals: https://en.wikipedia.org/wiki/Signal_(IPC)
+ */
+void libtwirc_init_sigmask(sigset_t *sigset)
+{
+	sigemptyset(sigset);
+	sigaddset(sigset, SIGCHLD);  // default: ignore
+	sigaddset(sigset, SIGCONT);  // default: continue execution
+	sigaddset(sigset, SIGURG);   // default: ignore
+	sigaddset(sigset, SIGWINCH); // default: ignore
+}
+
 /*
  * Returns a pointer to a twirc_state struct, which represents the state of
  * the connection to the server, the state of the user, holds the login data,
@@ -239,13 +326,66 @@ twirc_state_t *twirc_init()
 	s->status    = TWIRC_STATUS_DISCONNECTED;
 	s->ip_type   = TWIRC_IPV4;
 	s->socket_fd = -1;
+	s->epfd      = -1;
 	s->error     = 0;
+	s->options   = 0;
+
+	// Wait this long before reconnecting, if asked to do that
+	s->reconnect_min = TWIRC_RECONNECT_MIN;
+	s->reconnect_max = TWIRC_RECONNECT_MAX;
+
+	// Keep the connection in check like this, if asked to do that
+	s->keepalive_idle    = TWIRC_KEEPALIVE_IDLE;
+	s->keepalive_timeout = TWIRC_KEEPALIVE_TIMEOUT;
 	
 	// Initialize the buffer - it will be twice the message size so it can
 	// easily hold an incomplete message in addition to a complete one
-	s->buffer = malloc(2 * TWIRC_MESSAGE_SIZE * sizeof(char));
+	s->buffer = malloc(TWIRC_RECV_SIZE * sizeof(char));
 	if (s->buffer == NULL) { return NULL; } 
 	s->buffer[0] = '\0';
+	s->buf_head = 0;
+	s->buf_scan = 0;
+	s->buf_tail = 0;
+	s->buf_skip = 0;
+
+	// Initialize the array that epoll_pwait() will report events in
+	s->max_events = TWIRC_MAX_EVENTS;
+	s->events = malloc(s->max_events * sizeof(struct epoll_event));
+	if (s->events == NULL)
+	{
+		free(s->buffer);
+		free(s);
+		return NULL;
+	}
+
+	// Set up the signals to be blocked while waiting for events once, 
+	// instead of every time twirc_tick() is called
+	libtwirc_init_sigmask(&s->sigmask);
+
+	// Set up the rate limiter with Twitch's default limits
+	libtwirc_init_limits(s);
+
+	// Initialize the arena that holds the memory for event handling
+	if (libtwirc_arena_init(&s->arena, TWIRC_ARENA_SIZE) == -1)
+	{
+		free(s->events);
+		free(s->buffer);
+		free(s);
+		return NULL;
+	}
+
+	// Set up the inbox for messages sent from other threads
+	if (libtwirc_inbox_init(s) == -1)
+	{
+		libtwirc_arena_free(&s->arena);
+		free(s->events);
+		free(s->buffer);
+		free(s);
+		return NULL;
+	}
+
+	// No timers yet; the wheel only gets going once there are some
+	libtwirc_wheel_init(&s->wheel);
 
 	// Make sure the structs within state are zero-initialized
 	memset(&s->login, 0, sizeof(twirc_login_t));
@@ -287,10 +427,25 @@ void libtwirc_free_login(twirc_state_t *s)
  */
 void twirc_free(twirc_state_t *s)
 {
-	close(s->epfd);
+	libtwirc_handover_free(s);
+	if (s->reactor != NULL)
+	{
+		twirc_reactor_remove(s->reactor, s);
+	}
+	if (s->epfd >= 0)
+	{
+		close(s->epfd);
+	}
 	libtwirc_free_callbacks(s);
 	libtwirc_free_login(s);
 	free(s->buffer);
+	free(s->events);
+	free(s->sendq);
+	libtwirc_clear_held(s);
+	libtwirc_free_chans(s);
+	libtwirc_free_inbox(s);
+	libtwirc_free_timers(s);
+	libtwirc_arena_free(&s->arena);
 	free(s);
 	s = NULL;
 }
@@ -308,243 +463,65 @@ void twirc_kill(twirc_state_t *s)
 	twirc_free(s);
 }
 
-/*
- * Copies a portion of src to dest. The copied part will start from the offset
- * given in off and end at the next null terminator encountered, but at most 
- * slen bytes. It is essential for slen to be correctly provided, as this 
- * function is supposed to handle src strings that were network-transmitted and
- * might not be null-terminated. The copied string will be null terminated, even
- * if no null terminator was read from src. If dlen is not sufficient to store 
- * the copied string plus the null terminator, or if the given offset points to 
- * the end or beyond src, -1 is returned. Returns the number of bytes copied + 1, 
- * so this value can be used as an offset for successive calls of this function, 
- * or slen if all chunks have been read. 
- */
-size_t libtwirc_next_chunk(char *dest, size_t dlen, const char *src, size_t slen, size_t off)
-{
-	/*
-	 | recv() 1    | recv() 2       |
-	 |-------------|----------------|
-	 | SOMETHING\r | \n\0ELSE\r\n\0 |
-	
-	 chunk 1 -> SOMETHING\0
-	 chunk 2 -> \0
-	 chunk 3 -> ELSE\0
-	
-	 | recv(1)     | recv() 2      |
-	 |-------------|---------------|
-	 | SOMETHING\r | \nSTUFF\r\n\0 |
-	
-	 chunk 1 -> SOMETHING\0
-	 chunk 2 -> \nSTUFF\0
-	*/
-	
-	// Determine the maximum number of bytes we'll have to read
-	size_t chunk_len = slen - off;
-	
-	// Invalid offset (or maybe we're just done reading src)
-	if (chunk_len <= 0)
-	{
-		return -1;
-	}
-	
-	// Figure out the maximum size we can read
-	size_t max_len = dlen < chunk_len ? dlen : chunk_len;
-	
-	// Copy everything from offset to (and including) the next null terminator
-	// but at most max_len bytes (important if there is no null terminator)
-	strncpy(dest, src + off, max_len); 
-	
-	// Check how much we've actually written to the dest buffer
-	size_t cpy_len = strnlen(dest, max_len);
-	
-	// Check if we've entirely filled the buffer (no space for \0)
-	if (cpy_len == dlen)
-	{
-		dest[0] = '\0';
-		return -1;
-	}
-	
-	// Make sure there is a null terminator at the end, even if
-	// there was no null terminator in the copied string
-	dest[cpy_len] = '\0';
-	
-	// Calculate the offset to the next chunk (+1 to skip null terminator)
-	size_t new_off = off + cpy_len + 1;
-	
-	// Return slen if we've read all data, otherwise the offset to the next chunk
-	return new_off >= slen ? slen : new_off;
-}
-	
-
-/*
- * Finds the first occurrence of the sep string in src, then copies everything 
- * that is found before the separator into dest. The extracted part and the 
- * separator will be removed from src. Note that this function will by design
- * not extract the last token, unless it also ends in the given separator.
- * This is so because it was designed to extract complete IRC messages from a 
- * string containing multiple of those, where the last one might be incomplete.
- * Only extracting tokens that _end_ in the separator guarantees that we will
- * only extract complete IRC messages and leave incomplete ones in src.
- *
- * Returns the size of the copied string, or 0 if the separator could not be 
- * found in the src string.
- */
-size_t libtwirc_shift_token(char *dest, char *src, const char *sep)
-{
-	// Find the first occurence of the separator
-	char *sep_pos = strstr(src, sep);
-	if (sep_pos == NULL)
-	{
-		return 0;
-	}
-
-	// Figure out the length of the token etc
-	size_t sep_len = strlen(sep);
-	size_t new_len = strlen(sep_pos) - sep_len;
-	size_t tok_len = sep_pos - src;
-	
-	// Copy the token to the dest buffer
-	strncpy(dest, src, tok_len);
-	dest[tok_len] = '\0';
-
-	// Remove the token from src
-	memmove(src, sep_pos + sep_len, new_len); 
-
-	// Make sure src is null terminated again
-	src[new_len] = '\0';
-
-	return tok_len;
-}
-
 /*
  * Takes an escaped string (as described in the IRCv3 spec, section tags)
- * and returns a pointer to a malloc'd string that holds the unescaped string.
- * Remember that the returned pointer has to be free'd by the caller!
- * TODO: THIS CAN SEGFAULT! FIX IT!
- * TODO: ^- regarding above comment, I think we fixed the segfault and simply
- *          forgot to remove the comment... but not sure, so please re-check.
+ * and unescapes it in place. Every escape sequence is two characters long 
+ * and will be replaced with a single character, so the unescaped string can
+ * never be longer than the escaped one; hence, no memory has to be allocated.
+ * Returns a pointer to str.
  */
-char *libtwirc_unescape(const char *str)
+char *libtwirc_unescape(char *str)
 {
-	size_t str_len = strlen(str);
-	char *unescaped = malloc((str_len + 1) * sizeof(char));
-	if (unescaped == NULL) { return NULL; }
-
 	int u = 0;
-	for (int i = 0; i < (int) str_len; ++i)
+	for (int i = 0; str[i] != '\0'; ++i)
 	{
 		if (str[i] == '\\')  
 		{
 			if (str[i+1] == ':') // "\:" -> ";"
 			{
-				unescaped[u++] = ';';
+				str[u++] = ';';
 				++i;
 				continue;
 			}
 			if (str[i+1] == 's') // "\s" -> " ";
 			{
-				unescaped[u++] = ' ';
+				str[u++] = ' ';
 				++i;
 				continue;
 			}
 			if (str[i+1] == '\\') // "\\" -> "\";
 			{
-				unescaped[u++] = '\\';
+				str[u++] = '\\';
 				++i;
 				continue;
 			}
 			if (str[i+1] == 'r') // "\r" -> '\r' (CR)
 			{
-				unescaped[u++] = '\r';
+				str[u++] = '\r';
 				++i;
 				continue;
 			}
 			if (str[i+1] == 'n') // "\n" -> '\n' (LF)
 			{
-				unescaped[u++] = '\n';
+				str[u++] = '\n';
 				++i;
 				continue;
 			}
 		}
-		unescaped[u++] = str[i];
+		str[u++] = str[i];
 	}
-	unescaped[u] = '\0';
-	return unescaped;
-}
-
-/*
- * Dynamically allocates a twirc_tag_t from the given key and value strings.
- * Returns NULL if memory allocation failed or the given key was NULL or an
- * empty string, otherwise a pointer to the created tag. If the given value 
- * was NULL, it will be set to an empty string. Both key and value are also 
- * dynamically allocated and need to be free'd by the caller at some point.
- */
-twirc_tag_t *libtwirc_create_tag(const char *key, const char *val)
-{
-	// Key can't be NULL or empty
-	if (key == NULL || strlen(key) == 0)
-	{
-		return NULL;
-	}
-	
-	// Allocate memory
-	twirc_tag_t *tag = malloc(sizeof(twirc_tag_t));
-
-	// Check if allocation worked
-	if (tag == NULL) {
-		return NULL;
-	}
-
-	// Set key and value; if value was NULL, set it to empty string
-	tag->key   = strdup(key);
-	tag->value = val == NULL ? strdup("") : libtwirc_unescape(val);
-
-	return tag;
-}
-
-void libtwirc_free_tag(twirc_tag_t *tag)
-{
-	free(tag->key);
-	free(tag->value);
-}
-
-void libtwirc_free_tags(twirc_tag_t **tags)
-{
-	if (tags == NULL)
-	{
-		return;
-	}
-	for (int i = 0; tags[i] != NULL; ++i)
-	{
-		libtwirc_free_tag(tags[i]);
-		free(tags[i]);
-		tags[i] = NULL;
-	}
-}
-
-void libtwirc_free_params(char **params)
-{
-	if (params == NULL)
-	{
-		return;
-	}
-	for (int i = 0; params[i] != NULL; ++i)
-	{
-		free(params[i]);
-		params[i] = NULL;
-	}
-	//free(params);
+	str[u] = '\0';
+	return str;
 }
 
 /*
  * Extracts the nickname from an IRC message's prefix, if any. Done this way:
  * Searches prefix for an exclamation mark ('!'). If there is one, everything 
- * before it will be returned as a pointer to an allocated string (malloc), so
- * the caller has to free() it at some point. If there is no exclamation mark 
- * in prefix or prefix is NULL or we're out of memory, NULL will be returned.
+ * before it will be copied to nick, which has to be able to hold len bytes;
+ * longer nicks will be truncated. Returns a pointer to nick or NULL if there
+ * is no exclamation mark in prefix or prefix is NULL.
  */
-char *libtwirc_parse_nick(const char *prefix)
+char *libtwirc_parse_nick(const char *prefix, char *nick, size_t len)
 {
 	// Nothing to do if nothing has been handed in
 	if (prefix == NULL)
@@ -553,31 +530,50 @@ char *libtwirc_parse_nick(const char *prefix)
 	}
 	
 	// Search for an exclamation mark in prefix
-	char *sep = strstr(prefix, "!");
+	char *sep = strchr(prefix, '!');
 	if (sep == NULL)
 	{
 		return NULL;
 	}
 	
-	// Return the nick as malloc'd string
-	size_t len = sep - prefix;
-	return strndup(prefix, len);
+	// Copy the nick, truncating it if need be
+	size_t nick_len = sep - prefix;
+	if (nick_len >= len)
+	{
+		nick_len = len - 1;
+	}
+	memcpy(nick, prefix, nick_len);
+	nick[nick_len] = '\0';
+	return nick;
 }
 
 /*
  * Extracts tags from the beginning of an IRC message, if any, and returns them
- * as a pointer to a dynamically allocated array of twirc_tag structs, where 
- * each struct contains two members, key and value, representing the key and 
- * value of a tag, respectively. The value member of a tag can be empty string 
- * for key-only tags. The last element of the array will be a NULL pointer, so 
+ * as a pointer to an array of pointers to twirc_tag structs, where each struct
+ * contains two members, key and value, representing the key and value of a 
+ * tag, respectively. The value member of a tag can be empty string for 
+ * key-only tags. The last element of the array will be a NULL pointer, so 
  * you can loop over all tags until you hit NULL. The number of extracted tags
  * is returned in len. If no tags have been found at the beginning of msg, tags
  * will be NULL, len will be 0 and this function will return a pointer to msg.
  * Otherwise, a pointer to the part of msg after the tags will be returned. 
  *
+ * The tags are sliced out of msg in place: separators are overwritten with 
+ * null terminators and values are unescaped in place, so the keys and values
+ * all point into msg. With the TWIRC_OPT_LAZY_TAGS option enabled, values are
+ * left as they are and only marked as escaped, so twirc_tag_value() can 
+ * unescape them when needed. The separators are taken from the delimiter table in 
+ * mem, which has to have been filled for msg. The tag structs are taken from
+ * mem as well, unless there are more than TWIRC_NUM_TAGS of them, in which 
+ * case they will be allocated from the state's arena (and released by 
+ * libtwirc_process_msg()). If that fails, NULL is returned. Additionally, all
+ * tags with well-known keys are put into mem's tag index (by TWIRC_TAG_* key),
+ * which has to be cleared beforehand. If a key appears more than once, the 
+ * index points to its first appearance, just like twirc_get_tag() would.
+ *
  * https://ircv3.net/specs/core/message-tags-3.2.html
  */
-const char *libtwirc_parse_tags(const char *msg, twirc_tag_t ***tags, size_t *len)
+char *libtwirc_parse_tags(twirc_state_t *s, char *msg, twirc_tag_t ***tags, size_t *len, struct libtwirc_evtmem *mem)
 {
 	// If msg doesn't start with "@", then there are no tags
 	if (msg[0] != '@')
@@ -587,81 +583,116 @@ const char *libtwirc_parse_tags(const char *msg, twirc_tag_t ***tags, size_t *le
 		return msg;
 	}
 
-	// Find the next space (the end of the tags string within msg)
-	char *next = strstr(msg, " ");
-	
-	// Duplicate the string from after the '@' until the next space
-	char *tag_str = strndup(msg + 1, next - (msg + 1));
+	struct libtwirc_delims *d = &mem->delims;
 
-	// Set the initial number of tags we want to allocate memory for
-	size_t num_tags = TWIRC_NUM_TAGS;
-	
-	// Allocate memory in the provided pointer to ptr-to-array-of-structs
-	*tags = malloc(num_tags * sizeof(twirc_tag_t*));
+	// Count the tags (semicolons before the first space), so we know if
+	// we can do without allocating memory for them
+	size_t num_tags = 1;
+	for (size_t i = d->cur; i < d->num && d->line[d->pos[i]] != ' '; ++i)
+	{
+		if (d->line[d->pos[i]] == ';')
+		{
+			++num_tags;
+		}
+	}
 
-	char *tag = NULL;
-	int i;
-	for (i = 0; (tag = strtok(i == 0 ? tag_str : NULL, ";")) != NULL; ++i)
+	twirc_tag_t  *tag_buf  = mem->tag_buf;
+	twirc_tag_t **tag_ptrs = mem->tag_ptrs;
+
+	// Too many tags to fit into mem, we need to allocate memory for them;
+	// we do so with one allocation for both the structs and the pointers
+	if (num_tags > TWIRC_NUM_TAGS)
 	{
-		// Make sure we have enough space; last element has to be NULL
-		if (i >= num_tags - 1)
+		tag_buf = libtwirc_alloc(s, num_tags * sizeof(twirc_tag_t) +
+				(num_tags + 1) * sizeof(twirc_tag_t*));
+		if (tag_buf == NULL)
 		{
-			size_t add = (size_t) (num_tags / 2);
-			num_tags += add;
-			*tags = realloc(*tags, num_tags * sizeof(twirc_tag_t*));
+			*len = 0;
+			*tags = NULL;
+			return NULL;
 		}
+		tag_ptrs = (twirc_tag_t **) (tag_buf + num_tags);
+	}
 
-		char *eq = strstr(tag, "=");
+	size_t i = 0;
+	char *key = msg + 1;  // Start of the current tag
+	char *eq  = NULL;     // First '=' in the current tag, if any
+	int lazy  = twirc_get_option(s, TWIRC_OPT_LAZY_TAGS);
+	char end  = ';';      // Delimiter that ended the current tag
 
-		// It's a key-only tag, like "foo" (never seen that on Twitch)
-		// Hence, we didn't find a '=' at all 
-		if (eq == NULL)
+	while (end == ';')
+	{
+		// Get the next delimiter; if we run out of them, the tags are 
+		// all there is to this message, so they end with msg itself
+		char *delim = d->cur < d->num ? 
+			d->line + d->pos[d->cur++] : key + strlen(key);
+
+		// Remember the first '=' only, the value might contain more
+		if (delim[0] == '=')
 		{
-			// TODO we should check for libtwirc_create_tag()
-			// 	returning NULL and act accordingly
-			(*tags)[i] = libtwirc_create_tag(tag, NULL);
+			if (eq == NULL)
+			{
+				eq = delim;
+			}
+			continue;
 		}
-		// It's either a key-only tag with a trailing '=' ("foo=")
-		// or a tag with key-value pair, like "foo=bar"
-		else
+
+		// It's a ';' (more tags to come), ' ' or '\0' (last tag);
+		// either way, it's the end of this tag, so we terminate it
+		end = delim[0];
+		delim[0] = '\0';
+
+		// If there is a '=', turn it into '\0' to separate key and 
+		// value; if there is none, it's a key-only tag (never seen
+		// that on Twitch), so we use the key's '\0' as empty value
+		if (eq != NULL)
 		{
-			// Turn the '=' into '\0' to separate key and value
-			eq[0] = '\0'; // Turn the '=' into '\0'
-			
-			// TODO we should check for libtwirc_create_tag()
-			// 	returning NULL and act accordingly
-			(*tags)[i] = libtwirc_create_tag(tag, eq+1);
+			eq[0] = '\0';
 		}
 
-		//fprintf(stderr, ">>> TAG %d: %s = %s\n", i, (*tags)[i]->key, (*tags)[i]->value);
-	}
+		// Key can't be empty, we skip those
+		if (key[0] != '\0')
+		{
+			// Add well-known keys to the index, first come first serve
+			int id = libtwirc_tag_key_id(key, (eq ? eq : delim) - key);
+			if (id != TWIRC_TAG_UNKNOWN && mem->tag_index[id] == NULL)
+			{
+				mem->tag_index[id] = &tag_buf[i];
+			}
 
-	// Set the number of tags found
-	*len = i;
+			tag_buf[i].key     = key;
+			tag_buf[i].value   = eq == NULL ? delim : eq + 1;
+			tag_buf[i].escaped = eq != NULL && lazy;
+			if (eq != NULL && !lazy)
+			{
+				libtwirc_unescape(tag_buf[i].value);
+			}
+			tag_ptrs[i] = &tag_buf[i];
+			++i;
+		}
 
-	free(tag_str);
-	
-	// Trim this down to the exact right size
-	if (i < num_tags - 1)
-	{
-		*tags = realloc(*tags, (i + 1) * sizeof(twirc_tag_t*));
+		key = delim + 1;
+		eq  = NULL;
 	}
 
 	// Make sure the last element is a NULL ptr
-	(*tags)[i] = NULL;
+	tag_ptrs[i] = NULL;
+
+	// Set the tags and the number of tags found
+	*tags = tag_ptrs;
+	*len = i;
 
 	// Return a pointer to the remaining part of msg
-	return next + 1;
+	return end == ' ' ? key : key - 1;
 }
 
 /*
  * Extracts the prefix from the beginning of msg, if there is one. The prefix 
- * will be returned as a pointer to a dynamically allocated string in prefix.
- * The caller needs to make sure to free the memory at some point. If no prefix
- * was found at the beginning of msg, prefix will be NULL. Returns a pointer to
+ * will be sliced out of msg in place and returned in prefix. If no prefix was
+ * found at the beginning of msg, prefix will be NULL. Returns a pointer to
  * the next part of the message, after the prefix.
  */
-const char *libtwirc_parse_prefix(const char *msg, char **prefix)
+char *libtwirc_parse_prefix(char *msg, char **prefix, struct libtwirc_delims *d)
 {
 	if (msg[0] != ':')
 	{
@@ -669,30 +700,54 @@ const char *libtwirc_parse_prefix(const char *msg, char **prefix)
 		return msg;
 	}
 	
-	// Find the next space (the end of the prefix string within msg)
-	char *next = strstr(msg, " ");
+	// The prefix starts after the ':' and ends at the next space
+	*prefix = msg + 1;
 
-	// Duplicate the string from after the ':' until the next space
-	*prefix = strndup(msg + 1, next - (msg + 1));
+	// Find the next space (the end of the prefix string within msg)
+	char *next = libtwirc_next_delim(d, msg, ' ');
+	if (next == NULL)
+	{
+		return msg + strlen(msg);
+	}
 
-	// Return a pointer to the remaining part of msg
+	// Terminate the prefix and return a pointer to the remaining part
+	next[0] = '\0';
 	return next + 1;
 }
 
-const char *libtwirc_parse_command(const char *msg, char **cmd)
+/*
+ * Extracts the command from the beginning of msg. The command will be sliced
+ * out of msg in place and returned in cmd. Returns NULL if the command was the
+ * last bit of msg, otherwise a pointer to the remaining part (the parameters).
+ */
+char *libtwirc_parse_command(char *msg, char **cmd, struct libtwirc_delims *d)
 {
+	// The command starts right away and ends at the next space
+	*cmd = msg;
+
 	// Find the next space (the end of the cmd string withing msg)
-	char *next = strstr(msg, " ");
+	char *next = libtwirc_next_delim(d, msg, ' ');
+	if (next == NULL)
+	{
+		return NULL;
+	}
 
-	// Duplicate the string from start to next space or end of msg
-	*cmd = strndup(msg, next == NULL ? strlen(msg) : next - msg);
-	
-	// Return NULL if cmd was the last bit of msg, or a pointer to
-	// the remaining part (the parameters)
-	return next == NULL ? NULL : next + 1;
+	// Terminate the command and return a pointer to the parameters
+	next[0] = '\0';
+	return next + 1;
 }
 
-const char *libtwirc_parse_params(const char *msg, char ***params, size_t *len, int *t_idx)
+/*
+ * Extracts the parameters from msg, which has to point to the parameter part
+ * of an IRC message, or be NULL if there are none. The parameters are sliced
+ * out of msg in place and returned in params, which will point to the params
+ * array of mem; the last element will be a NULL pointer. The number of params
+ * is returned in len, the index of the trailing parameter in t_idx (or -1 if 
+ * there is no trailing parameter). As per the IRC spec, a message can have at
+ * most 15 parameters; if there are more, the last one will contain the rest.
+ * Always returns NULL, as the parameters are the last part of a message.
+ */
+char *libtwirc_parse_params(char *msg, char ***params, size_t *len, int *t_idx, struct libtwirc_evtmem *mem)
 {
 	if (msg == NULL)
 	{
@@ -702,73 +757,48 @@ const char *libtwirc_parse_params(const char *msg, char ***params, size_t *len,
 		return NULL;
 	}
 
-	// Initialize params to hold TWIRC_NUM_PARAMS pointers to char
-	size_t num_params = TWIRC_NUM_PARAMS;
-	*params = malloc(num_params * sizeof(char*));
-
-	// Copy everything that's left in msg (params are always last)
-	char *p_str = strdup(msg);
-
-	size_t p_len = strlen(p_str);
 	size_t num_tokens = 0;
 	int trailing = 0;
-	int from = 0;
+	char *p = msg;
 
-	for (int i = 0; i < p_len; ++i)
+	while (p[0] != '\0')
 	{
-		// Make sure we have enough space; last element has to be NULL
-		if (num_tokens >= num_params - 1)
-		{
-			size_t add = num_params;
-			num_params += add;
-			*params = realloc(*params, num_params * sizeof(char*));
-		}
-
-		// Prefix of trailing token (ignore if part of trailing token)
-		if (p_str[i] == ':' && !trailing)
+		// Prefix of the trailing token: everything after it is one param
+		if (p[0] == ':')
 		{
-			// Remember that we're in the trailing token
 			trailing = 1;
-			// Set the start position marker to the next char
-			from = i+1;
-			continue;
+			mem->params[num_tokens++] = p + 1;
+			break;
 		}
 
-		// Token separator (ignore if trailing token)
-		if (p_str[i] == ' ' && !trailing)
+		mem->params[num_tokens++] = p;
+
+		// Last param we've got room for, it gets everything that's left
+		if (num_tokens == TWIRC_MAX_PARAMS)
 		{
-			// Copy everything from the beginning to here
-			(*params)[num_tokens++] = strndup(p_str + from, i - from);
-			//fprintf(stderr, "- %s\n", (*params)[num_tokens-1]);
-			// Set the start position marker to the next char
-			from = i+1;
-			continue;
+			break;
 		}
 
-		// We're at the last character (null terminator, hopefully)
-		if (i == p_len - 1)
+		// Token separator; terminate the current token
+		char *next = libtwirc_next_delim(&mem->delims, p, ' ');
+		if (next == NULL)
 		{
-			// Copy everything from the beginning to here + 1
-			(*params)[num_tokens++] = strndup(p_str + from, (i + 1) - from);
-			//fprintf(stderr, "- %s\n", (*params)[num_tokens-1]);
+			break;
 		}
+		next[0] = '\0';
+
+		// Skip additional spaces, if any
+		for (p = next + 1; p[0] == ' '; ++p) { }
 	}
 
+	// Make sure the last element is a NULL ptr
+	mem->params[num_tokens] = NULL;
+
 	// Set index of the trailing parameter, if any, otherwise -1
 	*t_idx = trailing ? num_tokens - 1 : -1;
-	// Set number of tokens (parameters) found and copied
+	// Set number of tokens (parameters) found
 	*len = num_tokens;
-	
-	free(p_str);
-
-	// Trim this down to the exact amount of memory we need
-	if (num_tokens < num_params - 1)
-	{
-		*params = realloc(*params, (num_tokens + 1) * sizeof(char*));
-	}
-	
-	// Make sure the last element is a NULL ptr
-	(*params)[num_tokens] = NULL;
+	*params = mem->params;
 
 	// We've reached the end of msg, so we'll return NULL
 	return NULL;
@@ -778,15 +808,15 @@ const char *libtwirc_parse_params(const char *msg, char ***params, size_t *len,
  * Checks if the event is a CTCP event. If so, strips the CTCP markers (0x01)
  * as well as the CTCP command from the trailing parameter and fills the ctcp
  * member of evt with the CTCP command instead. If it isn't a CTCP command, 
- * this function does nothing.
- * Returns 0 on success, -1 if an error occured (not enough memory).
+ * this function does nothing. All of this happens in place, as both the CTCP
+ * command and the stripped message are part of the trailing parameter anyway.
  */
-int libtwirc_parse_ctcp(twirc_event_t *evt)
+void libtwirc_parse_ctcp(twirc_event_t *evt)
 {
 	// Can't be CTCP if we don't even have enough parameters
 	if (evt->num_params <= evt->trailing)
 	{
-		return 0;
+		return;
 	}
 	
 	// For convenience, get a ptr to the trailing parameter
@@ -795,33 +825,32 @@ int libtwirc_parse_ctcp(twirc_event_t *evt)
 	// First char not 0x01? Not CTCP!
 	if (trailing[0] != 0x01)
 	{
-		return 0;
+		return;
 	}
 	
-	// Last char not 0x01? Not CTCP!
-	int last = strlen(trailing) - 1;
-	if (trailing[last] != 0x01)
+	// Last char not 0x01 (or the same as the first)? Not CTCP!
+	size_t last = strlen(trailing) - 1;
+	if (last == 0 || trailing[last] != 0x01)
 	{
-		return 0;
+		return;
 	}
 
-	// Find the first space within the trailing parameter
-	char *space = strstr(trailing, " ");
-	if (space == NULL) { return -1; }
+	// Strip the closing 0x01, the CTCP command follows the opening one
+	trailing[last] = '\0';
+	evt->ctcp = trailing + 1;
 
-	// Copy the CTCP command
-	evt->ctcp = strndup(trailing + 1, space - (trailing + 1));
-	if (evt->ctcp == NULL) { return -1; }
-	
-	// Strip 0x01
-	char *message = strndup(space + 1, (trailing + last) - (space + 1));
-	if (message == NULL) { return -1; }
-
-	// Free the old trailing parameter, swap in the stripped one
-	free(evt->params[evt->trailing]);
-	evt->params[evt->trailing] = message;
+	// Find the first space, which separates command and message
+	char *space = strchr(evt->ctcp, ' ');
+	if (space == NULL)
+	{
+		// No message at all, use the ctcp's null terminator instead
+		evt->params[evt->trailing] = trailing + last;
+		return;
+	}
 
-	return 0;
+	// Terminate the command, the message is whatever is left
+	space[0] = '\0';
+	evt->params[evt->trailing] = space + 1;
 }
 
 void libtwirc_dispatch_out(twirc_state_t *s, twirc_event_t *evt)
@@ -831,135 +860,112 @@ void libtwirc_dispatch_out(twirc_state_t *s, twirc_event_t *evt)
 }
 
 /*
- * Dispatches the internal and external event handler / callback functions
- * for the given event, based on the command field of evt. Does not handle
- * CTCP events - call libtwirc_dispatch_ctcp() for those instead.
+ * Jump table of the internal event handlers and the offsets of the matching
+ * user callbacks within the twirc_callbacks struct, indexed by the commands'
+ * TWIRC_COMMAND_* constants. Commands without an entry are handled as other.
  */
-void libtwirc_dispatch_evt(twirc_state_t *s, twirc_event_t *evt)
+const struct libtwirc_handler libtwirc_handlers[TWIRC_NUM_COMMANDS] =
 {
-	// TODO try ordering these by "probably usually most frequent", so that
-	// we waste as little CPU cycles as possible on strcmp() here!
-	
-	if (strcmp(evt->command, "PRIVMSG") == 0)
-	{
-		libtwirc_on_privmsg(s, evt);
-		s->cbs.privmsg(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "JOIN") == 0)
-	{
-		libtwirc_on_join(s, evt);
-		s->cbs.join(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "CLEARCHAT") == 0)
-	{
-		libtwirc_on_clearchat(s, evt);
-		s->cbs.clearchat(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "CLEARMSG") == 0)
-	{		
-		libtwirc_on_clearmsg(s, evt);
-		s->cbs.clearmsg(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "NOTICE") == 0)
-	{	
-		libtwirc_on_notice(s, evt);
-		s->cbs.notice(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "ROOMSTATE") == 0)
-	{		
-		libtwirc_on_roomstate(s, evt);
-		s->cbs.roomstate(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "USERSTATE") == 0)
-	{		
-		libtwirc_on_userstate(s, evt);
-		s->cbs.userstate(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "USERNOTICE") == 0)
-	{		
-		libtwirc_on_usernotice(s, evt);
-		s->cbs.usernotice(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "WHISPER") == 0)
-	{
-		libtwirc_on_whisper(s, evt);
-		s->cbs.whisper(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "PART") == 0)
-	{
-		libtwirc_on_part(s, evt);
-		s->cbs.join(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "PING") == 0)
-	{
-		libtwirc_on_ping(s, evt);
-		s->cbs.ping(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "MODE") == 0)
-	{
-		libtwirc_on_mode(s, evt);
-		s->cbs.mode(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "353") == 0 ||
-	    strcmp(evt->command, "366") == 0)
-	{
-		libtwirc_on_names(s, evt);
-		s->cbs.names(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "HOSTTARGET") == 0)
-	{
-		libtwirc_on_hosttarget(s, evt);
-		s->cbs.hosttarget(s, evt);		
-		return;
-	}
-	if (strcmp(evt->command, "CAP") == 0 &&
-	    strcmp(evt->params[0], "*") == 0)
+	[TWIRC_COMMAND_UNKNOWN]         = { libtwirc_on_other,           offsetof(twirc_callbacks_t, other) },
+	[TWIRC_COMMAND_PRIVMSG]         = { libtwirc_on_privmsg,         offsetof(twirc_callbacks_t, privmsg) },
+	[TWIRC_COMMAND_JOIN]            = { libtwirc_on_join,            offsetof(twirc_callbacks_t, join) },
+	[TWIRC_COMMAND_PART]            = { libtwirc_on_part,            offsetof(twirc_callbacks_t, part) },
+	[TWIRC_COMMAND_CLEARCHAT]       = { libtwirc_on_clearchat,       offsetof(twirc_callbacks_t, clearchat) },
+	[TWIRC_COMMAND_CLEARMSG]        = { libtwirc_on_clearmsg,        offsetof(twirc_callbacks_t, clearmsg) },
+	[TWIRC_COMMAND_NOTICE]          = { libtwirc_on_notice,          offsetof(twirc_callbacks_t, notice) },
+	[TWIRC_COMMAND_ROOMSTATE]       = { libtwirc_on_roomstate,       offsetof(twirc_callbacks_t, roomstate) },
+	[TWIRC_COMMAND_USERSTATE]       = { libtwirc_on_userstate,       offsetof(twirc_callbacks_t, userstate) },
+	[TWIRC_COMMAND_USERNOTICE]      = { libtwirc_on_usernotice,      offsetof(twirc_callbacks_t, usernotice) },
+	[TWIRC_COMMAND_WHISPER]         = { libtwirc_on_whisper,         offsetof(twirc_callbacks_t, whisper) },
+	[TWIRC_COMMAND_PING]            = { libtwirc_on_ping,            offsetof(twirc_callbacks_t, ping) },
+	[TWIRC_COMMAND_PONG]            = { libtwirc_on_pong,            offsetof(twirc_callbacks_t, other) },
+	[TWIRC_COMMAND_MODE]            = { libtwirc_on_mode,            offsetof(twirc_callbacks_t, mode) },
+	[TWIRC_COMMAND_CAP]             = { libtwirc_on_capack,          offsetof(twirc_callbacks_t, capack) },
+	[TWIRC_COMMAND_HOSTTARGET]      = { libtwirc_on_hosttarget,      offsetof(twirc_callbacks_t, hosttarget) },
+	[TWIRC_COMMAND_GLOBALUSERSTATE] = { libtwirc_on_globaluserstate, offsetof(twirc_callbacks_t, globaluserstate) },
+	[TWIRC_COMMAND_RECONNECT]       = { libtwirc_on_reconnect,       offsetof(twirc_callbacks_t, reconnect) },
+	[TWIRC_COMMAND_WELCOME]         = { libtwirc_on_welcome,         offsetof(twirc_callbacks_t, welcome) },
+	[TWIRC_COMMAND_NAMREPLY]        = { libtwirc_on_names,           offsetof(twirc_callbacks_t, names) },
+	[TWIRC_COMMAND_ENDOFNAMES]      = { libtwirc_on_names,           offsetof(twirc_callbacks_t, names) },
+	[TWIRC_COMMAND_UNKNOWNCOMMAND]  = { libtwirc_on_invalidcmd,      offsetof(twirc_callbacks_t, invalidcmd) },
+};
+
+/*
+ * Returns the jump table entry for the given event. This is the entry of its
+ * command, unless there is none or the event is a CAP command other than the
+ * "CAP * ACK" we're interested in, in which case it's the one for "other".
+ */
+const struct libtwirc_handler *libtwirc_get_handler(twirc_event_t *evt)
+{
+	const struct libtwirc_handler *h = &libtwirc_handlers[evt->command_id];
+
+	if (evt->command_id == TWIRC_COMMAND_CAP &&
+	    (evt->num_params == 0 || strcmp(evt->params[0], "*") != 0))
 	{
-		libtwirc_on_capack(s, evt);
-		s->cbs.capack(s, evt);
-		return;
+		h = NULL;
 	}
-	if (strcmp(evt->command, "001") == 0)
+
+	return h == NULL || h->handle == NULL ? 
+		&libtwirc_handlers[TWIRC_COMMAND_UNKNOWN] : h;
+}
+
+/*
+ * Returns the user callback function that the given jump table entry refers to.
+ */
+twirc_callback libtwirc_get_callback(twirc_state_t *s, const struct libtwirc_handler *h)
+{
+	return *(twirc_callback *) ((char *) &s->cbs + h->callback);
+}
+
+/*
+ * Calls the user callback cb for the event or, if the state hands its events
+ * off to consumer threads (see twirc_set_handoff()), publishes a copy of the
+ * event for them to call it. Events without a callback aren't handed off, and
+ * neither are the pool's and group's welcome hooks, which have to run right
+ * away. Events that came in more than once, over different connections (see
+ * libtwirc_handover.c and libtwirc_group.c), are only passed on once.
+ */
+void libtwirc_callback(twirc_state_t *s, twirc_callback cb, twirc_event_t *evt)
+{
+	// During a handover, the events of both connections are ours, but 
+	// only once (see libtwirc_handover.c)
+	if (s->primary != NULL || s->dedup.slots != NULL)
 	{
-		libtwirc_on_welcome(s, evt);
-		s->cbs.welcome(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "GLOBALUSERSTATE") == 0)
-	{ 
-		libtwirc_on_globaluserstate(s, evt);
-		s->cbs.globaluserstate(s, evt);
-		return;
+		if (!libtwirc_handover_pass(s, evt))
+		{
+			return;
+		}
+		s = s->primary ? s->primary : s;
 	}
-	if (strcmp(evt->command, "421") == 0)
+
+	// Of the legs of a redundancy group, only the first to receive an 
+	// event passes it on (see libtwirc_group.c); the group's welcome hook
+	// has to run for every leg, though
+	if (s->group != NULL && cb != libtwirc_group_on_welcome &&
+	    !libtwirc_group_pass(s, evt))
 	{
-		libtwirc_on_invalidcmd(s, evt);
-		s->cbs.invalidcmd(s, evt);
 		return;
 	}
-	if (strcmp(evt->command, "RECONNECT") == 0)
+
+	if (s->handoff == NULL || cb == libtwirc_on_null || 
+	    cb == libtwirc_pool_on_welcome || cb == libtwirc_group_on_welcome)
 	{
-		libtwirc_on_reconnect(s, evt);
-		s->cbs.reconnect(s, evt);
+		cb(s, evt);
 		return;
 	}
-	
-	// Some unaccounted-for event occured
-	libtwirc_on_other(s, evt);
-	s->cbs.other(s, evt);
+	libtwirc_handoff_push(s->handoff, s, cb, evt);
+}
+
+/*
+ * Dispatches the internal and external event handler / callback functions
+ * for the given event, based on the command_id field of evt. Does not handle
+ * CTCP events - call libtwirc_dispatch_ctcp() for those instead.
+ */
+void libtwirc_dispatch_evt(twirc_state_t *s, twirc_event_t *evt)
+{
+	const struct libtwirc_handler *h = libtwirc_get_handler(evt);
+	h->handle(s, evt);
+	libtwirc_callback(s, libtwirc_get_callback(s, h), evt);
 }
 
 /*
@@ -972,48 +978,73 @@ void libtwirc_dispatch_ctcp(twirc_state_t *s, twirc_event_t *evt)
 	if (strcmp(evt->ctcp, "ACTION") == 0)
 	{
 		libtwirc_on_action(s, evt);
-		s->cbs.action(s, evt);
+		libtwirc_callback(s, s->cbs.action, evt);
 		return;
 	}
 	
 	// Some unaccounted-for event occured
 	libtwirc_on_other(s, evt);
-	s->cbs.other(s, evt);
+	libtwirc_callback(s, s->cbs.other, evt);
 }
 
 /*
- * Takes a raw IRC message and parses all the relevant information into a 
- * twirc_event struct, then calls upon the functions responsible for the 
- * dispatching of the event to internal and external callback functions.
- * Returns 0 on success, -1 if an out of memory error occured during the
- * parsing/handling of a CTCP event.
+ * Takes a raw IRC message of len bytes (without the \r\n, but null terminated)
+ * and parses all the relevant information into a twirc_event struct, then 
+ * calls upon the functions responsible for the dispatching of the event to 
+ * internal and external callback functions. Parsing happens in place, which
+ * means msg will be modified and the event's members will point into it; 
+ * only the raw member is a copy, as the unmodified message is needed there.
+ * Returns 0 on success, -1 if an out of memory error occured during parsing.
  */
-int libtwirc_process_msg(twirc_state_t *s, const char *msg, int outbound)
+int libtwirc_process_msg(twirc_state_t *s, char *msg, size_t len, int outbound)
 {
-	//fprintf(stderr, "> %s (%zu)\n", msg, strlen(msg));
+	//fprintf(stderr, "> %s (%zu)\n", msg, len);
 
-	int err = 0;
-	twirc_event_t evt = { 0 };
+	// Everything allocated from here on will be released in one go
+	struct libtwirc_mark mark = libtwirc_arena_mark(&s->arena);
 
-	evt.raw = strdup(msg);
+	twirc_event_t evt = { 0 };
+	struct libtwirc_evtmem mem;
+	memset(mem.tag_index, 0, sizeof(mem.tag_index));
+	evt.tag_index = mem.tag_index;
+	mem.decoded.decoded = 0;
+	evt.decoded = &mem.decoded;
+
+	// Copy the unmodified message, as we're about to slice up msg; the
+	// receive buffer only takes lines that fit, so it's never cut short
+	size_t raw_len = len < TWIRC_RECV_SIZE ? len : TWIRC_RECV_SIZE - 1;
+	memcpy(mem.raw, msg, raw_len);
+	mem.raw[raw_len] = '\0';
+	evt.raw = mem.raw;
+
+	// Find all delimiters in one go, so the tokenizers don't have to
+	mem.delims.line = msg;
+	mem.delims.num  = libtwirc_scan(msg, len, " ;= ", mem.delims.pos, TWIRC_RECV_SIZE);
+	mem.delims.cur  = 0;
 
 	// Extract the tags, if any
-	msg = libtwirc_parse_tags(msg, &(evt.tags), &(evt.num_tags));
+	msg = libtwirc_parse_tags(s, msg, &(evt.tags), &(evt.num_tags), &mem);
+	if (msg == NULL)
+	{
+		libtwirc_arena_release(&s->arena, mark);
+		return libtwirc_oom(s);
+	}
 
 	// Extract the prefix, if any
-	msg = libtwirc_parse_prefix(msg, &(evt.prefix));
+	msg = libtwirc_parse_prefix(msg, &(evt.prefix), &mem.delims);
 
-	// Extract the command, always
-	msg = libtwirc_parse_command(msg, &(evt.command));
+	// Extract the command, always, and figure out which one it is
+	msg = libtwirc_parse_command(msg, &(evt.command), &mem.delims);
+	evt.command_id = libtwirc_command_id(evt.command);
 
 	// Extract the parameters, if any
-	msg = libtwirc_parse_params(msg, &(evt.params), &(evt.num_params), &(evt.trailing));
+	msg = libtwirc_parse_params(msg, &(evt.params), &(evt.num_params), &(evt.trailing), &mem);
 
 	// Check for CTCP and possibly modify the event accordingly
-	err = libtwirc_parse_ctcp(&evt);
+	libtwirc_parse_ctcp(&evt);
 
 	// Extract the nick from the prefix, maybe
-	evt.origin = libtwirc_parse_nick(evt.prefix);
+	evt.origin = libtwirc_parse_nick(evt.prefix, mem.origin, TWIRC_NICK_SIZE);
 	
 	if (outbound)
 	{
@@ -1028,93 +1059,134 @@ int libtwirc_process_msg(twirc_state_t *s, const char *msg, int outbound)
 		libtwirc_dispatch_evt(s, &evt);
 	}
 
-	// Free event
-	// TODO: make all of this into a function? libtwirc_free_event()
-	libtwirc_free_params(evt.params);
-	free(evt.params);
-	evt.params = NULL;
-	libtwirc_free_tags(evt.tags);
-	free(evt.tags);
-	evt.tags = NULL;
-	free(evt.raw);
-	free(evt.prefix);
-	free(evt.origin);
-	free(evt.target);
-	free(evt.command);
-	free(evt.ctcp);
+	// Release all memory that has been allocated for this event
+	libtwirc_arena_release(&s->arena, mark);
 
-	return err;
+	return 0;
 }
 
 /*
- * Process the raw IRC data stored in `buf`, which has a size of len bytes.
- * Incomplete commands will be buffered in state->buffer, complete commands 
- * will be processed right away. Returns 0 on success, -1 if out of memory.
+ * Makes sure there is room for more data at the end of the receive buffer. 
+ * If all data in the buffer has been processed, we simply start over at the
+ * beginning. Otherwise, the unprocessed data (an incomplete message) is only
+ * moved to the front of the buffer if the space left at the end drops below 
+ * TWIRC_RECV_MIN. Should the buffer be full with a single, incomplete message
+ * (one that is longer than the buffer), that message will be discarded. 
+ * Returns the number of bytes that can be written at buf_tail.
  */
-int libtwirc_process_data(twirc_state_t *s, const char *buf, size_t len)
+size_t libtwirc_prepare_buffer(twirc_state_t *s)
 {
-	/*
-	    +----------------------+----------------+
-	    |       recv() 1       |    recv() 2    |
-	    +----------------------+----------------+
-	    |USER MYNAME\r\n\0PASSW|ORD MYPASS\r\n\0|
-	    +----------------------+----------------+
-
-	    -> libtwirc_next_chunk() 1.1 => "USER MYNAME\r\n\0"
-	    -> libtwirc_next_chunk() 1.2 => "PASSW\0"
-	    -> libtwirc_next_chunk() 2.1 => "ORD MYPASS\r\n\0"
-	*/
-
-	// A chunk has to be able to hold at least as much data as the buffer
-	// we're working on. This means we'll dynamically allocate the chunk 
-	// buffer to the same size as the handed in buffer, plus one to make
-	// room for a null terminator which might not be present in the data
-	// received, but will definitely be added in the chunk.
-
-	char *chunk = malloc(len + 1);
-	if (chunk == NULL) { return libtwirc_oom(s); }
-	chunk[0] = '\0';
-	int off = 0;
-
-	// Here, we'll get one chunk at a time, where a chunk is a part of the
-	// recieved bytes that ends in a null terminator. We'll add all of the 
-	// extracted chunks to the buffer, which might already contain parts of
-	// an incomplete IRC command. The buffer needs to be sufficiently big 
-	// to contain more than one delivery in case one of them is incomplete,
-	// but the next one is complete and adds the missing pieces of the 
-	// previous one.
-
-	while ((off = libtwirc_next_chunk(chunk, len + 1, buf, len, off)) > 0)
+	// Everything has been processed, start over at the beginning
+	if (s->buf_head == s->buf_tail)
 	{
-		// Concatenate the current buffer and the newly extracted chunk
-		strcat(s->buffer, chunk);
+		s->buf_head = 0;
+		s->buf_scan = 0;
+		s->buf_tail = 0;
 	}
-
-	free(chunk);
-
-	// Here, we're lookin at each IRC command in the buffer. We do so by 
-	// getting the string from the beginning of the buffer that ends in 
-	// '\r\n', if any. This string will then be deleted from the buffer.
-	// We do this repeatedly until we've extracted all complete commands 
-	// from the buffer. If the last bit of the buffer was an incomplete 
-	// command (did not end in '\r\n'), it will be left in the buffer. 
-	// Hopefully, successive recv() calls will bring in the missing pieces.
-	// If not, we will run into issues, as the buffer could silently and 
-	// slowly fill up until it finally overflows. TODO: test for that?
 	
-	char msg[TWIRC_MESSAGE_SIZE];
-	msg[0] = '\0';
+	// Running out of space at the end, but there is some at the front
+	if (TWIRC_RECV_SIZE - s->buf_tail < TWIRC_RECV_MIN && s->buf_head > 0)
+	{
+		size_t len = s->buf_tail - s->buf_head;
+		memmove(s->buffer, s->buffer + s->buf_head, len);
+		s->buf_scan -= s->buf_head;
+		s->buf_tail -= s->buf_head;
+		s->buf_head  = 0;
+	}
 
-	while (libtwirc_shift_token(msg, s->buffer, "\r\n") > 0)
+	// Buffer is full, but doesn't contain a complete message; this is 
+	// one mighty long message, which we'll have to drop, unfortunately
+	if (s->buf_tail == TWIRC_RECV_SIZE - 1)
 	{
-		// Process the message and check if we ran out of memory doing so
-		if (libtwirc_process_msg(s, msg, 0) == -1)
+		s->buf_head = 0;
+		s->buf_scan = 0;
+		s->buf_tail = 0;
+		s->buf_skip = 1;
+	}
+
+	// Leave room for the null terminator added by libtwirc_recv()
+	return TWIRC_RECV_SIZE - s->buf_tail;
+}
+
+/*
+ * Processes the raw IRC data that has been received into the state's receive
+ * buffer but not yet processed. Every byte is only looked at once in order to
+ * find the '\r\n' at the end of the messages (see libtwirc_scan()); for each
+ * complete message, the '\r' will be replaced with a null terminator and the
+ * message will then be parsed and processed right there, in the buffer. If 
+ * the last bit of data is an incomplete message, it will stay in the buffer
+ * and will be completed by successive recv() calls. Returns 0 on success, -1
+ * if out of memory.
+ */
+int libtwirc_process_data(twirc_state_t *s)
+{
+	int err = 0;
+	size_t num_lf = 0;
+	uint16_t lf[TWIRC_SCAN_LINES];
+
+	// Everything the callbacks send goes out in one go, once we're done
+	twirc_batch_begin(s);
+
+	do
+	{
+		// Find the line feeds in the data we haven't scanned yet
+		size_t from = s->buf_scan;
+		num_lf = libtwirc_scan(s->buffer + from, s->buf_tail - from,
+				"\n\n\n\n", lf, TWIRC_SCAN_LINES);
+
+		// If we've found as many as we can take, there might be more
+		// after the last one; otherwise, everything has been scanned
+		s->buf_scan = num_lf == TWIRC_SCAN_LINES ?
+			from + lf[num_lf - 1] + 1 : s->buf_tail;
+
+		for (size_t i = 0; i < num_lf; ++i)
 		{
-			return -1;
+			size_t end = from + lf[i];
+
+			// Only "\r\n" terminates a message, a lone '\n' doesn't
+			if (end == s->buf_head || s->buffer[end - 1] != '\r')
+			{
+				continue;
+			}
+			s->buffer[end - 1] = '\0';
+
+			// Skip the rest of a message that was too long for the buffer
+			if (s->buf_skip)
+			{
+				s->buf_skip = 0;
+			}
+			// Process the message and check if we ran out of memory 
+			else if (libtwirc_process_msg(s, s->buffer + s->buf_head, 
+					(end - 1) - s->buf_head, 0) == -1)
+			{
+				err = -1;
+			}
+
+			// The next message starts right after the '\n'
+			s->buf_head = end + 1;
 		}
 	}
-	
-	return 0;
+	while (num_lf == TWIRC_SCAN_LINES);
+
+	twirc_batch_end(s);
+	return err;
+}
+
+/*
+ * Calls the internal and external disconnect event handlers, now that the 
+ * connection has been lost, and returns -1. If we were about to hand over to
+ * a new connection (see TWIRC_OPT_HANDOVER), that one takes over right now 
+ * instead, and 0 is returned.
+ */
+int libtwirc_disconnected(twirc_state_t *s)
+{
+	if (s->successor != NULL && libtwirc_handover_switch(s) == 0)
+	{
+		return 0;
+	}
+	libtwirc_on_disconnect(s);
+	s->cbs.disconnect(s, NULL);
+	return -1;
 }
 
 /*
@@ -1127,32 +1199,59 @@ int libtwirc_handle_event(twirc_state_t *s, struct epoll_event *epev)
 	// We've got data coming in
 	if(epev->events & EPOLLIN)
 	{
-		char buf[TWIRC_BUFFER_SIZE];
 		int bytes_received = 0;
+		size_t budget = s->reactor ? s->reactor->budget : 0;
+		size_t total  = 0;
 		
-		// Fetch and process all available data from the socket
-		while ((bytes_received = libtwirc_recv(s, buf, TWIRC_BUFFER_SIZE)) > 0)
+		// Fetch and process all available data from the socket; the data
+		// is read straight into the free space at the end of the buffer.
+		// If we are driven by a reactor, we only read as much as our read
+		// budget allows, then we get back in line behind the others
+		while (1)
 		{
+			if (budget && total >= budget)
+			{
+				libtwirc_reactor_defer(s->reactor, s);
+				break;
+			}
+
+			size_t space = libtwirc_prepare_buffer(s);
+			bytes_received = libtwirc_recv(s, s->buffer + s->buf_tail, space);
+			if (bytes_received <= 0)
+			{
+				break;
+			}
+			s->buf_tail += bytes_received;
+			total += bytes_received;
+
 			// Process the data and check if we ran out of memory doing so
-			if (libtwirc_process_data(s, buf, bytes_received) == -1)
+			if (libtwirc_process_data(s) == -1)
 			{
 				s->error = TWIRC_ERR_OUT_OF_MEMORY;
 				return -1;
 			}
 		}
 		
+		// Proof of life (see TWIRC_OPT_KEEPALIVE)
+		if (total > 0)
+		{
+			s->last_recv = libtwirc_now();
+		}
+
 		// If twirc_recv() returned -1, the connection is probably down,
 		// either way, we  have a serious issue and should stop running!
 		if (bytes_received == -1)
 		{
 			s->error = TWIRC_ERR_SOCKET_RECV;
 			
-			// We were connected but now seem to be disconnected?
-			if (twirc_is_connected(s) && tcpsock_status(s->socket_fd) == -1)
+			// We were connected but now seem to be disconnected? If
+			// we were still connecting, the attempt failed for sure
+			// (and recv() took the socket's error, so don't ask)
+			if (twirc_is_connecting(s) || (twirc_is_connected(s) &&
+			    tcpsock_status(s->socket_fd) == -1))
 			{
 				// If so, call the disconnect event handlers
-				libtwirc_on_disconnect(s);
-				s->cbs.disconnect(s, NULL);
+				return libtwirc_disconnected(s);
 			}
 			return -1;
 		}
@@ -1169,33 +1268,43 @@ int libtwirc_handle_event(twirc_state_t *s, struct epoll_event *epev)
 			libtwirc_on_connect(s);
 			s->cbs.connect(s, NULL);
 		}
+
+		// Send whatever has been queued up while we couldn't; if this 
+		// fails, the error field is set and the connection is probably
+		// down, which we'll find out below
+		libtwirc_flush(s);
+
+		// Held back messages that didn't fit into the send queue can
+		// have another go (see libtwirc_release_held())
+		s->held_stuck = 0;
+
+		// Messages from other threads that had to wait for the send
+		// queue to clear can go now (see libtwirc_drain_inbox())
+		if (s->inbox_next != NULL && s->sendq_tail == s->sendq_head)
+		{
+			libtwirc_drain_inbox(s);
+		}
 	}
 	
 	// Server closed the connection
 	if (epev->events & EPOLLRDHUP)
 	{
 		s->error = TWIRC_ERR_CONN_CLOSED;
-		libtwirc_on_disconnect(s);
-		s->cbs.disconnect(s, NULL);
-		return -1;
+		return libtwirc_disconnected(s);
 	}
 	
 	// Unexpected hangup on socket 
 	if (epev->events & EPOLLHUP) // fires even if not added explicitly
 	{
 		s->error = TWIRC_ERR_CONN_HANGUP;
-		libtwirc_on_disconnect(s);
-		s->cbs.disconnect(s, NULL);
-		return -1;
+		return libtwirc_disconnected(s);
 	}
 
 	// Socket error
 	if (epev->events & EPOLLERR) // fires even if not added explicitly
 	{
 		s->error = TWIRC_ERR_CONN_SOCKET;
-		libtwirc_on_disconnect(s);
-		s->cbs.disconnect(s, NULL);
-		return -1;
+		return libtwirc_disconnected(s);
 	}
 	
 	// Handled everything and no disconnect/error occurred
@@ -1203,37 +1312,59 @@ int libtwirc_handle_event(twirc_state_t *s, struct epoll_event *epev)
 }
 
 /*
- * Sends data to the IRC server, using the state's socket.
- * On success, returns the number of bytes sent.
- * On error, -1 is returned and errno is set appropriately.
+ * Sends the message to the IRC server, using the state's socket, after adding
+ * the "\r\n" every IRC message needs to end with. If the socket isn't ready
+ * to take all of it right now, the rest will be queued and sent as soon as 
+ * possible (see libtwirc_writev()); if the rate limits don't allow sending it
+ * right now, it will be held back (see libtwirc_write_limited()). Returns 0 
+ * if the message has been sent, queued or held back, -1 on error (check the
+ * state's error field and errno).
  */
 int libtwirc_send(twirc_state_t *s, const char *msg)
 {
+	// Called from a thread other than the one driving us, so we'll have
+	// to leave the actual sending to that one (see libtwirc_async.c)
+	if ((s->options & TWIRC_OPT_THREADSAFE) && !libtwirc_in_tick(s))
+	{
+		return libtwirc_send_async(s, msg);
+	}
+
 	// Get the actual message length (without null terminator)
 	// If the message is too big for the message buffer, we only
 	// grab as much as we can fit in our buffer (we truncate)
 	size_t msg_len = strnlen(msg, TWIRC_BUFFER_SIZE - 3);
 
-	// Create a perfectly sized buffer (max TWIRC_BUFFER_SIZE)
-	size_t buf_len = msg_len + 3;
-	char *buf = malloc(buf_len * sizeof(char));
+	// Actually send (or queue) the message, unless the rate limits don't 
+	// allow that right now; the "\r\n" will be added along the way
+	int ret = libtwirc_write_limited(s, msg, msg_len);
 
-	// Copy the user's message into our slightly larger buffer
-	snprintf(buf, buf_len, "%s", msg);
+	// Hand the message, as is, to the raw outbound callback
+	s->cbs.outbound_raw(s, msg, msg_len);
 
-	// Use the additional space for line and null terminators
-	// IRC messages need to be CR-LF (\r\n) terminated!
-	buf[msg_len+0] = '\r';
-	buf[msg_len+1] = '\n';
-	buf[msg_len+2] = '\0';
+	// Parsing the message into an event costs about as much as sending it,
+	// so we only do that if someone is actually interested in the event
+	if (s->cbs.outbound == libtwirc_on_null)
+	{
+		return ret;
+	}
 
-	// Actually send the message
-	int ret = tcpsock_send(s->socket_fd, buf, buf_len);
-	
-	// Dispatch the outgoing event
-	libtwirc_process_msg(s, msg, 1);
+	// Dispatch the outgoing event; the parser slices up the message it is 
+	// given, so it gets a copy, which only lives until the event has been
+	// dispatched, hence we take the memory for it from the arena
+	struct libtwirc_mark mark = libtwirc_arena_mark(&s->arena);
+	char *buf = libtwirc_alloc(s, msg_len + 1);
+	if (buf == NULL)
+	{
+		// The message is on its way regardless, so we don't want the 
+		// caller to think it isn't and send it again
+		libtwirc_arena_release(&s->arena, mark);
+		return ret;
+	}
+	memcpy(buf, msg, msg_len);
+	buf[msg_len] = '\0';
+	libtwirc_process_msg(s, buf, msg_len, 1);
+	libtwirc_arena_release(&s->arena, mark);
 
-	free(buf);
 	return ret;
 }
 
@@ -1269,6 +1400,28 @@ int libtwirc_recv(twirc_state_t *s, char *buf, size_t len)
 }
 
 
+/*
+ * Sets the number of events twirc_tick() can handle in one go, meaning the 
+ * size of the array it hands to epoll_pwait(), to max. Returns 0 on success,
+ * -1 if max is smaller than 1 or memory for the array couldn't be allocated;
+ * in the latter case, the previous array will be kept.
+ */
+int twirc_set_max_events(twirc_state_t *s, int max)
+{
+	if (max < 1)
+	{
+		return -1;
+	}
+	struct epoll_event *events = realloc(s->events, max * sizeof(struct epoll_event));
+	if (events == NULL)
+	{
+		return libtwirc_oom(s);
+	}
+	s->events = events;
+	s->max_events = max;
+	return 0;
+}
+
 /*
  * Waits timeout milliseconds for events to happen on the IRC connection.
  * Returns 0 if all events have been handled and -1 if an error has been 
@@ -1278,30 +1431,34 @@ int libtwirc_recv(twirc_state_t *s, char *buf, size_t len)
  * is up to the user to decide whether they want to disconnect now or keep the
  * connection alive. Remember, however, that messages will keep piling up in 
  * the kernel; if your program is handling very busy channels, you might not 
- * want to stay connected without handling those messages for too long. 
+ * want to stay connected without handling those messages for too long. All 
+ * events that are ready when we wake up will be handled, up to the number 
+ * set with twirc_set_max_events() (TWIRC_MAX_EVENTS by default).
  */
 int twirc_tick(twirc_state_t *s, int timeout)
 {
-	struct epoll_event epev;
-	
-	// epoll_wait()/epoll_pwait() will return -1 if a signal is caught.
-	// User code might catch "harmless" signals, like SIGWINCH, that are
-	// ignored by default. This would then cause epoll_wait() to return
-	// with -1, hence our main loop to come to a halt. This is not what
-	// a user would expect; we should only come to a halt on "serious"
-	// signals that would cause program termination/halt by default.
-	// In order to achieve this, we tell epoll_pwait() to block all of
-	// the signals that are ignored by default. For a list of signals:
-	// https://en.wikipedia.org/wiki/Signal_(IPC)
-	
-	sigset_t sigset;
-	sigemptyset(&sigset);
-	sigaddset(&sigset, SIGCHLD);  // default: ignore
-	sigaddset(&sigset, SIGCONT);  // default: continue execution
-	sigaddset(&sigset, SIGURG);   // default: ignore
-	sigaddset(&sigset, SIGWINCH); // default: ignore
+	// If we are driven by a reactor, it is up to the reactor to wait
+	if (s->reactor != NULL)
+	{
+		return twirc_reactor_tick(s->reactor, timeout);
+	}
 
-	int num_events = epoll_pwait(s->epfd, &epev, 1, timeout, &sigset);
+	// A connection we handed over from can go now (see TWIRC_OPT_HANDOVER)
+	libtwirc_handover_reap(s);
+
+	// Make sure we wake up in time to send held back messages, ours and
+	// those of the connection that's about to take over, if any
+	timeout = libtwirc_limit_timeout(s, timeout);
+	if (s->successor != NULL)
+	{
+		timeout = libtwirc_limit_timeout(s->successor, timeout);
+	}
+
+	// Wait for events, blocking the harmless signals (see above)
+	int num_events = epoll_pwait(s->epfd, s->events, s->max_events, timeout, &s->sigmask);
+
+	// From here on, this thread is the one driving the state
+	const void *prev = libtwirc_tick_begin(s);
 
 	// An error has occured
 	if (num_events == -1)
@@ -1333,19 +1490,33 @@ int twirc_tick(twirc_state_t *s, int timeout)
 		if (twirc_is_connected(s) && tcpsock_status(s->socket_fd) == -1)
 		{
 			// ...if so, call the disconnect event handlers
-			libtwirc_on_disconnect(s);
-			s->cbs.disconnect(s, NULL);
+			libtwirc_disconnected(s);
 		}
+		libtwirc_tick_end(prev);
 		return -1;
 	}
 	
-	// No events have occured
-	if (num_events == 0)
+	// Handle all events that have occured, if any; even if one of them 
+	// leaves us with an error, the others still have to be handled, as 
+	// the timerfd and the inbox's eventfd are edge-triggered and won't be
+	// reported again
+	int ret = 0;
+	for (int i = 0; i < num_events; ++i)
 	{
-		return 0;
+		if (libtwirc_handle_epoll(&s->events[i]) == -1)
+		{
+			ret = -1;
+		}
 	}
 
-	return libtwirc_handle_event(s, &epev);
+	// Send the held back messages that the rate limits now allow
+	libtwirc_release_held(s);
+	if (s->successor != NULL)
+	{
+		libtwirc_release_held(s->successor);
+	}
+	libtwirc_tick_end(prev);
+	return ret;
 }
 
 /*
@@ -1362,7 +1533,11 @@ int twirc_loop(twirc_state_t *s)
 	// so that we stop running after the connection attempt has been going 
 	// on for so-and-so long. Or shall we leave that up to the user code?
 
-	while (twirc_tick(s, -1) == 0)
+	// If we're going to reconnect, losing the connection is no reason to 
+	// stop (see TWIRC_OPT_RECONNECT); otherwise, it is, even if it's been
+	// noticed by a timer rather than twirc_tick() (see TWIRC_OPT_KEEPALIVE)
+	while ((twirc_tick(s, -1) == 0 && s->status != TWIRC_STATUS_DISCONNECTED) ||
+	       twirc_is_reconnecting(s))
 	{
 		// Nothing to do here, actually. :-)
 	}
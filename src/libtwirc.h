@@ -1,6 +1,8 @@
 #ifndef LIBTWIRC_H
 #define LIBTWIRC_H
 
+#include <stdint.h>     // uint64_t
+
 // Name & Version
 #define TWIRC_NAME "libtwirc"
 #define TWIRC_VER_MAJOR 0
@@ -18,6 +20,21 @@
 #define TWIRC_STATUS_AUTHENTICATING  4
 #define TWIRC_STATUS_AUTHENTICATED   8
 
+// Options (bitfield, see twirc_set_option())
+#define TWIRC_OPT_LAZY_TAGS          1 // Unescape tag values on access only
+#define TWIRC_OPT_CORK               2 // Use TCP_CORK for batches
+#define TWIRC_OPT_THREADSAFE         4 // Allow sending from any thread
+#define TWIRC_OPT_RECONNECT          8 // Reconnect and rejoin when connection lost
+#define TWIRC_OPT_HANDOVER          16 // Make-before-break reconnect on RECONNECT
+#define TWIRC_OPT_KEEPALIVE         32 // PING when idle, drop connection if no PONG
+
+// Rate limits (see twirc_set_rate_limit())
+#define TWIRC_LIMIT_PRIVMSG          0 // Chat messages per channel
+#define TWIRC_LIMIT_PRIVMSG_MOD      1 // Chat messages per channel as mod
+#define TWIRC_LIMIT_JOIN             2 // Channels joined
+#define TWIRC_LIMIT_WHISPER          3 // Whispers sent
+#define TWIRC_NUM_LIMITS             4
+
 // Errors
 #define TWIRC_ERR_NONE               0
 #define TWIRC_ERR_OUT_OF_MEMORY     -2
@@ -33,12 +50,104 @@
 #define TWIRC_ERR_CONN_HANGUP      -12 // Connection lost: unexpectedly
 #define TWIRC_ERR_CONN_SOCKET      -13 // Connection lost: socket error
 #define TWIRC_ERR_EPOLL_SIG        -14 // epoll_pwait() caught a signal
+#define TWIRC_ERR_SENDQ_FULL       -15 // Send queue is full, message dropped
+#define TWIRC_ERR_TIMER            -16 // timerfd could not be set up
+#define TWIRC_ERR_CONN_TIMEOUT     -17 // Connection lost: PING not answered
 
 // Maybe we should do this, too:
 // https://github.com/shaoner/libircclient/blob/master/include/libirc_rfcnumeric.h
 // Good source is:
 // https://www.alien.net.au/irc/irc2numerics.html
 
+// Commands (see the command_id member of twirc_event)
+enum twirc_command
+{
+	TWIRC_COMMAND_UNKNOWN,             // Anything not listed below
+	TWIRC_COMMAND_PRIVMSG,
+	TWIRC_COMMAND_JOIN,
+	TWIRC_COMMAND_PART,
+	TWIRC_COMMAND_CLEARCHAT,
+	TWIRC_COMMAND_CLEARMSG,
+	TWIRC_COMMAND_NOTICE,
+	TWIRC_COMMAND_ROOMSTATE,
+	TWIRC_COMMAND_USERSTATE,
+	TWIRC_COMMAND_USERNOTICE,
+	TWIRC_COMMAND_WHISPER,
+	TWIRC_COMMAND_PING,
+	TWIRC_COMMAND_PONG,
+	TWIRC_COMMAND_MODE,
+	TWIRC_COMMAND_CAP,
+	TWIRC_COMMAND_HOSTTARGET,
+	TWIRC_COMMAND_GLOBALUSERSTATE,
+	TWIRC_COMMAND_RECONNECT,
+	TWIRC_COMMAND_NICK,
+	TWIRC_COMMAND_PASS,
+	TWIRC_COMMAND_QUIT,
+	TWIRC_COMMAND_WELCOME,             // 001
+	TWIRC_COMMAND_YOURHOST,            // 002
+	TWIRC_COMMAND_CREATED,             // 003
+	TWIRC_COMMAND_MYINFO,              // 004
+	TWIRC_COMMAND_NAMREPLY,            // 353
+	TWIRC_COMMAND_ENDOFNAMES,          // 366
+	TWIRC_COMMAND_MOTD,                // 372
+	TWIRC_COMMAND_MOTDSTART,           // 375
+	TWIRC_COMMAND_ENDOFMOTD,           // 376
+	TWIRC_COMMAND_UNKNOWNCOMMAND,      // 421
+	TWIRC_NUM_COMMANDS                 // Number of commands, keep last!
+};
+
+// Well-known tag keys (see twirc_get_tag_fast())
+enum twirc_tag_key
+{
+	TWIRC_TAG_UNKNOWN,                 // Anything not listed below
+	TWIRC_TAG_BADGE_INFO,
+	TWIRC_TAG_BADGES,
+	TWIRC_TAG_BAN_DURATION,
+	TWIRC_TAG_BITS,
+	TWIRC_TAG_BROADCASTER_LANG,
+	TWIRC_TAG_CLIENT_NONCE,
+	TWIRC_TAG_COLOR,
+	TWIRC_TAG_DISPLAY_NAME,
+	TWIRC_TAG_EMOTE_ONLY,
+	TWIRC_TAG_EMOTE_SETS,
+	TWIRC_TAG_EMOTES,
+	TWIRC_TAG_FIRST_MSG,
+	TWIRC_TAG_FLAGS,
+	TWIRC_TAG_FOLLOWERS_ONLY,
+	TWIRC_TAG_ID,
+	TWIRC_TAG_LOGIN,
+	TWIRC_TAG_MOD,
+	TWIRC_TAG_MSG_ID,
+	TWIRC_TAG_MSG_PARAM_CUMULATIVE_MONTHS,
+	TWIRC_TAG_MSG_PARAM_DISPLAY_NAME,
+	TWIRC_TAG_MSG_PARAM_LOGIN,
+	TWIRC_TAG_MSG_PARAM_MONTHS,
+	TWIRC_TAG_MSG_PARAM_RECIPIENT_DISPLAY_NAME,
+	TWIRC_TAG_MSG_PARAM_RECIPIENT_ID,
+	TWIRC_TAG_MSG_PARAM_RECIPIENT_USER_NAME,
+	TWIRC_TAG_MSG_PARAM_RITUAL_NAME,
+	TWIRC_TAG_MSG_PARAM_SHOULD_SHARE_STREAK,
+	TWIRC_TAG_MSG_PARAM_STREAK_MONTHS,
+	TWIRC_TAG_MSG_PARAM_SUB_PLAN,
+	TWIRC_TAG_MSG_PARAM_SUB_PLAN_NAME,
+	TWIRC_TAG_MSG_PARAM_VIEWER_COUNT,
+	TWIRC_TAG_R9K,
+	TWIRC_TAG_REPLY_PARENT_MSG_ID,
+	TWIRC_TAG_ROOM_ID,
+	TWIRC_TAG_SLOW,
+	TWIRC_TAG_SUBS_ONLY,
+	TWIRC_TAG_SUBSCRIBER,
+	TWIRC_TAG_SYSTEM_MSG,
+	TWIRC_TAG_TARGET_MSG_ID,
+	TWIRC_TAG_TARGET_USER_ID,
+	TWIRC_TAG_TMI_SENT_TS,
+	TWIRC_TAG_TURBO,
+	TWIRC_TAG_USER_ID,
+	TWIRC_TAG_USER_TYPE,
+	TWIRC_TAG_VIP,
+	TWIRC_NUM_TAG_KEYS                 // Number of keys, keep last and <= 64!
+};
+
 // Message size needs to be large enough to accomodate a single IRC message 
 // from the Twitch servers. Twitch limits the visible chat message part of 
 // an IRC message to 512 bytes (510 without \r\n), but does not seem to take 
@@ -51,15 +160,19 @@
 // message in addition to a complete one.
 #define TWIRC_MESSAGE_SIZE 2048
 
-// The buffer size will be used for retrieving network data via recv(), which 
-// means it could be very small (say, 256 bytes), as we call recv() in a loop
-// until all data has been retrieved and processed. However, this will also 
-// increase the CPU load required; having a larger buffer means we can process 
-// more data in one go, which will improve speed. It seems sensible to choose 
+// The buffer size will be used for assembling the commands we send to the 
+// server. Incoming data, on the other hand, is read straight into the receive
+// buffer of the twirc_state struct (see above). It seems sensible to choose 
 // a size that is at least as large as the MESSAGE buffer (see above) so that
-// we can assure that we will be able to process an entire message in one go.
+// we can assure that we will be able to send an entire message in one go.
 #define TWIRC_BUFFER_SIZE TWIRC_MESSAGE_SIZE
 
+// When joining or leaving lots of channels at once, as many channels as will
+// fit are packed into each JOIN or PART command, comma separated. Other than
+// for incoming messages, we stick to the classic IRC limit of 512 bytes per
+// line (510 without \r\n) here, as that's what servers reliably accept.
+#define TWIRC_MULTI_LINE_SIZE 510
+
 // The prefix is an optional part of every IRC message retrieved from a server.
 // As such, it can never exceed or even reach the size of a message itself.
 // Usually, the prefix is a rather short string, based upon the length of the 
@@ -104,6 +217,71 @@
 // http://www.networksorcery.com/enp/protocol/irc.htm
 #define TWIRC_NUM_PARAMS 4
 
+// The IRC spec limits the number of parameters of a message to 15. If there
+// happen to be more, the last parameter will hold the remainder of the message.
+// http://www.networksorcery.com/enp/protocol/irc.htm
+#define TWIRC_MAX_PARAMS 15
+
+// The number of epoll events twirc_tick() can handle per call, by default. A
+// single connection only needs one, but if several sources become ready at 
+// the same time, they can all be handled after one wake-up instead of one per
+// call. Use twirc_set_max_events() to change this for a given state.
+#define TWIRC_MAX_EVENTS 8
+
+// The number of bytes a connection driven by a reactor may read before the 
+// other connections of the reactor get their turn, by default. This should be
+// a few times the size of the receive buffer, so busy connections don't have
+// to wait all the time, but small enough so they can't hog the reactor.
+#define TWIRC_READ_BUDGET (8 * TWIRC_MESSAGE_SIZE)
+
+// Number of points every connection of a pool gets on the hash ring that 
+// decides which connection a channel goes to. More points spread the channels
+// more evenly, but make the ring bigger; 64 is plenty for a few dozen shards.
+#define TWIRC_POOL_VNODES 64
+
+// How long (in milliseconds) a redundancy group remembers the events it has
+// passed on, so it can drop the copies that come in late over its other
+// connections, and how many events it remembers at most, by default; see
+// twirc_group_set_window().
+#define TWIRC_GROUP_WINDOW 5000
+#define TWIRC_GROUP_DEDUP_SIZE 16384
+
+// Worker threads wake up at least this often (in milliseconds) to check if
+// they have been told to stop, see twirc_workers_stop().
+#define TWIRC_WORKER_TICK 100
+
+// Number of blocks a handoff hands events to consumer threads in, unless 
+// given otherwise, and the size of every block. An event takes about twice
+// the size of its raw message plus some pointers, so even most of the largest
+// events will fit; the rare ones that don't get a block allocated for them.
+#define TWIRC_HANDOFF_BLOCKS 1024
+#define TWIRC_BLOCK_SIZE (4 * TWIRC_MESSAGE_SIZE)
+
+// Delay (in milliseconds) before the first attempt to reconnect, with the
+// TWIRC_OPT_RECONNECT option, and the most it can grow to after failed
+// attempts, by default; see twirc_set_reconnect_delay().
+#define TWIRC_RECONNECT_MIN 1000
+#define TWIRC_RECONNECT_MAX 120000
+
+// With the TWIRC_OPT_KEEPALIVE option, a PING is sent once nothing has come
+// in for this long (in milliseconds), and the connection is considered lost
+// if the PONG doesn't come back within this long, by default; see 
+// twirc_set_keepalive().
+#define TWIRC_KEEPALIVE_IDLE 30000
+#define TWIRC_KEEPALIVE_TIMEOUT 10000
+
+// Number of buckets of the round-trip time histogram, see
+// twirc_get_rtt_histogram().
+#define TWIRC_RTT_BUCKETS 16
+
+// Time (in milliseconds) the new connection gets to log in and join all the
+// channels during a handover (see TWIRC_OPT_HANDOVER), how long we keep on
+// dropping duplicate messages after the switch, and how many message ids we
+// remember to tell the duplicates (a power of two).
+#define TWIRC_HANDOVER_TIMEOUT 30000
+#define TWIRC_HANDOVER_LINGER 10000
+#define TWIRC_DEDUP_SIZE 4096
+
 // If you want to connect to Twitch IRC anonymously, which means you'll be able
 // to read chat but not participate, then you need to use the special username 
 // "justinfan<randomnumber>", which seems to be a relic from the JustinTV days.
@@ -122,12 +300,24 @@ struct twirc_event;
 struct twirc_callbacks;
 struct twirc_login;
 struct twirc_tag;
+struct twirc_tags;
+struct twirc_reactor;
+struct twirc_pool;
+struct twirc_group;
+struct twirc_workers;
+struct twirc_handoff;
 
 typedef struct twirc_event twirc_event_t;
 typedef struct twirc_login twirc_login_t;
 typedef struct twirc_tag twirc_tag_t;
+typedef struct twirc_tags twirc_tags_t;
 typedef struct twirc_state twirc_state_t;
 typedef struct twirc_callbacks twirc_callbacks_t;
+typedef struct twirc_reactor twirc_reactor_t;
+typedef struct twirc_pool twirc_pool_t;
+typedef struct twirc_group twirc_group_t;
+typedef struct twirc_workers twirc_workers_t;
+typedef struct twirc_handoff twirc_handoff_t;
 
 struct twirc_login
 {
@@ -143,6 +333,62 @@ struct twirc_tag
 {
 	char *key;
 	char *value;
+	int escaped;                       // value not unescaped yet (lazy)
+};
+
+// Decoded view of the well-known tags of an event, see twirc_get_tags().
+// Strings point to the (unescaped) tag values, numbers have been converted.
+// Members of tags the event doesn't have are NULL or 0; use present to tell
+// a missing tag from one that is 0, for example with followers_only.
+struct twirc_tags
+{
+	int decoded;                       // Members have been filled in
+	uint64_t present;                  // Bit (1 << TWIRC_TAG_*) per tag
+	char *badge_info;
+	char *badges;
+	int ban_duration;
+	int bits;
+	char *broadcaster_lang;
+	char *client_nonce;
+	char *color;
+	char *display_name;
+	int emote_only;
+	char *emote_sets;
+	char *emotes;
+	int first_msg;
+	char *flags;
+	int followers_only;
+	char *id;
+	char *login;
+	int mod;
+	char *msg_id;
+	int msg_param_cumulative_months;
+	char *msg_param_display_name;
+	char *msg_param_login;
+	int msg_param_months;
+	char *msg_param_recipient_display_name;
+	uint64_t msg_param_recipient_id;
+	char *msg_param_recipient_user_name;
+	char *msg_param_ritual_name;
+	int msg_param_should_share_streak;
+	int msg_param_streak_months;
+	char *msg_param_sub_plan;
+	char *msg_param_sub_plan_name;
+	int msg_param_viewer_count;
+	int r9k;
+	char *reply_parent_msg_id;
+	uint64_t room_id;
+	int slow;
+	int subs_only;
+	int subscriber;
+	char *system_msg;
+	char *target_msg_id;
+	uint64_t target_user_id;
+	uint64_t tmi_sent_ts;              // Milliseconds since the epoch
+	int turbo;
+	uint64_t user_id;
+	char *user_type;
+	int vip;
 };
 
 struct twirc_event
@@ -152,11 +398,14 @@ struct twirc_event
 	// Separated raw data
 	char *prefix;                      // IRC message prefix
 	char *command;                     // IRC message command
+	int command_id;                    // Command as TWIRC_COMMAND_*
 	char **params;                     // IRC message parameter
 	size_t num_params;                 // Number of elements in params
 	int trailing;                      // Index of the trailing param
 	twirc_tag_t **tags;                // IRC message tags
 	size_t num_tags;                   // Number of elements in tags
+	twirc_tag_t **tag_index;           // Known tags, by TWIRC_TAG_* key
+	twirc_tags_t *decoded;             // Use twirc_get_tags() instead
 	// For convenience
 	char *origin;                      // Nick as extracted from prefix
 	char *channel;                     // Channel as extracted from params
@@ -166,6 +415,8 @@ struct twirc_event
 };
 
 typedef void (*twirc_callback)(twirc_state_t *s, twirc_event_t *e);
+typedef void (*twirc_raw_callback)(twirc_state_t *s, const char *msg, size_t len);
+typedef void (*twirc_timer_callback)(twirc_state_t *s, void *arg);
 
 struct twirc_callbacks
 {
@@ -193,6 +444,7 @@ struct twirc_callbacks
 	twirc_callback invalidcmd;         // Server doesn't recognise command
 	twirc_callback other;              // Everything else (for now)
 	twirc_callback outbound;           // Messages we send TO the server
+	twirc_raw_callback outbound_raw;   // Same, but raw, without parsing
 };
 
 /*
@@ -211,6 +463,83 @@ int twirc_disconnect(twirc_state_t *s);
 // Main flow control
 int twirc_loop(twirc_state_t *s);
 int twirc_tick(twirc_state_t *s, int timeout);
+int twirc_set_max_events(twirc_state_t *s, int max);
+
+// Driving many connections from one thread
+twirc_reactor_t *twirc_reactor_init();
+int  twirc_reactor_add(twirc_reactor_t *r, twirc_state_t *s);
+int  twirc_reactor_remove(twirc_reactor_t *r, twirc_state_t *s);
+void twirc_reactor_set_budget(twirc_reactor_t *r, size_t bytes);
+int  twirc_reactor_set_max_events(twirc_reactor_t *r, int max);
+int  twirc_reactor_tick(twirc_reactor_t *r, int timeout);
+int  twirc_reactor_loop(twirc_reactor_t *r);
+void twirc_reactor_free(twirc_reactor_t *r);
+
+// Spreading channels across many connections
+twirc_pool_t      *twirc_pool_init(size_t num_shards, twirc_reactor_t *r);
+twirc_callbacks_t *twirc_pool_get_callbacks(twirc_pool_t *p);
+int  twirc_pool_connect(twirc_pool_t *p, const char *host, const char *port, const char *nick, const char *pass);
+int  twirc_pool_join(twirc_pool_t *p, const char *chan);
+int  twirc_pool_join_many(twirc_pool_t *p, const char **chans, size_t n);
+int  twirc_pool_part(twirc_pool_t *p, const char *chan);
+twirc_state_t   *twirc_pool_get_shard(twirc_pool_t *p, const char *chan);
+twirc_state_t   *twirc_pool_get_state(twirc_pool_t *p, size_t i);
+size_t           twirc_pool_get_num_shards(const twirc_pool_t *p);
+twirc_reactor_t *twirc_pool_get_reactor(twirc_pool_t *p);
+twirc_pool_t    *twirc_get_pool(twirc_state_t *s);
+void  twirc_pool_set_context(twirc_pool_t *p, void *ctx);
+void *twirc_pool_get_context(twirc_pool_t *p);
+int  twirc_pool_tick(twirc_pool_t *p, int timeout);
+int  twirc_pool_loop(twirc_pool_t *p);
+void twirc_pool_free(twirc_pool_t *p);
+
+// Reading the same channels over several connections
+twirc_group_t     *twirc_group_init(size_t num_legs, twirc_reactor_t *r);
+twirc_callbacks_t *twirc_group_get_callbacks(twirc_group_t *g);
+int  twirc_group_connect(twirc_group_t *g, const char *host, const char *port, const char *nick, const char *pass);
+int  twirc_group_connect_leg(twirc_group_t *g, size_t i, const char *host, const char *port, const char *nick, const char *pass);
+int  twirc_group_join(twirc_group_t *g, const char *chan);
+int  twirc_group_join_many(twirc_group_t *g, const char **chans, size_t n);
+int  twirc_group_part(twirc_group_t *g, const char *chan);
+int  twirc_group_set_window(twirc_group_t *g, unsigned ms, size_t size);
+twirc_state_t   *twirc_group_get_state(twirc_group_t *g, size_t i);
+size_t           twirc_group_get_num_legs(const twirc_group_t *g);
+twirc_reactor_t *twirc_group_get_reactor(twirc_group_t *g);
+twirc_group_t   *twirc_get_group(twirc_state_t *s);
+size_t   twirc_group_get_leg(const twirc_state_t *s);
+uint64_t twirc_group_get_wins(const twirc_group_t *g, size_t i);
+uint64_t twirc_group_get_losses(const twirc_group_t *g, size_t i);
+uint64_t twirc_group_get_lag(const twirc_group_t *g, size_t i);
+void  twirc_group_set_context(twirc_group_t *g, void *ctx);
+void *twirc_group_get_context(twirc_group_t *g);
+int  twirc_group_tick(twirc_group_t *g, int timeout);
+int  twirc_group_loop(twirc_group_t *g);
+void twirc_group_free(twirc_group_t *g);
+
+// Driving connections from one thread per core
+twirc_workers_t *twirc_workers_init(size_t num_workers, int pin);
+int  twirc_workers_add(twirc_workers_t *w, twirc_state_t *s);
+twirc_reactor_t *twirc_workers_get_reactor(twirc_workers_t *w, size_t i);
+size_t twirc_workers_get_num(const twirc_workers_t *w);
+int  twirc_workers_start(twirc_workers_t *w);
+void twirc_workers_stop(twirc_workers_t *w);
+void twirc_workers_free(twirc_workers_t *w);
+
+// Handing events off to consumer threads
+twirc_handoff_t *twirc_handoff_init(size_t num_blocks);
+void twirc_set_handoff(twirc_state_t *s, twirc_handoff_t *h);
+twirc_event_t *twirc_handoff_pop(twirc_handoff_t *h, int timeout, twirc_state_t **s);
+void twirc_handoff_release(twirc_event_t *evt);
+int  twirc_handoff_run(twirc_handoff_t *h, int timeout);
+void twirc_handoff_free(twirc_handoff_t *h);
+
+// Timers
+uint64_t twirc_timer_add(twirc_state_t *s, unsigned ms, unsigned interval, twirc_timer_callback cb, void *arg);
+int twirc_timer_cancel(twirc_state_t *s, uint64_t id);
+
+// Keeping events beyond their callback
+twirc_event_t *twirc_event_clone(const twirc_event_t *evt);
+void twirc_event_release(twirc_event_t *evt);
 
 // Clean-up and shut-down
 void twirc_kill(twirc_state_t *s);
@@ -221,24 +550,47 @@ twirc_login_t *twirc_get_login(twirc_state_t *s);
 twirc_tag_t   *twirc_get_tag_by_key(twirc_tag_t **tags, const char *key); // deprecated
 twirc_tag_t   *twirc_get_tag(twirc_tag_t **tags, const char *key);
 char const    *twirc_get_tag_value(twirc_tag_t **tags, const char *key);
+char const    *twirc_tag_value(twirc_tag_t *tag);
+twirc_tag_t   *twirc_get_tag_fast(twirc_event_t *evt, int key);
+twirc_tags_t  *twirc_get_tags(twirc_event_t *evt);
 int            twirc_get_last_error(const twirc_state_t *s);
+size_t         twirc_get_queued_bytes(const twirc_state_t *s);
+size_t         twirc_get_held_messages(const twirc_state_t *s);
 
 // Twitc state status inforamtion
 int twirc_is_connecting(const twirc_state_t *s);
 int twirc_is_logging_in(const twirc_state_t *s);
 int twirc_is_connected(const twirc_state_t *s);
 int twirc_is_logged_in(const twirc_state_t *s);
+int twirc_is_reconnecting(const twirc_state_t *s);
+
+// Round-trip time (see TWIRC_OPT_KEEPALIVE)
+uint64_t twirc_get_rtt(const twirc_state_t *s);
+size_t   twirc_get_rtt_histogram(const twirc_state_t *s, uint64_t *counts, size_t n);
 
 // Custom user-data
 void  twirc_set_context(twirc_state_t *s, void *ctx);
 void *twirc_get_context(twirc_state_t *s);
 
+// Batching
+void twirc_batch_begin(twirc_state_t *s);
+int  twirc_batch_end(twirc_state_t *s);
+
+// Options
+void twirc_set_option(twirc_state_t *s, int opt, int on);
+int  twirc_set_reconnect_delay(twirc_state_t *s, unsigned min_ms, unsigned max_ms);
+int  twirc_set_keepalive(twirc_state_t *s, unsigned idle_ms, unsigned timeout_ms);
+int  twirc_get_option(const twirc_state_t *s, int opt);
+int  twirc_set_rate_limit(twirc_state_t *s, int limit, unsigned count, unsigned secs);
+
 // Twitch IRC commands
 int twirc_cmd_raw(twirc_state_t *s, const char *msg);
 int twirc_cmd_pass(twirc_state_t *s, const char *pass);
 int twirc_cmd_nick(twirc_state_t *s, const char *nick);
 int twirc_cmd_join(twirc_state_t *s, const char *chan);
 int twirc_cmd_part(twirc_state_t *s, const char *chan);
+int twirc_cmd_join_many(twirc_state_t *s, const char **chans, size_t n);
+int twirc_cmd_part_many(twirc_state_t *s, const char **chans, size_t n);
 int twirc_cmd_ping(twirc_state_t *s, const char *param);
 int twirc_cmd_pong(twirc_state_t *s, const char *param);
 int twirc_cmd_quit(twirc_state_t *s);
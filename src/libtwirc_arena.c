@@ -0,0 +1,133 @@
+#include <stdlib.h>     // malloc(), free()
+#include <string.h>     // memcpy(), strnlen()
+#include <stddef.h>     // max_align_t
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * The event arena. All memory needed while parsing and handling an event is
+ * taken from one block that belongs to the state, simply by bumping an offset.
+ * When the event has been dispatched, the offset is reset to where it was
+ * before, which frees everything at once. As events can be nested (a callback
+ * might send a message, which creates an outbound event), this works with
+ * marks: take a mark before, release it after, and only the memory allocated
+ * in between will be freed. Should the block ever run out of space, we fall
+ * back to malloc(), keeping the allocations in a list so that releasing the
+ * mark will free them as well. In practice, this never happens, as the block
+ * is much larger than all the allocations for even the biggest of events.
+ */
+
+/*
+ * Allocation that didn't fit into the arena's block; these form a list, newest
+ * first, and the actual memory follows right after this header.
+ */
+struct libtwirc_arena_big
+{
+	struct libtwirc_arena_big *next;
+	max_align_t data[];
+};
+
+/*
+ * Allocates the arena's block. Returns 0 on success, -1 if out of memory.
+ */
+int libtwirc_arena_init(struct libtwirc_arena *a, size_t size)
+{
+	a->buf = malloc(size);
+	if (a->buf == NULL)
+	{
+		return -1;
+	}
+	a->size = size;
+	a->used = 0;
+	a->big  = NULL;
+	return 0;
+}
+
+/*
+ * Returns a mark that represents the arena's current fill level. Pass it to
+ * libtwirc_arena_release() to free everything allocated after taking it.
+ */
+struct libtwirc_mark libtwirc_arena_mark(struct libtwirc_arena *a)
+{
+	struct libtwirc_mark m = { a->used, a->big };
+	return m;
+}
+
+/*
+ * Frees everything that has been allocated from the arena since the given
+ * mark has been taken, by resetting the offset and freeing all the malloc'd
+ * fallback allocations newer than the mark, if there are any.
+ */
+void libtwirc_arena_release(struct libtwirc_arena *a, struct libtwirc_mark m)
+{
+	while (a->big != m.big)
+	{
+		struct libtwirc_arena_big *next = a->big->next;
+		free(a->big);
+		a->big = next;
+	}
+	a->used = m.used;
+}
+
+/*
+ * Frees the arena's block and whatever might still be allocated.
+ */
+void libtwirc_arena_free(struct libtwirc_arena *a)
+{
+	struct libtwirc_mark m = { 0, NULL };
+	libtwirc_arena_release(a, m);
+	free(a->buf);
+	a->buf  = NULL;
+	a->size = 0;
+}
+
+/*
+ * Allocates len bytes from the state's arena, suitably aligned for any type.
+ * The memory will be valid until the mark taken before the allocation gets
+ * released, which for the allocations made while handling an event happens
+ * after its callback returned. Returns NULL and sets the state's error to
+ * TWIRC_ERR_OUT_OF_MEMORY if the memory could not be allocated.
+ */
+void *libtwirc_alloc(twirc_state_t *s, size_t len)
+{
+	struct libtwirc_arena *a = &s->arena;
+
+	// Round up, so the next allocation will be aligned as well
+	size_t align = sizeof(max_align_t);
+	size_t size  = (len + align - 1) & ~(align - 1);
+
+	// Usually, this is all it takes
+	if (size <= a->size - a->used)
+	{
+		void *ptr = a->buf + a->used;
+		a->used += size;
+		return ptr;
+	}
+
+	// The block is full, so we ask malloc() instead
+	struct libtwirc_arena_big *big = malloc(sizeof(struct libtwirc_arena_big) + len);
+	if (big == NULL)
+	{
+		return libtwirc_oom_null(s);
+	}
+	big->next = a->big;
+	a->big = big;
+	return big->data;
+}
+
+/*
+ * Copies at most len chars of str into memory allocated from the state's
+ * arena and null terminates the copy. Returns NULL if out of memory.
+ */
+char *libtwirc_strndup(twirc_state_t *s, const char *str, size_t len)
+{
+	len = strnlen(str, len);
+	char *dup = libtwirc_alloc(s, len + 1);
+	if (dup == NULL)
+	{
+		return NULL;
+	}
+	memcpy(dup, str, len);
+	dup[len] = '\0';
+	return dup;
+}
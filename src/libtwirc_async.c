@@ -0,0 +1,278 @@
+#include <stdlib.h>     // malloc(), free()
+#include <string.h>     // memcpy(), strnlen()
+#include <stdint.h>     // uintptr_t, uint64_t
+#include <errno.h>      // errno, EEXIST
+#include <unistd.h>     // read(), write(), close()
+#include <stdatomic.h>  // atomic_*
+#include <sys/epoll.h>  // epoll_ctl()
+#include <sys/eventfd.h> // eventfd()
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * Sending from other threads. A state must only ever be used by the thread
+ * that drives it (the one calling twirc_tick() or twirc_reactor_tick()), as
+ * sending touches the socket, the send queue and the rate limiter. With the
+ * TWIRC_OPT_THREADSAFE option, libtwirc_send() checks whether it is being
+ * called from that thread; if not, the message is put onto the state's inbox,
+ * a lock-free queue that any number of threads can add to, and the state's
+ * eventfd is signalled. The eventfd is part of the state's epoll set, so the
+ * thread driving the state wakes up and sends the messages in the inbox, in
+ * the order they came in, just as if they had been sent from a callback.
+ * Which thread drives which state is tracked with a thread-local pointer to
+ * the state (or reactor) that the thread is currently ticking.
+ */
+
+// State or reactor the current thread is ticking, if any
+static _Thread_local const void *libtwirc_ticking = NULL;
+
+/*
+ * Marks the state or reactor given as owner as the one the current thread is
+ * ticking, until libtwirc_tick_end() is called with what this returned.
+ */
+const void *libtwirc_tick_begin(const void *owner)
+{
+	const void *prev = libtwirc_ticking;
+	libtwirc_ticking = owner;
+	return prev;
+}
+
+/*
+ * Ends what libtwirc_tick_begin() started, prev being what it returned.
+ */
+void libtwirc_tick_end(const void *prev)
+{
+	libtwirc_ticking = prev;
+}
+
+/*
+ * Returns 1 if the current thread is the one driving the state, else 0.
+ */
+int libtwirc_in_tick(const twirc_state_t *s)
+{
+	return libtwirc_ticking != NULL &&
+	       (libtwirc_ticking == s || libtwirc_ticking == s->reactor);
+}
+
+/*
+ * Sets up the state's inbox and eventfd. Returns 0 on success, -1 on error.
+ */
+int libtwirc_inbox_init(twirc_state_t *s)
+{
+	s->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (s->wake_fd < 0)
+	{
+		return -1;
+	}
+	atomic_init(&s->inbox_stub.next, NULL);
+	atomic_init(&s->inbox_head, &s->inbox_stub);
+	s->inbox_tail = &s->inbox_stub;
+	s->inbox_next = NULL;
+	return 0;
+}
+
+/*
+ * Adds the state's eventfd to its current epoll instance. The epoll event
+ * carries the state's address with the lowest bit set, so it can be told
+ * apart from the socket's events (see libtwirc_handle_epoll()). It's fine if
+ * it has been added already. Returns 0 on success, -1 on error.
+ */
+int libtwirc_watch_inbox(twirc_state_t *s)
+{
+	if (s->epfd < 0 || s->wake_fd < 0)
+	{
+		return 0;
+	}
+	struct epoll_event eev = { 0 };
+	eev.data.ptr = (void *) ((uintptr_t) s | 1);
+	eev.events = EPOLLIN | EPOLLET;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wake_fd, &eev) == -1 && errno != EEXIST)
+	{
+		s->error = TWIRC_ERR_EPOLL_CTL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Adds the message to the end of the state's inbox. Producers only ever swap
+ * the head, then link the previous head to the new message, so they never
+ * wait for each other (this is Dmitry Vyukov's intrusive MPSC queue).
+ */
+void libtwirc_inbox_push(twirc_state_t *s, struct libtwirc_note *n)
+{
+	atomic_store_explicit(&n->next, NULL, memory_order_relaxed);
+	struct libtwirc_note *prev = atomic_exchange_explicit(&s->inbox_head, n, memory_order_acq_rel);
+	atomic_store_explicit(&prev->next, n, memory_order_release);
+}
+
+/*
+ * Takes the oldest message out of the state's inbox. Must only be called by
+ * the thread driving the state. Returns NULL if the inbox is empty or if a
+ * producer is in the middle of adding a message; in the latter case, the
+ * producer will signal the eventfd once it's done, so we'll be back.
+ */
+struct libtwirc_note *libtwirc_inbox_pop(twirc_state_t *s)
+{
+	struct libtwirc_note *tail = s->inbox_tail;
+	struct libtwirc_note *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+	// Skip the stub, which is only there so the queue is never empty
+	if (tail == &s->inbox_stub)
+	{
+		if (next == NULL)
+		{
+			return NULL;
+		}
+		s->inbox_tail = next;
+		tail = next;
+		next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	}
+	if (next != NULL)
+	{
+		s->inbox_tail = next;
+		return tail;
+	}
+
+	// tail is the last message, unless a producer is adding one right now
+	if (tail != atomic_load_explicit(&s->inbox_head, memory_order_acquire))
+	{
+		return NULL;
+	}
+
+	// Put the stub back in, so we can take out the last message
+	libtwirc_inbox_push(s, &s->inbox_stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next != NULL)
+	{
+		s->inbox_tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+/*
+ * Puts the message into the state's inbox and wakes up the thread driving the
+ * state, which will then send it. Can be called from any thread. Returns 0 on
+ * success, -1 if out of memory (TWIRC_ERR_OUT_OF_MEMORY).
+ */
+int libtwirc_send_async(twirc_state_t *s, const char *msg)
+{
+	size_t len = strnlen(msg, TWIRC_BUFFER_SIZE - 3);
+	struct libtwirc_note *n = malloc(sizeof(struct libtwirc_note) + len + 1);
+	if (n == NULL)
+	{
+		return libtwirc_oom(s);
+	}
+	n->msg = (char *) (n + 1);
+	memcpy(n->msg, msg, len);
+	n->msg[len] = '\0';
+	libtwirc_inbox_push(s, n);
+
+	uint64_t one = 1;
+	if (write(s->wake_fd, &one, sizeof(one)) == -1)
+	{
+		// Counter is full, so the thread is going to wake up anyway
+	}
+	return 0;
+}
+
+/*
+ * Sends the messages in the state's inbox, in the order they came in, in
+ * batches of up to TWIRC_INBOX_MAX bytes. Called when the state's eventfd has
+ * been signalled. Other threads can add messages much faster than the socket
+ * takes them, so once the socket can't keep up and data starts piling up in
+ * the send queue, we leave the rest in the inbox instead of overflowing the
+ * send queue; libtwirc_handle_event() calls us again once there is room.
+ */
+void libtwirc_drain_inbox(twirc_state_t *s)
+{
+	uint64_t val;
+	if (read(s->wake_fd, &val, sizeof(val)) == -1)
+	{
+		// Nothing to read, we'll look at the inbox anyway
+	}
+
+	// Start with the message we had to leave for later last time, if any
+	struct libtwirc_note *n = s->inbox_next;
+	s->inbox_next = NULL;
+	if (n == NULL)
+	{
+		n = libtwirc_inbox_pop(s);
+	}
+	while (n != NULL)
+	{
+		twirc_batch_begin(s);
+		size_t len = 0;
+		while (n != NULL && len < TWIRC_INBOX_MAX)
+		{
+			len += strlen(n->msg) + 2;
+			libtwirc_send(s, n->msg);
+			free(n);
+			n = libtwirc_inbox_pop(s);
+		}
+		twirc_batch_end(s);
+
+		// The socket didn't take all of it, wait for it to become
+		// writable again before we send any more
+		if (n != NULL && s->sendq_tail > s->sendq_head)
+		{
+			s->inbox_next = n;
+			return;
+		}
+	}
+}
+
+/*
+ * Frees all messages left in the state's inbox and closes its eventfd.
+ */
+void libtwirc_free_inbox(twirc_state_t *s)
+{
+	free(s->inbox_next);
+	s->inbox_next = NULL;
+
+	struct libtwirc_note *n;
+	while ((n = libtwirc_inbox_pop(s)) != NULL)
+	{
+		free(n);
+	}
+	if (s->wake_fd >= 0)
+	{
+		close(s->wake_fd);
+		s->wake_fd = -1;
+	}
+}
+
+/*
+ * Handles an event reported by epoll, which is one of a state's socket or, if
+ * one of the two lowest bits of its data is set, of the state's eventfd (1)
+ * or timerfd (2, see libtwirc_timers.c).
+ */
+int libtwirc_handle_epoll(struct epoll_event *epev)
+{
+	uintptr_t data = (uintptr_t) epev->data.ptr;
+	twirc_state_t *s = (twirc_state_t *) (data & ~(uintptr_t) 3);
+
+	// A connection that took over or gave up (see libtwirc_handover.c) is
+	// gone, even if some of its events are still around
+	if (s->primary != NULL && s->primary->successor != s)
+	{
+		return 0;
+	}
+
+	int ret = 0;
+	switch (data & 3)
+	{
+		case 1:
+			libtwirc_drain_inbox(s);
+			break;
+		case 2:
+			libtwirc_handle_timers(s);
+			break;
+		default:
+			ret = libtwirc_handle_event(s, epev);
+	}
+
+	// One that is about to take over keeps its troubles to itself
+	return s->primary != NULL ? 0 : ret;
+}
@@ -0,0 +1,138 @@
+#include <stdlib.h>     // malloc(), calloc(), free()
+#include <string.h>     // memcpy(), strncmp()
+#include <stdint.h>     // uint32_t
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * The channel table. Some things we need to keep track of per channel, like
+ * whether we are a moderator there, which changes how many messages we may
+ * send. The table is a hash table with open addressing (linear probing),
+ * keyed by channel name, that holds pointers to the channel structs, so they
+ * stay where they are when the table grows. Channels are never removed, only
+ * flagged as not joined, as the table is small and the data is still useful.
+ */
+
+/*
+ * Hashes the first len chars of name (FNV-1a).
+ */
+uint32_t libtwirc_chan_hash(const char *name, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; ++i)
+	{
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Doubles the size of the channel table (or allocates it, if it doesn't exist
+ * yet) and re-inserts all channels. Returns 0 on success, -1 if out of memory.
+ */
+int libtwirc_grow_chans(twirc_state_t *s)
+{
+	size_t size = s->chans_size ? s->chans_size * 2 : TWIRC_CHANS_SIZE;
+	struct libtwirc_chan **chans = calloc(size, sizeof(struct libtwirc_chan *));
+	if (chans == NULL)
+	{
+		return -1;
+	}
+
+	for (size_t i = 0; i < s->chans_size; ++i)
+	{
+		struct libtwirc_chan *c = s->chans[i];
+		if (c == NULL)
+		{
+			continue;
+		}
+		size_t slot = libtwirc_chan_hash(c->name, strlen(c->name)) & (size - 1);
+		while (chans[slot] != NULL)
+		{
+			slot = (slot + 1) & (size - 1);
+		}
+		chans[slot] = c;
+	}
+
+	free(s->chans);
+	s->chans = chans;
+	s->chans_size = size;
+	return 0;
+}
+
+/*
+ * Returns the channel with the given name (the first len chars of name, that
+ * is, so it doesn't have to be null terminated), or NULL if there is no such
+ * channel in the table. If create is 1, the channel will be added to the table
+ * if it isn't in there yet; NULL will then only be returned if we ran out of
+ * memory doing so.
+ */
+struct libtwirc_chan *libtwirc_get_chan(twirc_state_t *s, const char *name, size_t len, int create)
+{
+	// Keep the table at most half full, so the probe sequences stay short
+	if (create && (s->num_chans + 1) * 2 > s->chans_size)
+	{
+		if (libtwirc_grow_chans(s) == -1)
+		{
+			return libtwirc_oom_null(s);
+		}
+	}
+	if (s->chans_size == 0)
+	{
+		return NULL;
+	}
+
+	size_t mask = s->chans_size - 1;
+	size_t slot = libtwirc_chan_hash(name, len) & mask;
+	while (s->chans[slot] != NULL)
+	{
+		struct libtwirc_chan *c = s->chans[slot];
+		if (strncmp(c->name, name, len) == 0 && c->name[len] == '\0')
+		{
+			return c;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	if (!create)
+	{
+		return NULL;
+	}
+
+	// Not in the table yet, so let's add it; the name goes right after
+	// the struct, so it only takes one allocation
+	struct libtwirc_chan *c = malloc(sizeof(struct libtwirc_chan) + len + 1);
+	if (c == NULL)
+	{
+		return libtwirc_oom_null(s);
+	}
+	memset(c, 0, sizeof(struct libtwirc_chan));
+	c->name = (char *) (c + 1);
+	memcpy(c->name, name, len);
+	c->name[len] = '\0';
+	libtwirc_init_bucket(&c->privmsg, TWIRC_LIMIT_PRIVMSG, c);
+
+	s->chans[slot] = c;
+	s->num_chans += 1;
+	return c;
+}
+
+/*
+ * Frees all channels and the channel table itself.
+ */
+void libtwirc_free_chans(twirc_state_t *s)
+{
+	for (size_t i = 0; i < s->chans_size; ++i)
+	{
+		if (s->chans[i] != NULL)
+		{
+			libtwirc_clear_bucket(s, &s->chans[i]->privmsg);
+			free(s->chans[i]);
+		}
+	}
+	free(s->chans);
+	s->chans = NULL;
+	s->chans_size = 0;
+	s->num_chans = 0;
+}
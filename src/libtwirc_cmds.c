@@ -1,4 +1,5 @@
 #include <stdio.h>      // NULL, fprintf(), perror()
+#include <string.h>     // strlen(), strcmp(), memcpy()
 #include "libtwirc.h"
 #include "libtwirc_internal.h"
 
@@ -58,6 +59,92 @@ int twirc_cmd_part(twirc_state_t *state, const char *chan)
 	return libtwirc_send(state, msg);
 }
 
+/*
+ * Sends cmd ("JOIN" or "PART") for all n channels in chans, packing as many
+ * channels into every line as fit into TWIRC_MULTI_LINE_SIZE bytes. For JOIN,
+ * lines never carry more channels than the join limit allows at once, as the
+ * rate limiter charges one token per channel. All lines are sent as a batch.
+ * Returns 0 if all commands were sent (or queued), -1 on error.
+ */
+int libtwirc_cmd_many(twirc_state_t *state, const char *cmd, const char **chans, size_t n)
+{
+	size_t max_chans = n;
+	unsigned join_count = state->limits[TWIRC_LIMIT_JOIN].count;
+	if (strcmp(cmd, "JOIN") == 0 && join_count > 0 && join_count < max_chans)
+	{
+		max_chans = join_count;
+	}
+
+	char msg[TWIRC_MULTI_LINE_SIZE + 1];
+	size_t cmd_len = strlen(cmd);
+	memcpy(msg, cmd, cmd_len);
+	msg[cmd_len] = ' ';
+
+	int ret = 0;
+	twirc_batch_begin(state);
+
+	size_t i = 0;
+	while (i < n && ret == 0)
+	{
+		// Add channels until the line is full; a channel that doesn't
+		// even fit into an empty line will get truncated, as it would
+		// by twirc_cmd_join(), so we always take at least one channel
+		size_t len = cmd_len + 1;
+		size_t num = 0;
+		while (i < n && num < max_chans)
+		{
+			size_t chan_len = strlen(chans[i]);
+			size_t need = chan_len + (num > 0);
+			if (num > 0 && len + need > TWIRC_MULTI_LINE_SIZE)
+			{
+				break;
+			}
+			if (num > 0)
+			{
+				msg[len++] = ',';
+			}
+			if (len + chan_len > TWIRC_MULTI_LINE_SIZE)
+			{
+				chan_len = TWIRC_MULTI_LINE_SIZE - len;
+			}
+			memcpy(msg + len, chans[i], chan_len);
+			len += chan_len;
+			++num;
+			++i;
+		}
+		msg[len] = '\0';
+		ret = libtwirc_send(state, msg);
+	}
+
+	if (twirc_batch_end(state) == -1)
+	{
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Request to join all n channels in chans, using as few JOIN commands as
+ * possible (see libtwirc_cmd_many()). This is a lot faster than joining them
+ * one by one. The join callback will be called for every channel joined.
+ * Returns 0 if the commands were sent successfully, -1 on error.
+ */
+int twirc_cmd_join_many(twirc_state_t *state, const char **chans, size_t n)
+{
+	return libtwirc_cmd_many(state, "JOIN", chans, n);
+}
+
+/*
+ * Leave (part) all n channels in chans, using as few PART commands as
+ * possible (see libtwirc_cmd_many()). The part callback will be called for
+ * every channel left. Returns 0 if the commands were sent successfully, -1 on
+ * error.
+ */
+int twirc_cmd_part_many(twirc_state_t *state, const char **chans, size_t n)
+{
+	return libtwirc_cmd_many(state, "PART", chans, n);
+}
+
 /*
  * Sends the PONG command to the IRC server.
  * If param is given, it will be appended. To make Twitch happy (this is not 
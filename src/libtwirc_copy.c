@@ -0,0 +1,218 @@
+#include <stdlib.h>     // malloc(), free()
+#include <string.h>     // strlen(), memcpy(), memset()
+#include <stddef.h>     // max_align_t
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * Self-contained copies of events. An event's members point all over the
+ * place: into the receive buffer, the stack of the parser and the state's
+ * arena, all of which get reused as soon as the callback returns. To keep an
+ * event around for longer, or to hand it to another thread, we copy it into
+ * a single block of memory: first the event struct, then the struct for the
+ * decoded tags, the tag structs and the arrays of pointers, then all the
+ * strings, with all the pointers rewritten to point into the block. Members
+ * that point to a parameter (like channel and message usually do) point to
+ * the copy of that parameter, so every string is only copied once. Users get
+ * at this through twirc_event_clone(); the handoff copies events into blocks
+ * of its own pool instead.
+ */
+
+// Rounds n up to the next multiple of the strictest alignment of any type
+#define LIBTWIRC_ALIGN(n) (((n) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+
+/*
+ * Returns the number of bytes a copy of str needs, including the null
+ * terminator, or 0 if str is NULL.
+ */
+size_t libtwirc_str_size(const char *str)
+{
+	return str ? strlen(str) + 1 : 0;
+}
+
+/*
+ * Returns the number of bytes needed for a copy of the convenience member
+ * ref of the event, which is 0 if it points to one of the event's params or
+ * is NULL, as those don't need a copy of their own.
+ */
+size_t libtwirc_ref_size(const twirc_event_t *evt, const char *ref)
+{
+	for (size_t i = 0; ref != NULL && evt->params && i < evt->num_params; ++i)
+	{
+		if (ref == evt->params[i])
+		{
+			return 0;
+		}
+	}
+	return libtwirc_str_size(ref);
+}
+
+/*
+ * Returns the number of bytes libtwirc_copy_event() needs for a copy of evt.
+ */
+size_t libtwirc_event_size(const twirc_event_t *evt)
+{
+	size_t size = LIBTWIRC_ALIGN(sizeof(twirc_event_t))
+	            + LIBTWIRC_ALIGN(sizeof(twirc_tags_t))
+	            + LIBTWIRC_ALIGN(evt->num_tags * sizeof(twirc_tag_t))
+	            + LIBTWIRC_ALIGN((evt->num_tags + 1) * sizeof(twirc_tag_t *))
+	            + LIBTWIRC_ALIGN(TWIRC_NUM_TAG_KEYS * sizeof(twirc_tag_t *))
+	            + LIBTWIRC_ALIGN((evt->num_params + 1) * sizeof(char *));
+
+	size += libtwirc_str_size(evt->raw);
+	size += libtwirc_str_size(evt->prefix);
+	size += libtwirc_str_size(evt->command);
+	size += libtwirc_ref_size(evt, evt->origin);
+	size += libtwirc_ref_size(evt, evt->channel);
+	size += libtwirc_ref_size(evt, evt->target);
+	size += libtwirc_ref_size(evt, evt->message);
+	size += libtwirc_ref_size(evt, evt->ctcp);
+	for (size_t i = 0; evt->params && i < evt->num_params; ++i)
+	{
+		size += libtwirc_str_size(evt->params[i]);
+	}
+	for (size_t i = 0; evt->tags && i < evt->num_tags; ++i)
+	{
+		size += libtwirc_str_size(evt->tags[i]->key);
+		size += libtwirc_str_size(evt->tags[i]->value);
+	}
+	return size;
+}
+
+/*
+ * Copies str to *dst, advances *dst past the copy and returns a pointer to
+ * the copy; returns NULL without copying anything if str is NULL.
+ */
+char *libtwirc_copy_str(char **dst, const char *str)
+{
+	if (str == NULL)
+	{
+		return NULL;
+	}
+	size_t len = strlen(str) + 1;
+	char *copy = *dst;
+	memcpy(copy, str, len);
+	*dst += len;
+	return copy;
+}
+
+/*
+ * Returns a pointer to the copy of the convenience member ref of evt: if it
+ * points to one of the event's params, that's the copy of the param, which
+ * has to have been made already, otherwise ref is copied to *dst.
+ */
+char *libtwirc_copy_ref(const twirc_event_t *evt, twirc_event_t *copy, char **dst, const char *ref)
+{
+	for (size_t i = 0; ref != NULL && evt->params && i < evt->num_params; ++i)
+	{
+		if (ref == evt->params[i])
+		{
+			return copy->params[i];
+		}
+	}
+	return libtwirc_copy_str(dst, ref);
+}
+
+/*
+ * Copies evt, including everything it points to, into buf, which has to be
+ * aligned for any type and at least libtwirc_event_size() bytes large, and
+ * returns a pointer to the copy, which sits at the very beginning of buf.
+ * Tags that have already been decoded will be decoded again when asked for,
+ * see twirc_get_tags(); lazy tags that haven't been unescaped yet stay that
+ * way, as the copy has its own tag values.
+ */
+twirc_event_t *libtwirc_copy_event(const twirc_event_t *evt, void *buf)
+{
+	char *p = buf;
+
+	twirc_event_t *copy = (twirc_event_t *) p;
+	*copy = *evt;
+	p += LIBTWIRC_ALIGN(sizeof(twirc_event_t));
+
+	copy->decoded = (twirc_tags_t *) p;
+	copy->decoded->decoded = 0;
+	p += LIBTWIRC_ALIGN(sizeof(twirc_tags_t));
+
+	twirc_tag_t *tag_buf = (twirc_tag_t *) p;
+	p += LIBTWIRC_ALIGN(evt->num_tags * sizeof(twirc_tag_t));
+
+	twirc_tag_t **tag_ptrs = (twirc_tag_t **) p;
+	p += LIBTWIRC_ALIGN((evt->num_tags + 1) * sizeof(twirc_tag_t *));
+
+	copy->tag_index = (twirc_tag_t **) p;
+	memset(copy->tag_index, 0, TWIRC_NUM_TAG_KEYS * sizeof(twirc_tag_t *));
+	p += LIBTWIRC_ALIGN(TWIRC_NUM_TAG_KEYS * sizeof(twirc_tag_t *));
+
+	char **params = (char **) p;
+	p += LIBTWIRC_ALIGN((evt->num_params + 1) * sizeof(char *));
+
+	// From here on, it's all strings
+	copy->raw     = libtwirc_copy_str(&p, evt->raw);
+	copy->prefix  = libtwirc_copy_str(&p, evt->prefix);
+	copy->command = libtwirc_copy_str(&p, evt->command);
+
+	copy->params = NULL;
+	if (evt->params)
+	{
+		for (size_t i = 0; i < evt->num_params; ++i)
+		{
+			params[i] = libtwirc_copy_str(&p, evt->params[i]);
+		}
+		params[evt->num_params] = NULL;
+		copy->params = params;
+	}
+
+	copy->origin  = libtwirc_copy_ref(evt, copy, &p, evt->origin);
+	copy->channel = libtwirc_copy_ref(evt, copy, &p, evt->channel);
+	copy->target  = libtwirc_copy_ref(evt, copy, &p, evt->target);
+	copy->message = libtwirc_copy_ref(evt, copy, &p, evt->message);
+	copy->ctcp    = libtwirc_copy_ref(evt, copy, &p, evt->ctcp);
+
+	// Copy the tags and rebuild the index, the same way the parser does
+	copy->tags = NULL;
+	if (evt->tags)
+	{
+		for (size_t i = 0; i < evt->num_tags; ++i)
+		{
+			tag_buf[i].key     = libtwirc_copy_str(&p, evt->tags[i]->key);
+			tag_buf[i].value   = libtwirc_copy_str(&p, evt->tags[i]->value);
+			tag_buf[i].escaped = evt->tags[i]->escaped;
+			tag_ptrs[i] = &tag_buf[i];
+
+			int id = libtwirc_tag_key_id(tag_buf[i].key, strlen(tag_buf[i].key));
+			if (id != TWIRC_TAG_UNKNOWN && copy->tag_index[id] == NULL)
+			{
+				copy->tag_index[id] = &tag_buf[i];
+			}
+		}
+		tag_ptrs[evt->num_tags] = NULL;
+		copy->tags = tag_ptrs;
+	}
+	return copy;
+}
+
+/*
+ * Returns a copy of the event that stays valid after the callback returns and
+ * can be handed to other threads, or NULL if we ran out of memory. The copy,
+ * including all of its strings, tags and params, is one block of memory,
+ * allocated with a single malloc(); give it back with twirc_event_release().
+ */
+twirc_event_t *twirc_event_clone(const twirc_event_t *evt)
+{
+	void *buf = malloc(libtwirc_event_size(evt));
+	if (buf == NULL)
+	{
+		return NULL;
+	}
+	return libtwirc_copy_event(evt, buf);
+}
+
+/*
+ * Frees an event copied with twirc_event_clone(). The event, and everything
+ * it points to, must not be used afterwards. Only use this for clones; events
+ * taken from a handoff go back with twirc_handoff_release().
+ */
+void twirc_event_release(twirc_event_t *evt)
+{
+	free(evt);
+}
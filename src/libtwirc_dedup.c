@@ -0,0 +1,155 @@
+#include <stdlib.h>     // calloc(), free()
+#include <stdint.h>     // uint32_t, uint64_t
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * Remembers the last so-and-so many messages, by their id (the "id" tag) or,
+ * for those without one, their raw line, so that a message that comes in
+ * twice, over two connections, can be dropped the second time. The keys are
+ * 64 bit hashes, kept in a ring, oldest first, along with the time they were
+ * first seen and by whom. Once the ring is full, or its oldest entry is older
+ * than the window (if any), that entry is forgotten. To find a key quickly,
+ * a hash table (open addressing, linear probing) with twice as many slots as
+ * the ring has entries refers to the entries by their position in the ring.
+ */
+
+/*
+ * Initializes the set to remember up to size keys (a power of two) for up to
+ * window microseconds, or as long as there's room if window is 0. Returns 0
+ * on success, -1 if memory couldn't be allocated.
+ */
+int libtwirc_dedup_init(struct libtwirc_dedup *d, size_t size, uint64_t window)
+{
+	d->slots = calloc(2 * size, sizeof(uint32_t));
+	d->ring  = malloc(size * sizeof(struct libtwirc_seen));
+	if (d->slots == NULL || d->ring == NULL)
+	{
+		free(d->slots);
+		free(d->ring);
+		d->slots = NULL;
+		d->ring  = NULL;
+		return -1;
+	}
+	d->mask   = 2 * size - 1;
+	d->size   = size;
+	d->head   = 0;
+	d->num    = 0;
+	d->window = window;
+	return 0;
+}
+
+/*
+ * Frees the memory of the set; it can be initialized again afterwards.
+ */
+void libtwirc_dedup_free(struct libtwirc_dedup *d)
+{
+	free(d->slots);
+	free(d->ring);
+	d->slots = NULL;
+	d->ring  = NULL;
+	d->num   = 0;
+}
+
+/*
+ * Hashes the string (FNV-1a, 64 bit). 0 means "no key", so it's never returned.
+ */
+uint64_t libtwirc_dedup_hash(const char *str)
+{
+	uint64_t hash = 14695981039346656037u;
+	for (; *str != '\0'; ++str)
+	{
+		hash ^= (unsigned char) *str;
+		hash *= 1099511628211u;
+	}
+	return hash ? hash : 1;
+}
+
+/*
+ * Returns the key the event is known by: the hash of its id or, if it doesn't
+ * have one and raw is 1, of its raw line. Returns 0 if there is no key.
+ */
+uint64_t libtwirc_dedup_key(twirc_event_t *evt, int raw)
+{
+	twirc_tag_t *id = evt ? twirc_get_tag_fast(evt, TWIRC_TAG_ID) : NULL;
+	if (id != NULL && id->value[0] != '\0')
+	{
+		return libtwirc_dedup_hash(id->value);
+	}
+	if (raw && evt && evt->raw)
+	{
+		return libtwirc_dedup_hash(evt->raw);
+	}
+	return 0;
+}
+
+/*
+ * Returns the slot that refers to key or, if it isn't in the set, the empty
+ * slot it would go into.
+ */
+size_t libtwirc_dedup_find(const struct libtwirc_dedup *d, uint64_t key)
+{
+	size_t i = key & d->mask;
+	while (d->slots[i] != 0 && d->ring[d->slots[i] - 1].key != key)
+	{
+		i = (i + 1) & d->mask;
+	}
+	return i;
+}
+
+/*
+ * Forgets the oldest key. Rather than leaving a tombstone in its slot, the
+ * slots after it are moved back, if they may, so no probe runs into a gap.
+ */
+void libtwirc_dedup_pop(struct libtwirc_dedup *d)
+{
+	size_t i = libtwirc_dedup_find(d, d->ring[d->head].key);
+	for (size_t j = (i + 1) & d->mask; d->slots[j] != 0; j = (j + 1) & d->mask)
+	{
+		// The key in j may move to the gap at i only if its home slot
+		// isn't (cyclically) between the two, or it couldn't be found
+		size_t home = d->ring[d->slots[j] - 1].key & d->mask;
+		if (((j - home) & d->mask) >= ((j - i) & d->mask))
+		{
+			d->slots[i] = d->slots[j];
+			i = j;
+		}
+	}
+	d->slots[i] = 0;
+	d->head = (d->head + 1) & (d->size - 1);
+	d->num -= 1;
+}
+
+/*
+ * Looks up key, first forgetting the keys that have fallen out of the window
+ * by now. If it is known, dup is set to 1 and its entry is returned. If not,
+ * it is added, as seen now, dup is set to 0 and the new entry is returned.
+ */
+struct libtwirc_seen *libtwirc_dedup_add(struct libtwirc_dedup *d, uint64_t key, uint64_t now, int *dup)
+{
+	while (d->window && d->num > 0 && now - d->ring[d->head].time > d->window)
+	{
+		libtwirc_dedup_pop(d);
+	}
+
+	size_t i = libtwirc_dedup_find(d, key);
+	if (d->slots[i] != 0)
+	{
+		*dup = 1;
+		return &d->ring[d->slots[i] - 1];
+	}
+	if (d->num == d->size)
+	{
+		libtwirc_dedup_pop(d);
+		i = libtwirc_dedup_find(d, key);
+	}
+
+	size_t pos = (d->head + d->num) & (d->size - 1);
+	d->ring[pos].key  = key;
+	d->ring[pos].time = now;
+	d->ring[pos].leg  = 0;
+	d->slots[i] = pos + 1;
+	d->num += 1;
+	*dup = 0;
+	return &d->ring[pos];
+}
@@ -1,5 +1,6 @@
 #include <stdlib.h>     // NULL, EXIT_FAILURE, EXIT_SUCCESS
 #include <string.h>     // strlen(), strerror()
+#include <strings.h>    // strcasecmp()
 #include "libtwirc.h"
 
 /*
@@ -16,6 +17,24 @@ void libtwirc_on_null(twirc_state_t *s, twirc_event_t *evt)
 	// Nothing in here - that's on purpose
 }
 
+/*
+ * Dummy for the raw callbacks, see libtwirc_on_null().
+ */
+static inline
+void libtwirc_on_null_raw(twirc_state_t *s, const char *msg, size_t len)
+{
+	// Nothing in here - that's on purpose
+}
+
+/*
+ * Returns 1 if the event originates from us, otherwise 0.
+ */
+int libtwirc_is_self(const twirc_state_t *s, const twirc_event_t *evt)
+{
+	return evt->origin && s->login.nick && 
+	       strcasecmp(evt->origin, s->login.nick) == 0;
+}
+
 /*
  * Is being called for every message we sent to the IRC server. Note that the 
  * convenience members of the event struct ("nick", "channel", etc) will all
@@ -46,6 +65,19 @@ void libtwirc_on_invalidcmd(twirc_state_t *s, twirc_event_t *evt)
 void libtwirc_on_welcome(twirc_state_t *s, twirc_event_t *evt)
 {
 	s->status |= TWIRC_STATUS_AUTHENTICATED;
+
+	// If we lost the connection before, we're back now
+	s->reconnect_attempts = 0;
+	libtwirc_keepalive_start(s);
+	if (s->primary != NULL)
+	{
+		// We're taking over from another connection, join its channels
+		libtwirc_handover_rejoin(s);
+	}
+	else if (s->options & TWIRC_OPT_RECONNECT)
+	{
+		libtwirc_rejoin(s);
+	}
 }
 
 /*
@@ -71,8 +103,10 @@ void libtwirc_on_globaluserstate(twirc_state_t *s, twirc_event_t *evt)
 	s->status |= TWIRC_STATUS_AUTHENTICATED;
 	
 	// Save the display-name and user-id in our login struct
-	twirc_tag_t *name = twirc_get_tag_by_key(evt->tags, "display-name");
-	twirc_tag_t *id   = twirc_get_tag_by_key(evt->tags, "user-id");
+	twirc_tag_t *name = twirc_get_tag_fast(evt, TWIRC_TAG_DISPLAY_NAME);
+	twirc_tag_t *id   = twirc_get_tag_fast(evt, TWIRC_TAG_USER_ID);
+	free(s->login.name);
+	free(s->login.id);
 	s->login.name = name ? strdup(name->value) : NULL;
 	s->login.id   = id   ? strdup(id->value)   : NULL;
 }
@@ -105,6 +139,23 @@ void libtwirc_on_join(twirc_state_t *s, twirc_event_t *evt)
 	{
 		evt->channel = evt->params[0];
 	}
+
+	// If it's us, remember it, so we can rejoin after a reconnect
+	if (evt->channel && libtwirc_is_self(s, evt))
+	{
+		struct libtwirc_chan *c = libtwirc_get_chan(s, evt->channel, 
+				strlen(evt->channel), 1);
+		if (c != NULL)
+		{
+			c->joined = 1;
+		}
+
+		// Maybe that was the last one we needed to take over
+		if (s->primary != NULL)
+		{
+			libtwirc_handover_check(s);
+		}
+	}
 }
 
 /*
@@ -140,6 +191,18 @@ void libtwirc_on_mode(twirc_state_t *s, twirc_event_t *evt)
 	{
 		evt->channel = evt->params[0];
 	}
+
+	// If it's about us, remember it, as the rate limits depend on it
+	if (evt->num_params > 2 && s->login.nick && 
+	    strcasecmp(evt->params[2], s->login.nick) == 0)
+	{
+		struct libtwirc_chan *c = libtwirc_get_chan(s, evt->channel, 
+				strlen(evt->channel), 1);
+		if (c != NULL)
+		{
+			c->mod = strcmp(evt->params[1], "+o") == 0;
+		}
+	}
 }
 
 /*
@@ -153,12 +216,12 @@ void libtwirc_on_mode(twirc_state_t *s, twirc_event_t *evt)
  */
 void libtwirc_on_names(twirc_state_t *s, twirc_event_t *evt)
 {
-	if (strcmp(evt->command, "353") == 0 && evt->num_params > 2)
+	if (evt->command_id == TWIRC_COMMAND_NAMREPLY && evt->num_params > 2)
 	{
 		evt->channel = evt->params[2];
 		return;
 	}
-	if (strcmp(evt->command, "366") == 0 && evt->num_params > 1)
+	if (evt->command_id == TWIRC_COMMAND_ENDOFNAMES && evt->num_params > 1)
 	{
 		evt->channel = evt->params[1];
 		return;
@@ -176,6 +239,17 @@ void libtwirc_on_part(twirc_state_t *s, twirc_event_t *evt)
 	{
 		evt->channel = evt->params[0];
 	}
+
+	// If it's us, we don't want to rejoin after a reconnect
+	if (evt->channel && libtwirc_is_self(s, evt))
+	{
+		struct libtwirc_chan *c = libtwirc_get_chan(s, evt->channel, 
+				strlen(evt->channel), 0);
+		if (c != NULL)
+		{
+			c->joined = 0;
+		}
+	}
 }
 
 /*
@@ -271,16 +345,16 @@ void libtwirc_on_hosttarget(twirc_state_t *s, twirc_event_t *evt)
 	char *sp = strstr(evt->params[evt->trailing], " ");
 	if (sp == NULL) { return; }
 	
-	// Extract the username from the trailing parameter
-	evt->target = strndup(evt->params[evt->trailing], 
-			sp - evt->params[evt->trailing] + 1);
-	
-	// If the username was "-", we set it to NULL for better indication
-	if (strcmp(evt->target, "-") == 0)
+	// If the username is "-", we leave target NULL for better indication
+	size_t len = sp - evt->params[evt->trailing];
+	if (len == 1 && evt->params[evt->trailing][0] == '-')
 	{
-		free(evt->target);
-		evt->target = NULL;
+		return;
 	}
+
+	// Extract the username from the trailing parameter; we can't just cut
+	// it off in place, as that would cut the trailing parameter short
+	evt->target = libtwirc_strndup(s, evt->params[evt->trailing], len);
 }
 
 /*
@@ -336,7 +410,20 @@ void libtwirc_on_action(twirc_state_t *s, twirc_event_t *evt)
  */
 void libtwirc_on_reconnect(twirc_state_t *s, twirc_event_t *evt)
 {
-	// Probably nothing to do here
+	// Ideally, we get a new connection going before this one is closed
+	// (see TWIRC_OPT_HANDOVER)
+	if ((s->options & TWIRC_OPT_HANDOVER) && libtwirc_handover_start(s) == 0)
+	{
+		return;
+	}
+
+	// If we're going to reconnect anyway, there's no point in waiting for
+	// the server to close the connection; we can't do it right here, in
+	// the middle of handling the data we received, so we set a timer
+	if (s->options & TWIRC_OPT_RECONNECT)
+	{
+		twirc_timer_add(s, 0, 0, libtwirc_drop_timer, NULL);
+	}
 }
 
 /*
@@ -546,6 +633,22 @@ void libtwirc_on_userstate(twirc_state_t *s, twirc_event_t *evt)
 	{
 		evt->channel = evt->params[0];
 	}
+	else
+	{
+		return;
+	}
+
+	// USERSTATE is about us, so this tells us whether we are a mod in the
+	// channel; the broadcaster is treated the same by the rate limits
+	twirc_tag_t *mod    = twirc_get_tag_fast(evt, TWIRC_TAG_MOD);
+	twirc_tag_t *badges = twirc_get_tag_fast(evt, TWIRC_TAG_BADGES);
+	struct libtwirc_chan *c = libtwirc_get_chan(s, evt->channel, 
+			strlen(evt->channel), 1);
+	if (c != NULL)
+	{
+		c->mod = (mod && strcmp(mod->value, "1") == 0) ||
+			(badges && strstr(badges->value, "broadcaster/") != NULL);
+	}
 }
 
 /*
@@ -562,7 +665,7 @@ void libtwirc_on_whisper(twirc_state_t *s, twirc_event_t *evt)
 {
 	if (evt->num_params > 0)
 	{
-		evt->target  = strdup(evt->params[0]);
+		evt->target  = evt->params[0];
 	}
 	if (evt->num_params > evt->trailing)
 	{
@@ -612,5 +715,12 @@ void libtwirc_on_disconnect(twirc_state_t *s)
 	// this to fail; second: we don't want to override more meaningful 
 	// errors that might have occurred before 
 	tcpsock_close(s->socket_fd);
+	s->socket_fd = -1;
+
+	// No need to keep an eye on it anymore (see TWIRC_OPT_KEEPALIVE)
+	libtwirc_keepalive_stop(s);
+
+	// Come back later, if we're supposed to (see TWIRC_OPT_RECONNECT)
+	libtwirc_schedule_reconnect(s);
 }
 
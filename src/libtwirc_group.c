@@ -0,0 +1,466 @@
+#include <stdlib.h>     // malloc(), realloc(), calloc(), free()
+#include <string.h>     // strcmp(), strdup(), memset()
+#include <stdint.h>     // uint64_t
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * The redundancy group. Where a pool spreads channels across connections, a
+ * group reads the same channels over several connections (legs) at once, to
+ * different servers if need be, so losing one of them, or one of them falling
+ * behind, doesn't cost a thing. Every event is passed on once, by whichever
+ * leg receives it first; the copies the other legs receive later are dropped.
+ * Events are known by their id or, if they don't have one, by their raw line,
+ * and remembered for a while (see twirc_group_set_window()). Callbacks get the
+ * leg that won, see twirc_group_get_leg(). For every leg, we count how often
+ * it won and how often it lost, and by how much (see twirc_group_get_lag()).
+ * All legs share one reactor and one set of callbacks.
+ */
+
+/*
+ * Decides whether the event, received by leg s, is to be passed on: it is if
+ * no leg has received it before or, for events without an id, if s itself
+ * has (a line can legitimately come in twice, like a PING). Returns 1 if it
+ * is to be passed on, otherwise 0.
+ */
+int libtwirc_group_pass(twirc_state_t *s, twirc_event_t *evt)
+{
+	twirc_group_t *g = s->group;
+	uint64_t key = libtwirc_dedup_key(evt, 1);
+	if (key == 0)
+	{
+		return 1;
+	}
+
+	int dup;
+	uint64_t now = libtwirc_now_us();
+	struct libtwirc_seen *e = libtwirc_dedup_add(&g->dedup, key, now, &dup);
+	struct libtwirc_group_leg *leg = &g->legs[s->group_leg];
+	if (!dup)
+	{
+		e->leg = s->group_leg;
+		leg->wins += 1;
+		return 1;
+	}
+	if (e->leg == s->group_leg)
+	{
+		return 1;
+	}
+	leg->losses += 1;
+	leg->lag += now - e->time;
+	return 0;
+}
+
+/*
+ * Joins all of the group's channels on the given leg, with as few JOIN
+ * commands as possible. Returns 0 on success, -1 on error.
+ */
+int libtwirc_group_join_leg(twirc_group_t *g, twirc_state_t *s)
+{
+	if (g->num_chans == 0 || !twirc_is_logged_in(s))
+	{
+		return 0;
+	}
+	return twirc_cmd_join_many(s, (const char **) g->chans, g->num_chans);
+}
+
+/*
+ * Installed as the welcome callback of every leg: once a leg has logged in,
+ * it joins the group's channels, then the user's welcome callback is called
+ * (for the first leg to log in, that is, unless it's been a while).
+ */
+void libtwirc_group_on_welcome(twirc_state_t *s, twirc_event_t *evt)
+{
+	libtwirc_group_join_leg(s->group, s);
+	libtwirc_callback(s, s->group->cbs.welcome, evt);
+}
+
+/*
+ * Returns a pointer to a new group of num_legs connections, driven by the
+ * given reactor, or by a reactor of the group's own if r is NULL. Returns NULL
+ * if the group could not be created. The legs will reconnect by themselves
+ * (TWIRC_OPT_RECONNECT) once connected; set up the callbacks (see
+ * twirc_group_get_callbacks()), then connect them with twirc_group_connect()
+ * or, one by one, with twirc_group_connect_leg().
+ */
+twirc_group_t *twirc_group_init(size_t num_legs, twirc_reactor_t *r)
+{
+	if (num_legs == 0)
+	{
+		return NULL;
+	}
+
+	twirc_group_t *g = malloc(sizeof(twirc_group_t));
+	if (g == NULL) { return NULL; }
+	memset(g, 0, sizeof(twirc_group_t));
+	twirc_init_callbacks(&g->cbs);
+
+	g->reactor = r;
+	if (g->reactor == NULL)
+	{
+		g->reactor = twirc_reactor_init();
+		g->own_reactor = 1;
+	}
+	g->legs = calloc(num_legs, sizeof(struct libtwirc_group_leg));
+	if (g->reactor == NULL || g->legs == NULL ||
+	    libtwirc_dedup_init(&g->dedup, TWIRC_GROUP_DEDUP_SIZE,
+	                        (uint64_t) TWIRC_GROUP_WINDOW * 1000) == -1)
+	{
+		twirc_group_free(g);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < num_legs; ++i)
+	{
+		twirc_state_t *s = twirc_init();
+		if (s == NULL)
+		{
+			twirc_group_free(g);
+			return NULL;
+		}
+		s->group = g;
+		s->group_leg = i;
+		s->options |= TWIRC_OPT_RECONNECT;
+		g->legs[g->num_legs++].state = s;
+		twirc_reactor_add(g->reactor, s);
+	}
+	return g;
+}
+
+/*
+ * Returns a pointer to the group's twirc_callbacks structure. These callbacks
+ * will be installed in all legs when they connect, so the events of all
+ * connections end up in the same callbacks. Use twirc_get_group() from within
+ * a callback to get to the group the event came in on. Don't change the
+ * callbacks of the legs directly, as they will be overwritten.
+ */
+twirc_callbacks_t *twirc_group_get_callbacks(twirc_group_t *g)
+{
+	return &g->cbs;
+}
+
+/*
+ * Connects leg i of the group to the given server (which can be a different
+ * one for every leg), with the given credentials or, if nick is NULL,
+ * anonymously (see twirc_connect_anon()). The group's channels are joined
+ * once it has logged in. Returns 0 if the connection is in progress, -1 if
+ * there is no such leg, it is connected already or the connection attempt
+ * failed (check the leg's error).
+ */
+int twirc_group_connect_leg(twirc_group_t *g, size_t i, const char *host, const char *port, const char *nick, const char *pass)
+{
+	if (i >= g->num_legs)
+	{
+		return -1;
+	}
+	twirc_state_t *s = g->legs[i].state;
+	if (s->status != TWIRC_STATUS_DISCONNECTED || twirc_is_reconnecting(s))
+	{
+		return -1;
+	}
+
+	// Everything goes to the group's callbacks, but we need to know when
+	// legs log in, so we can have them join the channels
+	s->cbs = g->cbs;
+	s->cbs.welcome = libtwirc_group_on_welcome;
+
+	return nick ? twirc_connect(s, host, port, nick, pass)
+	            : twirc_connect_anon(s, host, port);
+}
+
+/*
+ * Connects all legs of the group that aren't connected (or about to
+ * reconnect) to the given server, see twirc_group_connect_leg(). Returns 0 if
+ * all connections are in progress, -1 if at least one connection attempt
+ * failed (check the errors of the legs).
+ */
+int twirc_group_connect(twirc_group_t *g, const char *host, const char *port, const char *nick, const char *pass)
+{
+	int ret = 0;
+	for (size_t i = 0; i < g->num_legs; ++i)
+	{
+		twirc_state_t *s = g->legs[i].state;
+		if (s->status != TWIRC_STATUS_DISCONNECTED || twirc_is_reconnecting(s))
+		{
+			continue;
+		}
+		if (twirc_group_connect_leg(g, i, host, port, nick, pass) == -1)
+		{
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Returns the index of the group's channel of the given name, or SIZE_MAX if
+ * there is none.
+ */
+size_t libtwirc_group_find(twirc_group_t *g, const char *name)
+{
+	for (size_t i = 0; i < g->num_chans; ++i)
+	{
+		if (strcmp(g->chans[i], name) == 0)
+		{
+			return i;
+		}
+	}
+	return SIZE_MAX;
+}
+
+/*
+ * Adds the channel to the group and joins it on all legs that are logged in;
+ * the others will join it once they are. Returns 0 on success (including if
+ * the channel is part of the group already), -1 if out of memory or sending
+ * the JOIN command failed on any leg.
+ */
+int twirc_group_join(twirc_group_t *g, const char *chan)
+{
+	return twirc_group_join_many(g, &chan, 1);
+}
+
+/*
+ * Adds all n channels in chans to the group and joins them, with as few JOIN
+ * commands as possible, see twirc_group_join().
+ */
+int twirc_group_join_many(twirc_group_t *g, const char **chans, size_t n)
+{
+	if (g->num_chans + n > g->chans_size)
+	{
+		size_t size = g->chans_size ? g->chans_size : TWIRC_CHANS_SIZE;
+		while (size < g->num_chans + n)
+		{
+			size *= 2;
+		}
+		char **c = realloc(g->chans, size * sizeof(char *));
+		if (c == NULL)
+		{
+			return -1;
+		}
+		g->chans = c;
+		g->chans_size = size;
+	}
+
+	// Only the new ones need to be joined
+	const char **added = (const char **) g->chans + g->num_chans;
+	size_t num_added = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (libtwirc_group_find(g, chans[i]) != SIZE_MAX)
+		{
+			continue;
+		}
+		char *name = strdup(chans[i]);
+		if (name == NULL)
+		{
+			return -1;
+		}
+		g->chans[g->num_chans++] = name;
+		num_added += 1;
+	}
+	if (num_added == 0)
+	{
+		return 0;
+	}
+
+	int ret = 0;
+	for (size_t i = 0; i < g->num_legs; ++i)
+	{
+		twirc_state_t *s = g->legs[i].state;
+		if (twirc_is_logged_in(s) && twirc_cmd_join_many(s, added, num_added) == -1)
+		{
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Leaves the channel on all legs and removes it from the group. Returns 0 on
+ * success (including if the channel isn't part of the group), -1 if sending
+ * the PART command failed on any leg.
+ */
+int twirc_group_part(twirc_group_t *g, const char *chan)
+{
+	size_t c = libtwirc_group_find(g, chan);
+	if (c == SIZE_MAX)
+	{
+		return 0;
+	}
+
+	int ret = 0;
+	for (size_t i = 0; i < g->num_legs; ++i)
+	{
+		twirc_state_t *s = g->legs[i].state;
+		if (twirc_is_logged_in(s) && twirc_cmd_part(s, g->chans[c]) == -1)
+		{
+			ret = -1;
+		}
+	}
+
+	// Fill the gap with the last channel
+	free(g->chans[c]);
+	g->chans[c] = g->chans[--g->num_chans];
+	return ret;
+}
+
+/*
+ * Sets for how long (in milliseconds) the group remembers the events it has
+ * passed on, and how many of them at most (a power of two), the defaults
+ * being TWIRC_GROUP_WINDOW and TWIRC_GROUP_DEDUP_SIZE. The window has to
+ * cover the most that any leg may lag behind the others, and the size has to
+ * cover all the events coming in during that time, or the late copies will be
+ * passed on as well. Forgets all events seen so far. Returns 0 on success, -1
+ * if size isn't a power of two or memory couldn't be allocated (in which case
+ * the previous settings are kept).
+ */
+int twirc_group_set_window(twirc_group_t *g, unsigned ms, size_t size)
+{
+	if (size == 0 || (size & (size - 1)) != 0 || size > UINT32_MAX / 2)
+	{
+		return -1;
+	}
+	struct libtwirc_dedup d;
+	if (libtwirc_dedup_init(&d, size, (uint64_t) ms * 1000) == -1)
+	{
+		return -1;
+	}
+	libtwirc_dedup_free(&g->dedup);
+	g->dedup = d;
+	return 0;
+}
+
+/*
+ * Returns the group's leg with the given index (0 to the number of legs minus
+ * 1), for example to set its options, or NULL if there is no such leg.
+ */
+twirc_state_t *twirc_group_get_state(twirc_group_t *g, size_t i)
+{
+	return i < g->num_legs ? g->legs[i].state : NULL;
+}
+
+/*
+ * Returns the number of legs (connections) of the group.
+ */
+size_t twirc_group_get_num_legs(const twirc_group_t *g)
+{
+	return g->num_legs;
+}
+
+/*
+ * Returns the group the given state is a leg of, or NULL if it isn't part of
+ * a group. Useful in callbacks, which all of a group's legs have in common.
+ */
+twirc_group_t *twirc_get_group(twirc_state_t *s)
+{
+	return s->group;
+}
+
+/*
+ * Returns the index of the given leg within its group. Within a callback,
+ * this tells which leg the event came in on first.
+ */
+size_t twirc_group_get_leg(const twirc_state_t *s)
+{
+	return s->group_leg;
+}
+
+/*
+ * Returns how many events leg i was the first to receive, or 0 if there is
+ * no such leg.
+ */
+uint64_t twirc_group_get_wins(const twirc_group_t *g, size_t i)
+{
+	return i < g->num_legs ? g->legs[i].wins : 0;
+}
+
+/*
+ * Returns how many events leg i received after another leg had already, or
+ * 0 if there is no such leg.
+ */
+uint64_t twirc_group_get_losses(const twirc_group_t *g, size_t i)
+{
+	return i < g->num_legs ? g->legs[i].losses : 0;
+}
+
+/*
+ * Returns how far, on average, leg i was behind the winning leg, in
+ * microseconds, for the events it didn't receive first, or 0 if there have
+ * been none or there is no such leg.
+ */
+uint64_t twirc_group_get_lag(const twirc_group_t *g, size_t i)
+{
+	if (i >= g->num_legs || g->legs[i].losses == 0)
+	{
+		return 0;
+	}
+	return g->legs[i].lag / g->legs[i].losses;
+}
+
+/*
+ * Sets the group's context, a pointer to user data.
+ */
+void twirc_group_set_context(twirc_group_t *g, void *ctx)
+{
+	g->context = ctx;
+}
+
+/*
+ * Returns the group's context, see twirc_group_set_context().
+ */
+void *twirc_group_get_context(twirc_group_t *g)
+{
+	return g->context;
+}
+
+/*
+ * Returns the reactor that drives the group's connections.
+ */
+twirc_reactor_t *twirc_group_get_reactor(twirc_group_t *g)
+{
+	return g->reactor;
+}
+
+/*
+ * Waits timeout milliseconds for events on the group's connections and
+ * handles them, see twirc_reactor_tick(). If the group shares its reactor with
+ * other states, their events will be handled as well.
+ */
+int twirc_group_tick(twirc_group_t *g, int timeout)
+{
+	return twirc_reactor_tick(g->reactor, timeout);
+}
+
+/*
+ * Runs an endless loop that handles the events on the group's connections,
+ * until none of them is connected (or about to reconnect) anymore, see
+ * twirc_reactor_loop().
+ */
+int twirc_group_loop(twirc_group_t *g)
+{
+	return twirc_reactor_loop(g->reactor);
+}
+
+/*
+ * Frees the group, including all of its legs (whose connections had better
+ * be closed already, see twirc_disconnect()) and its own reactor, if any.
+ */
+void twirc_group_free(twirc_group_t *g)
+{
+	for (size_t i = 0; i < g->num_legs; ++i)
+	{
+		twirc_free(g->legs[i].state);
+	}
+	for (size_t i = 0; i < g->num_chans; ++i)
+	{
+		free(g->chans[i]);
+	}
+	if (g->own_reactor && g->reactor != NULL)
+	{
+		twirc_reactor_free(g->reactor);
+	}
+	libtwirc_dedup_free(&g->dedup);
+	free(g->legs);
+	free(g->chans);
+	free(g);
+}
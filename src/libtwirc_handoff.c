@@ -0,0 +1,367 @@
+#include <stdlib.h>     // malloc(), calloc(), free()
+#include <string.h>     // memset()
+#include <stdint.h>     // intptr_t, uint64_t
+#include <stddef.h>     // offsetof()
+#include <unistd.h>     // read(), write(), close()
+#include <poll.h>       // poll()
+#include <sched.h>      // sched_yield()
+#include <stdatomic.h>  // atomic_*
+#include <sys/eventfd.h> // eventfd()
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * The handoff. Usually, callbacks are called right from the thread that reads
+ * from the socket, and the event's memory is reused as soon as they return.
+ * That's fine for quick callbacks, but for slow ones, it holds up the
+ * connection. With a handoff, the internal event handlers still run right
+ * away, but instead of calling the user callback, the event is copied into a
+ * self-contained block (see libtwirc_copy.c) and published on a ring, from
+ * which any number of consumer threads take the events and call the callbacks
+ * (see twirc_handoff_run()). Blocks come from a fixed pool that is allocated
+ * up front, and go back to it when the consumer releases them, so handing off
+ * an event doesn't allocate any memory (unless the event is too large for a
+ * block, which is very rare). Both the ring of published events and the ring
+ * of free blocks are bounded lock-free MPMC queues, so several connections
+ * (or workers) can publish to the same handoff, for several consumers. If all
+ * blocks are in use, the publishing connection waits for one to be released,
+ * which in turn makes the server wait for us; nothing is ever dropped.
+ */
+
+/*
+ * Header of a block; the copy of the event follows right after it.
+ */
+struct libtwirc_block
+{
+	twirc_handoff_t *handoff;          // Handoff the block belongs to
+	twirc_state_t *state;              // State the event came in on
+	twirc_callback cb;                 // Callback to call for the event
+	int big;                           // Allocated separately, not pooled
+	max_align_t evt[];                 // The event
+};
+
+/*
+ * Initializes the ring with room for size (a power of two) elements.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int libtwirc_ring_init(struct libtwirc_ring *r, size_t size)
+{
+	r->cells = malloc(size * sizeof(struct libtwirc_cell));
+	if (r->cells == NULL)
+	{
+		return -1;
+	}
+	for (size_t i = 0; i < size; ++i)
+	{
+		atomic_init(&r->cells[i].seq, i);
+		r->cells[i].data = NULL;
+	}
+	r->mask = size - 1;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	return 0;
+}
+
+/*
+ * Adds data to the ring. Every cell carries a sequence number that tells
+ * whether it is free for the producer at a given position (seq == pos) or
+ * holds data for the consumer at that position (seq == pos + 1); producers
+ * claim a position by advancing head. Returns 0 on success, -1 if full.
+ */
+int libtwirc_ring_push(struct libtwirc_ring *r, void *data)
+{
+	size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+	for (;;)
+	{
+		struct libtwirc_cell *c = &r->cells[pos & r->mask];
+		size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+		if (dif == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + 1,
+						memory_order_relaxed, memory_order_relaxed))
+			{
+				c->data = data;
+				atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+				return 0;
+			}
+		}
+		else if (dif < 0)
+		{
+			return -1;
+		}
+		else
+		{
+			pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+		}
+	}
+}
+
+/*
+ * Takes the oldest element off the ring, see libtwirc_ring_push(). Returns
+ * the element or NULL if the ring is empty.
+ */
+void *libtwirc_ring_pop(struct libtwirc_ring *r)
+{
+	size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	for (;;)
+	{
+		struct libtwirc_cell *c = &r->cells[pos & r->mask];
+		size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t) seq - (intptr_t) (pos + 1);
+		if (dif == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1,
+						memory_order_relaxed, memory_order_relaxed))
+			{
+				void *data = c->data;
+				atomic_store_explicit(&c->seq, pos + r->mask + 1, memory_order_release);
+				return data;
+			}
+		}
+		else if (dif < 0)
+		{
+			return NULL;
+		}
+		else
+		{
+			pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+		}
+	}
+}
+
+/*
+ * Returns a pointer to a new handoff with num_blocks blocks (rounded up to the
+ * next power of two; TWIRC_HANDOFF_BLOCKS if 0), each of which can hold an
+ * event of up to TWIRC_BLOCK_SIZE bytes, or NULL if it could not be created.
+ * Enable it for a state with twirc_set_handoff().
+ */
+twirc_handoff_t *twirc_handoff_init(size_t num_blocks)
+{
+	size_t size = 1;
+	while (size < (num_blocks ? num_blocks : TWIRC_HANDOFF_BLOCKS))
+	{
+		size *= 2;
+	}
+
+	twirc_handoff_t *h = malloc(sizeof(twirc_handoff_t));
+	if (h == NULL) { return NULL; }
+	memset(h, 0, sizeof(twirc_handoff_t));
+	atomic_init(&h->waiters, 0);
+
+	h->num_blocks = size;
+	h->block_size = LIBTWIRC_ALIGN(sizeof(struct libtwirc_block) + TWIRC_BLOCK_SIZE);
+	h->efd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK);
+	h->blocks = malloc(h->num_blocks * h->block_size);
+
+	// The event ring gets twice the room, so there is always room for the
+	// big events, which don't come out of the pool, as well
+	if (h->efd < 0 || h->blocks == NULL ||
+	    libtwirc_ring_init(&h->free, size) == -1 ||
+	    libtwirc_ring_init(&h->events, 2 * size) == -1)
+	{
+		twirc_handoff_free(h);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < h->num_blocks; ++i)
+	{
+		struct libtwirc_block *b = (struct libtwirc_block *) (h->blocks + i * h->block_size);
+		b->handoff = h;
+		b->big = 0;
+		libtwirc_ring_push(&h->free, b);
+	}
+	return h;
+}
+
+/*
+ * Copies the event into a block and publishes it on the handoff's ring, so
+ * that one of the consumers will call cb for it. Waits for a block to become
+ * available if all of them are in use. Returns 0 on success, -1 if the event
+ * was too big for a block and we ran out of memory allocating one.
+ */
+int libtwirc_handoff_push(twirc_handoff_t *h, twirc_state_t *s, twirc_callback cb, twirc_event_t *evt)
+{
+	struct libtwirc_block *b = NULL;
+	size_t size = libtwirc_event_size(evt);
+	if (size <= TWIRC_BLOCK_SIZE)
+	{
+		while ((b = libtwirc_ring_pop(&h->free)) == NULL)
+		{
+			sched_yield();
+		}
+	}
+	else
+	{
+		b = malloc(sizeof(struct libtwirc_block) + size);
+		if (b == NULL)
+		{
+			return libtwirc_oom(s);
+		}
+		b->handoff = h;
+		b->big = 1;
+	}
+
+	b->state = s;
+	b->cb = cb;
+	libtwirc_copy_event(evt, b->evt);
+
+	while (libtwirc_ring_push(&h->events, b) == -1)
+	{
+		sched_yield();
+	}
+
+	// Only bother the kernel if there actually is someone waiting. The
+	// fence keeps the load of waiters from being done before the push is
+	// visible; paired with the one in twirc_handoff_pop(), either we see
+	// the waiter or the waiter sees the event, never neither
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&h->waiters) > 0)
+	{
+		uint64_t one = 1;
+		if (write(h->efd, &one, sizeof(one)) == -1)
+		{
+			// Counter is full, so they'll be woken up anyway
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns the block the given event (as returned by twirc_handoff_pop()) is
+ * the copy in.
+ */
+struct libtwirc_block *libtwirc_event_block(twirc_event_t *evt)
+{
+	return (struct libtwirc_block *) ((char *) evt - offsetof(struct libtwirc_block, evt));
+}
+
+/*
+ * Takes the oldest event off the handoff's ring, waiting up to timeout ms for
+ * one to arrive if there is none (-1 means forever, 0 means don't wait). If s
+ * isn't NULL, the state the event came in on is stored in it. The event and
+ * all its data stay valid until it is given back with twirc_handoff_release().
+ * Can be called from any number of threads at once; events of the same state
+ * will be taken in order, but if there are several consumers, they might be
+ * done with them in a different order. Returns NULL if there was no event.
+ */
+twirc_event_t *twirc_handoff_pop(twirc_handoff_t *h, int timeout, twirc_state_t **s)
+{
+	struct libtwirc_block *b = libtwirc_ring_pop(&h->events);
+	if (b == NULL && timeout != 0)
+	{
+		uint64_t deadline = libtwirc_now() + timeout;
+		atomic_fetch_add(&h->waiters, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		// Check again after announcing that we're waiting, in case an
+		// event came in right before, when nobody would have woken us
+		while ((b = libtwirc_ring_pop(&h->events)) == NULL)
+		{
+			int wait = -1;
+			if (timeout > 0)
+			{
+				uint64_t now = libtwirc_now();
+				if (now >= deadline)
+				{
+					break;
+				}
+				wait = (int) (deadline - now);
+			}
+
+			struct pollfd pfd = { h->efd, POLLIN, 0 };
+			if (poll(&pfd, 1, wait) <= 0)
+			{
+				break;
+			}
+			uint64_t val;
+			if (read(h->efd, &val, sizeof(val)) == -1)
+			{
+				// Another consumer was faster, try again
+			}
+		}
+		atomic_fetch_sub(&h->waiters, 1);
+	}
+
+	if (b == NULL)
+	{
+		return NULL;
+	}
+	if (s != NULL)
+	{
+		*s = b->state;
+	}
+	return (twirc_event_t *) b->evt;
+}
+
+/*
+ * Gives an event taken from a handoff with twirc_handoff_pop() back, so its
+ * block can be reused. The event must not be used afterwards.
+ */
+void twirc_handoff_release(twirc_event_t *evt)
+{
+	struct libtwirc_block *b = libtwirc_event_block(evt);
+	if (b->big)
+	{
+		free(b);
+		return;
+	}
+	libtwirc_ring_push(&b->handoff->free, b);
+}
+
+/*
+ * Takes the oldest event off the handoff's ring (waiting up to timeout ms for
+ * one, see twirc_handoff_pop()), calls the callback it was meant for, with
+ * the state it came in on, and releases it. This is what consumer threads
+ * should call in a loop. Note that the callbacks run in the consumer thread,
+ * so they must not use the state in ways that aren't thread-safe. Returns 1
+ * if an event has been handled, 0 if there was none.
+ */
+int twirc_handoff_run(twirc_handoff_t *h, int timeout)
+{
+	twirc_state_t *s;
+	twirc_event_t *evt = twirc_handoff_pop(h, timeout, &s);
+	if (evt == NULL)
+	{
+		return 0;
+	}
+	libtwirc_event_block(evt)->cb(s, evt);
+	twirc_handoff_release(evt);
+	return 1;
+}
+
+/*
+ * Makes the state hand its events off to the given handoff, or, if h is NULL,
+ * call the callbacks right away again. The connect and disconnect callbacks,
+ * as well as the outbound ones, are always called right away. Several states
+ * can share the same handoff.
+ */
+void twirc_set_handoff(twirc_state_t *s, twirc_handoff_t *h)
+{
+	s->handoff = h;
+}
+
+/*
+ * Frees the handoff. All states using it need to have been switched to
+ * another handoff (or none) and all consumers need to have stopped; events
+ * that haven't been taken yet are discarded.
+ */
+void twirc_handoff_free(twirc_handoff_t *h)
+{
+	if (h->events.cells != NULL)
+	{
+		struct libtwirc_block *b;
+		while ((b = libtwirc_ring_pop(&h->events)) != NULL)
+		{
+			twirc_handoff_release((twirc_event_t *) b->evt);
+		}
+	}
+	if (h->efd >= 0)
+	{
+		close(h->efd);
+	}
+	free(h->free.cells);
+	free(h->events.cells);
+	free(h->blocks);
+	free(h);
+}
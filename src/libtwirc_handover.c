@@ -0,0 +1,411 @@
+#include <stdlib.h>     // malloc(), free()
+#include <string.h>     // memcpy(), strlen()
+#include <sys/epoll.h>  // epoll_ctl()
+#include "tcpsock.h"
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * Handing over to a new connection (make-before-break). When the server
+ * announces that it is going to restart (RECONNECT), a state with the
+ * TWIRC_OPT_HANDOVER option doesn't wait for the connection to be closed, but
+ * connects again right away, in the background: its successor, a state of
+ * its own, which shares our epoll instance (or reactor), logs in with our
+ * login data and joins the channels we are in. Once it is in all of them, its
+ * connection becomes ours, the old one is closed and the successor is freed.
+ *
+ * While both connections are up, both hand their events to our callbacks, as
+ * if they were ours; messages that come in over both (they all have an "id"
+ * tag) are only passed on the first time. Events without an id, like the
+ * successor's welcome and its JOINs, only come from the old connection, until
+ * the switch. After the switch, we keep dropping duplicates for a little while
+ * (TWIRC_HANDOVER_LINGER), as the new connection might still deliver some
+ * messages that the old one got to first.
+ *
+ * If the successor can't connect, loses its connection or doesn't get done in
+ * time (TWIRC_HANDOVER_TIMEOUT), we give up on it and keep going with the old
+ * connection until the server closes it, as we would have without the option.
+ */
+
+/*
+ * Timer callback that stops dropping duplicates, some time after a handover.
+ */
+void libtwirc_dedup_timer(twirc_state_t *s, void *arg)
+{
+	s->dedup_timer = 0;
+	libtwirc_dedup_free(&s->dedup);
+}
+
+/*
+ * Keeps dropping duplicates for another TWIRC_HANDOVER_LINGER milliseconds.
+ */
+void libtwirc_handover_linger(twirc_state_t *s)
+{
+	if (s->dedup_timer != 0)
+	{
+		twirc_timer_cancel(s, s->dedup_timer);
+	}
+	s->dedup_timer = twirc_timer_add(s, TWIRC_HANDOVER_LINGER, 0,
+			libtwirc_dedup_timer, NULL);
+	if (s->dedup_timer == 0)
+	{
+		// Better to let a few duplicates through than to keep the
+		// memory forever
+		libtwirc_dedup_free(&s->dedup);
+	}
+}
+
+/*
+ * Disconnect callback of the successor: the handover failed.
+ */
+void libtwirc_handover_on_disconnect(twirc_state_t *n, twirc_event_t *evt)
+{
+	if (n->primary->successor == n)
+	{
+		libtwirc_handover_abort(n->primary);
+	}
+}
+
+/*
+ * Timer callback that gives up on a handover that took too long.
+ */
+void libtwirc_handover_timeout(twirc_state_t *s, void *arg)
+{
+	s->handover_timer = 0;
+	libtwirc_handover_abort(s);
+}
+
+/*
+ * Timer callback that switches over to the successor.
+ */
+void libtwirc_handover_timer(twirc_state_t *s, void *arg)
+{
+	s->handover_timer = 0;
+	libtwirc_handover_switch(s);
+}
+
+/*
+ * Starts a handover: sets up the successor and has it connect. Pools take
+ * care of their shards' channels themselves, so they don't get to do this.
+ * Returns 0 on success, -1 if there can't be a handover right now.
+ */
+int libtwirc_handover_start(twirc_state_t *s)
+{
+	if (s->pool != NULL || s->primary != NULL || s->successor != NULL ||
+	    s->retired != NULL || s->login.host == NULL || !twirc_is_logged_in(s))
+	{
+		return -1;
+	}
+	if (s->dedup.slots == NULL &&
+	    libtwirc_dedup_init(&s->dedup, TWIRC_DEDUP_SIZE, 0) == -1)
+	{
+		return libtwirc_oom(s);
+	}
+
+	twirc_state_t *n = twirc_init();
+	if (n == NULL)
+	{
+		return libtwirc_oom(s);
+	}
+
+	// Our events are the successor's events, mostly, but its connection
+	// is none of the user's business (see libtwirc_callback())
+	n->primary = s;
+	n->options = s->options & (TWIRC_OPT_LAZY_TAGS | TWIRC_OPT_CORK);
+	n->ip_type = s->ip_type;
+	n->cbs     = s->cbs;
+	n->cbs.connect      = libtwirc_on_null;
+	n->cbs.disconnect   = libtwirc_handover_on_disconnect;
+	n->cbs.outbound     = libtwirc_on_null;
+	n->cbs.outbound_raw = libtwirc_on_null_raw;
+	n->context = s->context;
+	memcpy(n->limits, s->limits, sizeof(s->limits));
+
+	// It is driven along with us, by our reactor or in our epoll instance
+	if (s->reactor != NULL)
+	{
+		twirc_reactor_add(s->reactor, n);
+	}
+	else
+	{
+		n->epfd = s->epfd;
+	}
+
+	twirc_login_t *l = &s->login;
+	if (twirc_connect(n, l->host, l->port, l->nick, l->pass) == -1)
+	{
+		s->error = n->error;
+		tcpsock_close(n->socket_fd);
+		n->socket_fd = -1;
+		if (n->reactor == NULL)
+		{
+			n->epfd = -1;
+		}
+		twirc_free(n);
+		return -1;
+	}
+
+	s->successor = n;
+	s->handover_timer = twirc_timer_add(s, TWIRC_HANDOVER_TIMEOUT, 0,
+			libtwirc_handover_timeout, NULL);
+	if (s->dedup_timer != 0)
+	{
+		twirc_timer_cancel(s, s->dedup_timer);
+		s->dedup_timer = 0;
+	}
+	return 0;
+}
+
+/*
+ * Joins the channels of the successor's primary state. Called once the
+ * successor is logged in. Returns 0 on success, -1 on error.
+ */
+int libtwirc_handover_rejoin(twirc_state_t *n)
+{
+	twirc_state_t *s = n->primary;
+	if (s->num_chans > 0)
+	{
+		const char **names = malloc(s->num_chans * sizeof(char *));
+		if (names == NULL)
+		{
+			return libtwirc_oom(n);
+		}
+
+		size_t num = 0;
+		for (size_t i = 0; i < s->chans_size; ++i)
+		{
+			if (s->chans[i] != NULL && s->chans[i]->joined)
+			{
+				names[num++] = s->chans[i]->name;
+			}
+		}
+
+		int ret = num ? twirc_cmd_join_many(n, names, num) : 0;
+		free(names);
+		if (ret == -1)
+		{
+			return -1;
+		}
+	}
+
+	// Maybe there was nothing to join
+	libtwirc_handover_check(n);
+	return 0;
+}
+
+/*
+ * Returns the number of channels that state s is in, but state n isn't, and
+ * puts their names into names, if it isn't NULL.
+ */
+size_t libtwirc_handover_missing(twirc_state_t *s, twirc_state_t *n, const char **names)
+{
+	size_t num = 0;
+	for (size_t i = 0; i < s->chans_size; ++i)
+	{
+		struct libtwirc_chan *c = s->chans[i];
+		if (c == NULL || !c->joined)
+		{
+			continue;
+		}
+		struct libtwirc_chan *nc = libtwirc_get_chan(n, c->name, strlen(c->name), 0);
+		if (nc == NULL || !nc->joined)
+		{
+			if (names != NULL)
+			{
+				names[num] = c->name;
+			}
+			++num;
+		}
+	}
+	return num;
+}
+
+/*
+ * Checks whether the successor is logged in and in all the channels that its
+ * primary state is in; if so, has the primary switch over. Called whenever
+ * the successor has joined a channel. We can't switch right here, in the
+ * middle of handling the successor's data, so we set a timer.
+ */
+void libtwirc_handover_check(twirc_state_t *n)
+{
+	twirc_state_t *s = n->primary;
+	if (s->successor != n || !twirc_is_logged_in(n) ||
+	    libtwirc_handover_missing(s, n, NULL) > 0)
+	{
+		return;
+	}
+	if (s->handover_timer != 0)
+	{
+		twirc_timer_cancel(s, s->handover_timer);
+	}
+	s->handover_timer = twirc_timer_add(s, 0, 0, libtwirc_handover_timer, NULL);
+}
+
+/*
+ * Lets go of the successor: closes its connection, takes it out of our epoll
+ * instance or reactor and leaves it to be freed at the start of the next tick
+ * (see libtwirc_handover_reap()). It can't be freed right away, as events for
+ * it might be waiting to be handled in this tick; these will be ignored (see
+ * libtwirc_handle_epoll()).
+ */
+void libtwirc_handover_retire(twirc_state_t *s)
+{
+	twirc_state_t *n = s->successor;
+	s->successor = NULL;
+	s->retired = n;
+
+	if (s->handover_timer != 0)
+	{
+		twirc_timer_cancel(s, s->handover_timer);
+		s->handover_timer = 0;
+	}
+
+	if (n->socket_fd >= 0 && n->status != TWIRC_STATUS_DISCONNECTED)
+	{
+		tcpsock_close(n->socket_fd);
+	}
+	n->socket_fd = -1;
+	n->status = TWIRC_STATUS_DISCONNECTED;
+
+	if (n->reactor != NULL)
+	{
+		twirc_reactor_remove(n->reactor, n);
+	}
+	else
+	{
+		epoll_ctl(n->epfd, EPOLL_CTL_DEL, n->wake_fd, NULL);
+		n->epfd = -1;
+	}
+}
+
+/*
+ * Gives up on the handover, if there is one going on; we keep going with the
+ * connection we have. Messages the successor delivered might still come in
+ * over our connection, so we keep dropping duplicates for a while.
+ */
+void libtwirc_handover_abort(twirc_state_t *s)
+{
+	if (s->successor == NULL)
+	{
+		return;
+	}
+	libtwirc_handover_retire(s);
+	libtwirc_handover_linger(s);
+}
+
+/*
+ * Switches over to the successor: its connection becomes ours, while ours is
+ * closed. If the successor isn't in all our channels yet, which happens if we
+ * lost our connection before it was done, these are joined (again) now.
+ * Returns 0 on success, -1 if the successor isn't even logged in yet, in which
+ * case the handover is called off.
+ */
+int libtwirc_handover_switch(twirc_state_t *s)
+{
+	twirc_state_t *n = s->successor;
+	if (n == NULL)
+	{
+		return -1;
+	}
+
+	// Have the successor's socket report to us from now on
+	struct epoll_event eev = { 0 };
+	eev.data.ptr = s;
+	eev.events = EPOLLRDHUP | EPOLLOUT | EPOLLIN | EPOLLET;
+	if (!twirc_is_logged_in(n) ||
+	    epoll_ctl(s->epfd, EPOLL_CTL_MOD, n->socket_fd, &eev) == -1)
+	{
+		libtwirc_handover_abort(s);
+		return -1;
+	}
+
+	// Close our connection; whatever is left of it is a duplicate
+	tcpsock_close(s->socket_fd);
+
+	// Take over the successor's connection, along with whatever it has
+	// received or is about to send; it gets our old buffers, to be freed
+	// along with it
+	char *buffer = s->buffer;
+	s->buffer   = n->buffer;
+	s->buf_head = n->buf_head;
+	s->buf_scan = n->buf_scan;
+	s->buf_tail = n->buf_tail;
+	s->buf_skip = n->buf_skip;
+	n->buffer   = buffer;
+
+	char *sendq = s->sendq;
+	size_t sendq_size = s->sendq_size;
+	s->sendq      = n->sendq;
+	s->sendq_size = n->sendq_size;
+	s->sendq_head = n->sendq_head;
+	s->sendq_tail = n->sendq_tail;
+	n->sendq      = sendq;
+	n->sendq_size = sendq_size;
+
+	s->socket_fd = n->socket_fd;
+	s->status    = n->status;
+	s->last_recv = libtwirc_now();
+	s->ping_sent = 0;
+	n->socket_fd = -1;
+	n->status    = TWIRC_STATUS_DISCONNECTED;
+
+	// Join what the successor didn't get to (JOINs it still held back
+	// go down with it); we use our names, as the successor goes away
+	size_t num = libtwirc_handover_missing(s, n, NULL);
+	if (num > 0)
+	{
+		const char **names = malloc(num * sizeof(char *));
+		if (names != NULL)
+		{
+			libtwirc_handover_missing(s, n, names);
+			twirc_cmd_join_many(s, names, num);
+			free(names);
+		}
+	}
+
+	libtwirc_handover_retire(s);
+	libtwirc_handover_linger(s);
+	return 0;
+}
+
+/*
+ * Frees the former successor, if there is one. Called before waiting for new
+ * events, when there can't be any old ones for it anymore.
+ */
+void libtwirc_handover_reap(twirc_state_t *s)
+{
+	if (s->retired != NULL)
+	{
+		twirc_free(s->retired);
+		s->retired = NULL;
+	}
+}
+
+/*
+ * Ends a handover, if there is one going on, and frees all that's left of it.
+ */
+void libtwirc_handover_free(twirc_state_t *s)
+{
+	libtwirc_handover_abort(s);
+	libtwirc_handover_reap(s);
+	libtwirc_dedup_free(&s->dedup);
+}
+
+/*
+ * Decides whether the event, received by state s, is to be handed to the user
+ * during or shortly after a handover. Events with an id are, unless they have
+ * been seen before; others only if s isn't a successor. Returns 1 if so, else
+ * 0.
+ */
+int libtwirc_handover_pass(twirc_state_t *s, twirc_event_t *evt)
+{
+	twirc_state_t *p = s->primary ? s->primary : s;
+	uint64_t key = p->dedup.slots ? libtwirc_dedup_key(evt, 0) : 0;
+	if (key == 0)
+	{
+		return s->primary == NULL;
+	}
+	int dup;
+	libtwirc_dedup_add(&p->dedup, key, 0, &dup);
+	return !dup;
+}
@@ -0,0 +1,259 @@
+#include <stdint.h>     // uint8_t
+#include <string.h>     // strlen(), strcmp(), strncmp()
+#include "libtwirc.h"
+
+/*
+ * Names of all the commands libtwirc knows about, indexed by their 
+ * TWIRC_COMMAND_* constant. The unknown command has an empty name, which
+ * makes sure that no command name will ever be found to match it.
+ */
+const char *libtwirc_command_names[TWIRC_NUM_COMMANDS] =
+{
+	[TWIRC_COMMAND_UNKNOWN]         = "",
+	[TWIRC_COMMAND_PRIVMSG]         = "PRIVMSG",
+	[TWIRC_COMMAND_JOIN]            = "JOIN",
+	[TWIRC_COMMAND_PART]            = "PART",
+	[TWIRC_COMMAND_CLEARCHAT]       = "CLEARCHAT",
+	[TWIRC_COMMAND_CLEARMSG]        = "CLEARMSG",
+	[TWIRC_COMMAND_NOTICE]          = "NOTICE",
+	[TWIRC_COMMAND_ROOMSTATE]       = "ROOMSTATE",
+	[TWIRC_COMMAND_USERSTATE]       = "USERSTATE",
+	[TWIRC_COMMAND_USERNOTICE]      = "USERNOTICE",
+	[TWIRC_COMMAND_WHISPER]         = "WHISPER",
+	[TWIRC_COMMAND_PING]            = "PING",
+	[TWIRC_COMMAND_PONG]            = "PONG",
+	[TWIRC_COMMAND_MODE]            = "MODE",
+	[TWIRC_COMMAND_CAP]             = "CAP",
+	[TWIRC_COMMAND_HOSTTARGET]      = "HOSTTARGET",
+	[TWIRC_COMMAND_GLOBALUSERSTATE] = "GLOBALUSERSTATE",
+	[TWIRC_COMMAND_RECONNECT]       = "RECONNECT",
+	[TWIRC_COMMAND_NICK]            = "NICK",
+	[TWIRC_COMMAND_PASS]            = "PASS",
+	[TWIRC_COMMAND_QUIT]            = "QUIT",
+	[TWIRC_COMMAND_WELCOME]         = "001",
+	[TWIRC_COMMAND_YOURHOST]        = "002",
+	[TWIRC_COMMAND_CREATED]         = "003",
+	[TWIRC_COMMAND_MYINFO]          = "004",
+	[TWIRC_COMMAND_NAMREPLY]        = "353",
+	[TWIRC_COMMAND_ENDOFNAMES]      = "366",
+	[TWIRC_COMMAND_MOTD]            = "372",
+	[TWIRC_COMMAND_MOTDSTART]       = "375",
+	[TWIRC_COMMAND_ENDOFMOTD]       = "376",
+	[TWIRC_COMMAND_UNKNOWNCOMMAND]  = "421",
+};
+
+/*
+ * Perfect hash table for the command names above: maps the hash of every 
+ * known command (see libtwirc_command_hash()) to its TWIRC_COMMAND_* constant.
+ * The hash function has been chosen so that no two known commands end up in 
+ * the same slot. All empty slots map to TWIRC_COMMAND_UNKNOWN (zero). If you
+ * add a command, make sure it doesn't collide with any of the existing ones;
+ * if it does, you'll have to find new multipliers for the hash function.
+ */
+const uint8_t libtwirc_command_slots[64] =
+{
+	[ 2] = TWIRC_COMMAND_MOTDSTART,
+	[ 3] = TWIRC_COMMAND_PONG,
+	[ 5] = TWIRC_COMMAND_ENDOFMOTD,
+	[ 6] = TWIRC_COMMAND_ROOMSTATE,
+	[ 7] = TWIRC_COMMAND_NICK,
+	[ 8] = TWIRC_COMMAND_PRIVMSG,
+	[10] = TWIRC_COMMAND_UNKNOWNCOMMAND,
+	[12] = TWIRC_COMMAND_JOIN,
+	[15] = TWIRC_COMMAND_CAP,
+	[16] = TWIRC_COMMAND_NAMREPLY,
+	[19] = TWIRC_COMMAND_CLEARCHAT,
+	[22] = TWIRC_COMMAND_WELCOME,
+	[23] = TWIRC_COMMAND_RECONNECT,
+	[25] = TWIRC_COMMAND_YOURHOST,
+	[27] = TWIRC_COMMAND_WHISPER,
+	[28] = TWIRC_COMMAND_CREATED,
+	[31] = TWIRC_COMMAND_MYINFO,
+	[32] = TWIRC_COMMAND_HOSTTARGET,
+	[36] = TWIRC_COMMAND_USERSTATE,
+	[37] = TWIRC_COMMAND_USERNOTICE,
+	[43] = TWIRC_COMMAND_CLEARMSG,
+	[47] = TWIRC_COMMAND_ENDOFNAMES,
+	[48] = TWIRC_COMMAND_QUIT,
+	[51] = TWIRC_COMMAND_PASS,
+	[52] = TWIRC_COMMAND_GLOBALUSERSTATE,
+	[54] = TWIRC_COMMAND_PART,
+	[55] = TWIRC_COMMAND_MODE,
+	[57] = TWIRC_COMMAND_MOTD,
+	[59] = TWIRC_COMMAND_NOTICE,
+	[63] = TWIRC_COMMAND_PING,
+};
+
+/*
+ * Hashes the given command, which has to be at least three characters long,
+ * into one of the 64 slots of libtwirc_command_slots. Only looks at the first,
+ * second and last character as well as the length, which is enough to tell 
+ * all known commands apart, including the numeric ones.
+ */
+unsigned int libtwirc_command_hash(const char *cmd, size_t len)
+{
+	return (2  * (unsigned char) cmd[0] +
+	        22 * (unsigned char) cmd[1] +
+	        3  * (unsigned char) cmd[len - 1] + len) & 63;
+}
+
+/*
+ * Resolves the given command, for example "PRIVMSG" or "001", to its
+ * TWIRC_COMMAND_* constant, using a perfect hash followed by a single string
+ * comparison. Returns TWIRC_COMMAND_UNKNOWN if the command isn't known.
+ */
+int libtwirc_command_id(const char *cmd)
+{
+	// All known commands are at least three characters long
+	size_t len = strlen(cmd);
+	if (len < 3)
+	{
+		return TWIRC_COMMAND_UNKNOWN;
+	}
+
+	// Look up the slot, then make sure it really is the same command
+	int id = libtwirc_command_slots[libtwirc_command_hash(cmd, len)];
+	return strcmp(cmd, libtwirc_command_names[id]) == 0 ? id : TWIRC_COMMAND_UNKNOWN;
+}
+
+/*
+ * Keys of all the tags libtwirc knows about, indexed by their TWIRC_TAG_* 
+ * constant. Again, the unknown key is empty so that nothing ever matches it.
+ */
+const char *libtwirc_tag_keys[TWIRC_NUM_TAG_KEYS] =
+{
+	[TWIRC_TAG_UNKNOWN]                          = "",
+	[TWIRC_TAG_BADGE_INFO]                       = "badge-info",
+	[TWIRC_TAG_BADGES]                           = "badges",
+	[TWIRC_TAG_BAN_DURATION]                     = "ban-duration",
+	[TWIRC_TAG_BITS]                             = "bits",
+	[TWIRC_TAG_BROADCASTER_LANG]                 = "broadcaster-lang",
+	[TWIRC_TAG_CLIENT_NONCE]                     = "client-nonce",
+	[TWIRC_TAG_COLOR]                            = "color",
+	[TWIRC_TAG_DISPLAY_NAME]                     = "display-name",
+	[TWIRC_TAG_EMOTE_ONLY]                       = "emote-only",
+	[TWIRC_TAG_EMOTE_SETS]                       = "emote-sets",
+	[TWIRC_TAG_EMOTES]                           = "emotes",
+	[TWIRC_TAG_FIRST_MSG]                        = "first-msg",
+	[TWIRC_TAG_FLAGS]                            = "flags",
+	[TWIRC_TAG_FOLLOWERS_ONLY]                   = "followers-only",
+	[TWIRC_TAG_ID]                               = "id",
+	[TWIRC_TAG_LOGIN]                            = "login",
+	[TWIRC_TAG_MOD]                              = "mod",
+	[TWIRC_TAG_MSG_ID]                           = "msg-id",
+	[TWIRC_TAG_MSG_PARAM_CUMULATIVE_MONTHS]      = "msg-param-cumulative-months",
+	[TWIRC_TAG_MSG_PARAM_DISPLAY_NAME]           = "msg-param-displayName",
+	[TWIRC_TAG_MSG_PARAM_LOGIN]                  = "msg-param-login",
+	[TWIRC_TAG_MSG_PARAM_MONTHS]                 = "msg-param-months",
+	[TWIRC_TAG_MSG_PARAM_RECIPIENT_DISPLAY_NAME] = "msg-param-recipient-display-name",
+	[TWIRC_TAG_MSG_PARAM_RECIPIENT_ID]           = "msg-param-recipient-id",
+	[TWIRC_TAG_MSG_PARAM_RECIPIENT_USER_NAME]    = "msg-param-recipient-user-name",
+	[TWIRC_TAG_MSG_PARAM_RITUAL_NAME]            = "msg-param-ritual-name",
+	[TWIRC_TAG_MSG_PARAM_SHOULD_SHARE_STREAK]    = "msg-param-should-share-streak",
+	[TWIRC_TAG_MSG_PARAM_STREAK_MONTHS]          = "msg-param-streak-months",
+	[TWIRC_TAG_MSG_PARAM_SUB_PLAN]               = "msg-param-sub-plan",
+	[TWIRC_TAG_MSG_PARAM_SUB_PLAN_NAME]          = "msg-param-sub-plan-name",
+	[TWIRC_TAG_MSG_PARAM_VIEWER_COUNT]           = "msg-param-viewerCount",
+	[TWIRC_TAG_R9K]                              = "r9k",
+	[TWIRC_TAG_REPLY_PARENT_MSG_ID]              = "reply-parent-msg-id",
+	[TWIRC_TAG_ROOM_ID]                          = "room-id",
+	[TWIRC_TAG_SLOW]                             = "slow",
+	[TWIRC_TAG_SUBS_ONLY]                        = "subs-only",
+	[TWIRC_TAG_SUBSCRIBER]                       = "subscriber",
+	[TWIRC_TAG_SYSTEM_MSG]                       = "system-msg",
+	[TWIRC_TAG_TARGET_MSG_ID]                    = "target-msg-id",
+	[TWIRC_TAG_TARGET_USER_ID]                   = "target-user-id",
+	[TWIRC_TAG_TMI_SENT_TS]                      = "tmi-sent-ts",
+	[TWIRC_TAG_TURBO]                            = "turbo",
+	[TWIRC_TAG_USER_ID]                          = "user-id",
+	[TWIRC_TAG_USER_TYPE]                        = "user-type",
+	[TWIRC_TAG_VIP]                              = "vip",
+};
+
+/*
+ * Perfect hash table for the tag keys above, see libtwirc_tag_hash(). Works 
+ * just like libtwirc_command_slots, except it needs 128 slots, as there are
+ * more tag keys than commands and quite a few of them look very much alike.
+ */
+const uint8_t libtwirc_tag_slots[128] =
+{
+	[  0] = TWIRC_TAG_MSG_PARAM_RECIPIENT_USER_NAME,
+	[  5] = TWIRC_TAG_R9K,
+	[  7] = TWIRC_TAG_TURBO,
+	[  8] = TWIRC_TAG_MSG_PARAM_SUB_PLAN_NAME,
+	[  9] = TWIRC_TAG_MSG_PARAM_RECIPIENT_ID,
+	[ 11] = TWIRC_TAG_REPLY_PARENT_MSG_ID,
+	[ 12] = TWIRC_TAG_COLOR,
+	[ 13] = TWIRC_TAG_SYSTEM_MSG,
+	[ 15] = TWIRC_TAG_LOGIN,
+	[ 18] = TWIRC_TAG_MOD,
+	[ 27] = TWIRC_TAG_EMOTE_ONLY,
+	[ 28] = TWIRC_TAG_BADGES,
+	[ 40] = TWIRC_TAG_SUBS_ONLY,
+	[ 41] = TWIRC_TAG_MSG_ID,
+	[ 46] = TWIRC_TAG_FOLLOWERS_ONLY,
+	[ 47] = TWIRC_TAG_ROOM_ID,
+	[ 48] = TWIRC_TAG_MSG_PARAM_CUMULATIVE_MONTHS,
+	[ 49] = TWIRC_TAG_MSG_PARAM_RECIPIENT_DISPLAY_NAME,
+	[ 55] = TWIRC_TAG_TARGET_MSG_ID,
+	[ 59] = TWIRC_TAG_ID,
+	[ 63] = TWIRC_TAG_VIP,
+	[ 64] = TWIRC_TAG_USER_ID,
+	[ 67] = TWIRC_TAG_CLIENT_NONCE,
+	[ 71] = TWIRC_TAG_TMI_SENT_TS,
+	[ 76] = TWIRC_TAG_DISPLAY_NAME,
+	[ 82] = TWIRC_TAG_USER_TYPE,
+	[ 83] = TWIRC_TAG_SLOW,
+	[ 86] = TWIRC_TAG_MSG_PARAM_LOGIN,
+	[ 88] = TWIRC_TAG_BITS,
+	[ 91] = TWIRC_TAG_FLAGS,
+	[ 92] = TWIRC_TAG_MSG_PARAM_SHOULD_SHARE_STREAK,
+	[ 93] = TWIRC_TAG_EMOTES,
+	[ 94] = TWIRC_TAG_BAN_DURATION,
+	[ 97] = TWIRC_TAG_MSG_PARAM_SUB_PLAN,
+	[100] = TWIRC_TAG_MSG_PARAM_RITUAL_NAME,
+	[101] = TWIRC_TAG_SUBSCRIBER,
+	[103] = TWIRC_TAG_EMOTE_SETS,
+	[104] = TWIRC_TAG_TARGET_USER_ID,
+	[108] = TWIRC_TAG_BADGE_INFO,
+	[112] = TWIRC_TAG_MSG_PARAM_DISPLAY_NAME,
+	[117] = TWIRC_TAG_MSG_PARAM_MONTHS,
+	[118] = TWIRC_TAG_MSG_PARAM_STREAK_MONTHS,
+	[121] = TWIRC_TAG_FIRST_MSG,
+	[124] = TWIRC_TAG_BROADCASTER_LANG,
+	[126] = TWIRC_TAG_MSG_PARAM_VIEWER_COUNT,
+};
+
+/*
+ * Hashes the given tag key of length len, which has to be at least two, into 
+ * one of the 128 slots of libtwirc_tag_slots. Looks at the first, middle and 
+ * last character as well as the length; the "msg-param-" keys all start the 
+ * same, so the second character wouldn't help much.
+ */
+unsigned int libtwirc_tag_hash(const char *key, size_t len)
+{
+	return (1  * (unsigned char) key[0] +
+	        54 * (unsigned char) key[len / 2] +
+	        30 * (unsigned char) key[len - 1] + len) & 127;
+}
+
+/*
+ * Resolves the given tag key of length len (it doesn't have to be null 
+ * terminated), for example "user-id", to its TWIRC_TAG_* constant, using a 
+ * perfect hash followed by a single string comparison. Returns 
+ * TWIRC_TAG_UNKNOWN if the key isn't known.
+ */
+int libtwirc_tag_key_id(const char *key, size_t len)
+{
+	// All known keys are at least two characters long
+	if (len < 2)
+	{
+		return TWIRC_TAG_UNKNOWN;
+	}
+
+	// Look up the slot, then make sure it really is the same key
+	int id = libtwirc_tag_slots[libtwirc_tag_hash(key, len)];
+	const char *known = libtwirc_tag_keys[id];
+	return strncmp(key, known, len) == 0 && known[len] == '\0' ? 
+		id : TWIRC_TAG_UNKNOWN;
+}
@@ -1,81 +1,506 @@
 #ifndef LIBTWIRC_INTERNAL_H
 #define LIBTWIRC_INTERNAL_H
 
+#include <stdint.h>     // uint16_t
+#include <signal.h>     // sigset_t
+#include <sys/epoll.h>  // struct epoll_event
+#include <pthread.h>    // pthread_t
+#include <stdatomic.h>  // atomic_int
 #include "libtwirc.h"
 
+// Size of the state's receive buffer. It is twice the message size so it can
+// easily hold an incomplete message in addition to a complete one.
+#define TWIRC_RECV_SIZE (2 * TWIRC_MESSAGE_SIZE)
+
+// Number of line ends libtwirc_process_data() looks for in one go.
+#define TWIRC_SCAN_LINES 64
+
+// Once less than this many bytes are left at the end of the receive buffer, 
+// the unprocessed data is moved to the front, so recv() has some room again.
+#define TWIRC_RECV_MIN (TWIRC_MESSAGE_SIZE / 4)
+
+// Initial and maximum size of the state's send queue, which holds the data 
+// that couldn't be sent right away because the socket wasn't ready for it.
+#define TWIRC_SENDQ_SIZE (2 * TWIRC_MESSAGE_SIZE)
+#define TWIRC_SENDQ_MAX  (128 * TWIRC_MESSAGE_SIZE)
+
+// How long twirc_disconnect() waits, at most, for the socket to take all the
+// queued data, including the QUIT, before it closes the socket (in ms).
+#define TWIRC_DRAIN_TIMEOUT 1000
+
+// Number of bytes from the inbox (messages from other threads) that are sent
+// in one batch, at most; needs to leave the send queue some room to spare.
+#define TWIRC_INBOX_MAX  (TWIRC_SENDQ_MAX / 2)
+
+// The timer wheel has TWIRC_WHEEL_LEVELS levels of 2^TWIRC_WHEEL_BITS slots;
+// a slot of level L spans 64^L ms, so the wheel reaches 64^4 ms (about 4.6
+// hours) ahead. Timers further out than that wait in an overflow bucket. The
+// wheel starts out with room for TWIRC_TIMERS_SIZE timers and grows as needed.
+#define TWIRC_WHEEL_BITS   6
+#define TWIRC_WHEEL_SLOTS  (1 << TWIRC_WHEEL_BITS)
+#define TWIRC_WHEEL_LEVELS 4
+#define TWIRC_WHEEL_SPAN   (1ULL << (TWIRC_WHEEL_BITS * TWIRC_WHEEL_LEVELS))
+#define TWIRC_TIMERS_SIZE  16
+
+// Index of no timer, ends the lists of timers.
+#define LIBTWIRC_TIMER_NIL UINT32_MAX
+
+// Initial number of slots of the state's channel table (a power of two).
+#define TWIRC_CHANS_SIZE 16
+
+// Size of the state's event arena, which holds all memory needed while an 
+// event is being handled, including that of events nested within it.
+#define TWIRC_ARENA_SIZE (4 * TWIRC_MESSAGE_SIZE)
+
+// Shard index of a pool's channel that isn't joined on any shard right now.
+#define TWIRC_POOL_NONE SIZE_MAX
+
+// Types of tag values, as far as decoding them into twirc_tags is concerned
+#define LIBTWIRC_TAG_TYPE_NONE 0      // Not decoded (no twirc_tags member)
+#define LIBTWIRC_TAG_TYPE_STR  1      // String, char *
+#define LIBTWIRC_TAG_TYPE_INT  2      // Integer or boolean, int
+#define LIBTWIRC_TAG_TYPE_U64  3      // Large number (IDs, times), uint64_t
+
 /*
  * Structures
  */
 
-// https://pastebin.com/qzzvpuB6
-// TODO come up with a solution of how to hand the relevant meta data 
-//      of certain events to the user (in the callbacks) without adding
-//      a dozen function arguments; maybe use a twirc_tags struct that
-//      contains one member for each possible tag? But there are plenty!
-//      Alternatively, have two to three dedicated structs that will be
-//      set or be NULL depending on the type of event? For example, one 
-//      struct twirc_message_details, one struct twirc_user_details?
-/*
-struct twirc_tags
-{
-	char *badges;
-	int ban_duration;
-	int bits;
-	char *broadcaster_lang;
-	char *color;
-	char *display_name;
-	char *emotes;
-	int emote_only;
-	char *emote-sets;
-	int followers_only;
-	char *id;
-	char *login;
-	int mod;
-	char *msg_id;
-	// int msg_param_cumulative_months; -> msg_param_months
-	char *msg_param_display_name;
-	char *msg_param_login;
-	int msg_param_months;
-	char *msg_param_recipient_display_name;
-	char *msg_param_recipient_id;
-	char *msg_param_recipient_user_name;
-	int msg_param_should_share_streak;
-	int msg_param_streak_months;
-	char *msg-param-sub-plan;
-	char *msg-param-sub-plan-name;
-	int msg_param_viewer_count;
-	char *msg_param_ritual_name;
-	int r9k;
-	char *room_id;
-	int slow;
-	int subs_only;
-	char *system_msg;
-	char *target_msg_id;
-	char *tmi_sent_ts;
-	char *user_id;
-};
-*/
+/*
+ * Bump allocator that backs all memory allocated while handling events, see
+ * libtwirc_arena.c; big is the list of allocations that didn't fit into buf.
+ */
+struct libtwirc_arena
+{
+	char *buf;                         // Memory block
+	size_t size;                       // Size of buf
+	size_t used;                       // Bytes of buf in use
+	struct libtwirc_arena_big *big;    // Fallback allocations, newest first
+};
+
+/*
+ * Fill level of an arena, as returned by libtwirc_arena_mark().
+ */
+struct libtwirc_mark
+{
+	size_t used;
+	struct libtwirc_arena_big *big;
+};
+
+/*
+ * Type of a well-known tag's value and the offset of the twirc_tags member 
+ * it will be decoded into; libtwirc_tag_fields has one of these per key.
+ */
+struct libtwirc_tag_field
+{
+	int type;                          // LIBTWIRC_TAG_TYPE_*
+	size_t offset;                     // Offset within twirc_tags
+};
+
+/*
+ * A rate limit: count messages per ms milliseconds; count 0 means no limit.
+ */
+struct libtwirc_limit
+{
+	unsigned count;
+	unsigned ms;
+};
+
+/*
+ * A message that has been held back by the rate limiter, including its
+ * "\r\n"; these form a list per bucket, the oldest first.
+ */
+struct libtwirc_held
+{
+	struct libtwirc_held *next;        // Next message in the same bucket
+	unsigned cost;                     // Tokens this message takes
+	size_t len;                        // Length of data
+	char data[];                       // The message
+};
+
+/*
+ * Token bucket of the rate limiter, see libtwirc_limit.c.
+ */
+struct libtwirc_bucket
+{
+	int limit;                         // TWIRC_LIMIT_* that applies
+	struct libtwirc_chan *chan;        // Channel, for chat message buckets
+	double tokens;                     // Messages we may send right now
+	uint64_t last;                     // When tokens was updated (in ms)
+	struct libtwirc_held *held;        // Messages held back, oldest first
+	struct libtwirc_held *held_tail;   // Message held back last
+	struct libtwirc_bucket *next_waiting; // Next bucket with held messages
+	int waiting;                       // We're in the state's waiting list
+};
+
+/*
+ * What we know about a channel, see libtwirc_chans.c.
+ */
+struct libtwirc_chan
+{
+	char *name;                        // Channel name, including the '#'
+	int mod;                           // We are a moderator here
+	int joined;                        // We are in here (or were, see rejoin)
+	struct libtwirc_bucket privmsg;    // Rate limit for chat messages
+};
+
+/*
+ * Message sent from another thread, waiting in a state's inbox for the thread
+ * driving the state to send it, see libtwirc_async.c.
+ */
+struct libtwirc_note
+{
+	_Atomic(struct libtwirc_note *) next; // Next newer message
+	char *msg;                         // The message, follows the struct
+};
+
+/*
+ * Timer of a state's timer wheel, see libtwirc_timers.c. Timers live in one
+ * array and refer to each other by index, so the array can grow; the slot's
+ * generation makes sure a stale timer ID can't cancel the slot's next timer.
+ */
+struct libtwirc_timer
+{
+	uint64_t expires;                  // When it's due, see libtwirc_now()
+	unsigned interval;                 // Repeat every so many ms, or 0
+	twirc_timer_callback cb;           // Function to call when it's due
+	void *arg;                         // Argument to pass to cb
+	uint32_t gen;                      // Generation, bumped on every reuse
+	uint32_t prev;                     // Previous timer in the same bucket
+	uint32_t next;                     // Next timer in bucket or free list
+	int bucket;                        // Bucket it's in, -1 if none
+};
+
+/*
+ * A state's hierarchical timer wheel, driven by a timerfd in the state's
+ * epoll set. Bucket i of level L is buckets[L * TWIRC_WHEEL_SLOTS + i], the
+ * last bucket holds the timers that are too far out for the wheel.
+ */
+struct libtwirc_wheel
+{
+	int fd;                            // timerfd, -1 until the first timer
+	uint64_t now;                      // First ms not handled yet
+	uint64_t armed;                    // Time the timerfd is set to, or 0
+	struct libtwirc_timer *timers;     // All timers, used or not
+	uint32_t size;                     // Number of elements in timers
+	uint32_t num;                      // Number of timers in the wheel
+	uint32_t free;                     // First unused timer
+	uint32_t buckets[TWIRC_WHEEL_LEVELS * TWIRC_WHEEL_SLOTS + 1];
+	uint64_t used[TWIRC_WHEEL_LEVELS]; // Bitmaps of non-empty buckets
+};
+
+/*
+ * A message seen recently, see libtwirc_dedup.c.
+ */
+struct libtwirc_seen
+{
+	uint64_t key;                      // Hash of the id (or raw line)
+	uint64_t time;                     // First seen at (microseconds)
+	size_t leg;                        // Seen first by (group leg index)
+};
+
+/*
+ * Keys of the messages seen recently, see libtwirc_dedup.c.
+ */
+struct libtwirc_dedup
+{
+	uint32_t *slots;                   // Hash table, ring position + 1
+	size_t mask;                       // Number of slots minus one
+	struct libtwirc_seen *ring;        // The messages, oldest first
+	size_t size;                       // Number of elements in ring
+	size_t head;                       // Oldest message in ring
+	size_t num;                        // Number of messages in ring
+	uint64_t window;                   // Forget them after (us), or 0
+};
 
 struct twirc_state
 {
 	int status : 8;                    // Connection/login status
+	int options;                       // Options (TWIRC_OPT_*)
 	int ip_type;                       // IP type, IPv4 or IPv6
 	int socket_fd;                     // TCP socket file descriptor
-	char *buffer;                      // IRC message buffer
+	char *buffer;                      // IRC message (receive) buffer
+	size_t buf_head;                   // Start of unprocessed data
+	size_t buf_scan;                   // End of data scanned for '\n'
+	size_t buf_tail;                   // End of received data
+	int buf_skip;                      // Skip data until next "\r\n"
+	struct libtwirc_arena arena;       // Memory for event handling
+	char *sendq;                       // Data waiting to be sent
+	size_t sendq_size;                 // Size of sendq
+	size_t sendq_head;                 // Start of data waiting in sendq
+	size_t sendq_tail;                 // End of data waiting in sendq
+	int batch;                         // Nesting depth of open batches
+	struct libtwirc_chan **chans;      // Channel table (hash table)
+	size_t chans_size;                 // Number of slots in chans
+	size_t num_chans;                  // Number of channels in chans
+	struct libtwirc_limit limits[TWIRC_NUM_LIMITS]; // Rate limits
+	struct libtwirc_bucket join;       // Rate limit for JOINs
+	struct libtwirc_bucket whisper;    // Rate limit for whispers
+	struct libtwirc_bucket *waiting;   // Buckets with held messages
+	int held_stuck;                    // Send queue took no more, wait
 	twirc_login_t login;               // IRC login data 
 	twirc_callbacks_t cbs;             // Event callbacks
 	int epfd;                          // epoll file descriptor
+	struct epoll_event *events;        // Events array for epoll_pwait()
+	int max_events;                    // Number of elements in events
+	sigset_t sigmask;                  // Signals blocked in epoll_pwait()
+	twirc_reactor_t *reactor;          // Reactor driving us, if any
+	twirc_state_t *next_state;         // Next state of the reactor
+	twirc_state_t *next_deferred;      // Next state that hit its budget
+	int deferred;                      // We hit our budget, are in line
+	twirc_pool_t *pool;                // Pool we're a shard of, if any
+	twirc_group_t *group;              // Group we're a leg of, if any
+	size_t group_leg;                  // Our index within the group
+	twirc_handoff_t *handoff;          // Where events go, if not to cbs
+	int wake_fd;                       // eventfd, signals a full inbox
+	struct libtwirc_note *inbox_next;  // Taken from inbox, but not sent yet
+	_Atomic(struct libtwirc_note *) inbox_head; // Newest message in inbox
+	struct libtwirc_note *inbox_tail;  // Oldest message in inbox
+	struct libtwirc_note inbox_stub;   // Keeps the inbox from being empty
+	struct libtwirc_wheel wheel;       // Timers
+	int quit;                          // Disconnecting on purpose
+	unsigned reconnect_min;            // First reconnect delay (ms)
+	unsigned reconnect_max;            // Maximum reconnect delay (ms)
+	unsigned reconnect_attempts;       // Reconnects since last login
+	uint64_t reconnect_timer;          // Timer of pending reconnect, or 0
+	uint32_t rng;                      // State of random number generator
+	twirc_state_t *primary;            // State we're taking over from
+	twirc_state_t *successor;          // State taking over from us
+	twirc_state_t *retired;            // Former successor, to be freed
+	uint64_t handover_timer;           // Switches or gives up on handover
+	uint64_t dedup_timer;              // Stops dropping duplicates
+	struct libtwirc_dedup dedup;       // Ids of messages seen (handover)
+	unsigned keepalive_idle;           // PING after this long idle (ms)
+	unsigned keepalive_timeout;        // Wait this long for PONG (ms)
+	uint64_t keepalive_timer;          // Timer of the keepalive, or 0
+	uint64_t last_recv;                // Last time data came in (ms)
+	uint64_t ping_sent;                // Our PING went out (us), or 0
+	char ping_token[16];               // Token of our PING
+	uint64_t rtt;                      // Smoothed round-trip time (us)
+	uint64_t rtt_hist[TWIRC_RTT_BUCKETS]; // Round-trip times (histogram)
 	int error;                         // Last error that occured
 	void *context;                     // Pointer to user data
 };
 
+/*
+ * Drives the connections of any number of states with one epoll instance, see
+ * libtwirc_reactor.c. All the states are kept in a list (states), the ones 
+ * that have hit their read budget in another (deferred, first in line first).
+ */
+struct twirc_reactor
+{
+	int epfd;                          // epoll file descriptor
+	struct epoll_event *events;        // Events array for epoll_pwait()
+	int max_events;                    // Number of elements in events
+	sigset_t sigmask;                  // Signals blocked in epoll_pwait()
+	size_t budget;                     // Bytes per state per round
+	twirc_state_t *states;             // All states of this reactor
+	twirc_state_t *deferred;           // States that hit their budget
+	twirc_state_t *deferred_tail;      // Last of the deferred states
+};
+
+/*
+ * Point on a pool's hash ring, see libtwirc_pool.c.
+ */
+struct libtwirc_pool_point
+{
+	uint32_t hash;                     // Position on the ring
+	size_t shard;                      // Index of the shard it belongs to
+};
+
+/*
+ * Channel of a pool and the shard it is joined on.
+ */
+struct libtwirc_pool_chan
+{
+	char *name;                        // Channel name, including the '#'
+	size_t shard;                      // Shard index or TWIRC_POOL_NONE
+	int pending;                       // Moved, JOIN not yet sent
+};
+
+/*
+ * Spreads channels across several connections (shards), see libtwirc_pool.c.
+ */
+struct twirc_pool
+{
+	twirc_reactor_t *reactor;          // Reactor driving the shards
+	int own_reactor;                   // We created it, we free it
+	twirc_state_t **shards;            // The connections
+	size_t num_shards;                 // Number of shards
+	struct libtwirc_pool_point *ring;  // Hash ring, sorted by hash
+	size_t ring_size;                  // Number of points on the ring
+	struct libtwirc_pool_chan *chans;  // All channels of the pool
+	size_t chans_size;                 // Number of elements in chans
+	size_t num_chans;                  // Number of channels in chans
+	twirc_callbacks_t cbs;             // Callbacks shared by all shards
+	void *context;                     // Pointer to user data
+};
+
+/*
+ * Connection of a redundancy group, along with how it's been doing.
+ */
+struct libtwirc_group_leg
+{
+	twirc_state_t *state;              // The connection
+	uint64_t wins;                     // Events it received first
+	uint64_t losses;                   // Events it received late
+	uint64_t lag;                      // Sum of how late (microseconds)
+};
+
+/*
+ * Reads the same channels over several connections (legs), passing on every
+ * event only once, see libtwirc_group.c.
+ */
+struct twirc_group
+{
+	twirc_reactor_t *reactor;          // Reactor driving the legs
+	int own_reactor;                   // We created it, we free it
+	struct libtwirc_group_leg *legs;   // The connections
+	size_t num_legs;                   // Number of legs
+	char **chans;                      // Channels of the group
+	size_t chans_size;                 // Number of elements in chans
+	size_t num_chans;                  // Number of channels in chans
+	struct libtwirc_dedup dedup;       // Events passed on recently
+	twirc_callbacks_t cbs;             // Callbacks shared by all legs
+	void *context;                     // Pointer to user data
+};
+
+/*
+ * One thread, pinned to one core, driving one reactor, see libtwirc_workers.c.
+ */
+struct libtwirc_worker
+{
+	twirc_workers_t *workers;          // Workers this one belongs to
+	twirc_reactor_t *reactor;          // Reactor driven by this worker
+	pthread_t thread;                  // The worker's thread
+	int cpu;                           // Core to pin to, -1 for none
+	size_t num_states;                 // States added to the reactor
+};
+
+/*
+ * A number of workers, see libtwirc_workers.c.
+ */
+struct twirc_workers
+{
+	struct libtwirc_worker *workers;   // The workers
+	size_t num_workers;                // Number of workers
+	atomic_int running;                // Workers should keep running
+	int started;                       // Threads have been started
+};
+
+/*
+ * Cell of a lock-free ring, see libtwirc_ring_push().
+ */
+struct libtwirc_cell
+{
+	atomic_size_t seq;                 // Position the cell is ready for
+	void *data;                        // The element
+};
+
+/*
+ * Bounded lock-free queue for any number of producers and consumers. Head
+ * and tail each get a cache line of their own, so producers and consumers
+ * don't get in each other's way.
+ */
+struct libtwirc_ring
+{
+	struct libtwirc_cell *cells;       // The cells
+	size_t mask;                       // Number of cells minus 1
+	_Alignas(64) atomic_size_t head;   // Next position to push to
+	_Alignas(64) atomic_size_t tail;   // Next position to pop from
+};
+
+/*
+ * Hands events off to consumer threads, see libtwirc_handoff.c.
+ */
+struct twirc_handoff
+{
+	struct libtwirc_ring events;       // Published events
+	struct libtwirc_ring free;         // Blocks that are free to use
+	char *blocks;                      // Memory of all blocks
+	size_t block_size;                 // Size of a block, including header
+	size_t num_blocks;                 // Number of blocks
+	int efd;                           // eventfd to wake up consumers
+	atomic_int waiters;                // Consumers waiting for events
+};
+
+/*
+ * Entry of the event dispatcher's jump table: the internal event handler for
+ * a command and the offset of the matching user callback in twirc_callbacks.
+ */
+struct libtwirc_handler
+{
+	void (*handle)(twirc_state_t *s, twirc_event_t *evt);
+	size_t callback;
+};
+
+/*
+ * Offset table of all the delimiters (spaces, semicolons and equal signs) in
+ * an IRC message, as created by libtwirc_scan(). The tokenizers consume the
+ * entries in order, so the message only has to be scanned once.
+ */
+struct libtwirc_delims
+{
+	char *line;                        // Message the offsets refer to
+	uint16_t pos[TWIRC_RECV_SIZE];     // Offsets of the delimiters
+	size_t num;                        // Number of offsets in pos
+	size_t cur;                        // Index of next unconsumed offset
+};
+
+/*
+ * Memory backing a twirc_event while it is being parsed and dispatched. The
+ * parser slices the message up in place, so all it needs on top of that is a
+ * copy of the unmodified message, room for the nick (which is extracted from 
+ * the prefix and can therefore not be sliced out of it), the arrays that hold
+ * the tags and params and the offset table of the message's delimiters. This
+ * struct lives on the stack of the function that processes a message, so no
+ * memory has to be allocated for the event, unless it happens to have more
+ * than TWIRC_NUM_TAGS tags, in which case they go into the state's arena.
+ */
+struct libtwirc_evtmem
+{
+	char raw[TWIRC_RECV_SIZE];                   // Unmodified message
+	char origin[TWIRC_NICK_SIZE];                // Nick from the prefix
+	twirc_tag_t tag_buf[TWIRC_NUM_TAGS];         // Tag structs
+	twirc_tag_t *tag_ptrs[TWIRC_NUM_TAGS + 1];   // NULL-terminated tags
+	twirc_tag_t *tag_index[TWIRC_NUM_TAG_KEYS];  // Known tags, by key
+	twirc_tags_t decoded;                        // Decoded known tags
+	char *params[TWIRC_MAX_PARAMS + 1];          // NULL-terminated params
+	struct libtwirc_delims delims;               // Delimiters in message
+};
+
 /*
  * Private functions
  */
 
+int libtwirc_oom(twirc_state_t *s);
+void *libtwirc_oom_null(twirc_state_t *s);
 int libtwirc_send(twirc_state_t *s, const char *msg);
 int libtwirc_recv(twirc_state_t *s, char *buf, size_t len);
 int libtwirc_auth(twirc_state_t *s);
 int libtwirc_capreq(twirc_state_t *s);
+char *libtwirc_unescape(char *str);
+void libtwirc_init_sigmask(sigset_t *sigset);
+int libtwirc_handle_event(twirc_state_t *s, struct epoll_event *epev);
+int libtwirc_send_async(twirc_state_t *s, const char *msg);
+int libtwirc_in_tick(const twirc_state_t *s);
+uint64_t libtwirc_now();
+void libtwirc_init_bucket(struct libtwirc_bucket *b, int limit, struct libtwirc_chan *chan);
+void libtwirc_clear_bucket(twirc_state_t *s, struct libtwirc_bucket *b);
+struct libtwirc_chan *libtwirc_get_chan(twirc_state_t *s, const char *name, size_t len, int create);
+void twirc_init_callbacks(twirc_callbacks_t *cbs);
+void libtwirc_callback(twirc_state_t *s, twirc_callback cb, twirc_event_t *evt);
+void libtwirc_free_login(twirc_state_t *s);
+void libtwirc_schedule_reconnect(twirc_state_t *s);
+void libtwirc_drop_timer(twirc_state_t *s, void *arg);
+int libtwirc_rejoin(twirc_state_t *s);
+int libtwirc_handover_start(twirc_state_t *s);
+int libtwirc_handover_rejoin(twirc_state_t *n);
+void libtwirc_handover_check(twirc_state_t *n);
+void libtwirc_handover_abort(twirc_state_t *s);
+int libtwirc_handover_switch(twirc_state_t *s);
+int libtwirc_disconnected(twirc_state_t *s);
+void libtwirc_keepalive_timer(twirc_state_t *s, void *arg);
+void libtwirc_keepalive_start(twirc_state_t *s);
+void libtwirc_keepalive_stop(twirc_state_t *s);
 
 #endif
@@ -0,0 +1,172 @@
+#include <stdio.h>      // snprintf()
+#include <string.h>     // strcmp(), memcpy()
+#include <stdint.h>     // uint64_t
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * Keepalive. A connection that died without the server ever saying goodbye
+ * (say, because some router in between went away) can look perfectly fine
+ * from our end for minutes, until TCP gives up on it. With the
+ * TWIRC_OPT_KEEPALIVE option, once nothing has come in for a while, we send
+ * a PING with a token of our own; the server has to answer it with a PONG
+ * carrying the same token. If that doesn't happen in time, we consider the
+ * connection lost and go down the same path as if the server had closed it
+ * (which includes reconnecting, with TWIRC_OPT_RECONNECT). The time it takes
+ * for the PONG to come back is the connection's round-trip time, which we
+ * keep a running estimate (EWMA, like TCP's) and a histogram of.
+ */
+
+/*
+ * Sets the keepalive timer to go off in ms milliseconds.
+ */
+void libtwirc_keepalive_arm(twirc_state_t *s, uint64_t ms)
+{
+	s->keepalive_timer = twirc_timer_add(s, ms, 0, libtwirc_keepalive_timer, NULL);
+}
+
+/*
+ * Timer callback that does the actual work: if we're waiting for a PONG that
+ * is overdue, the connection is lost; if nothing came in for long enough, we
+ * send a PING. Either way, it sets itself up to go off again when there's
+ * something to do next.
+ */
+void libtwirc_keepalive_timer(twirc_state_t *s, void *arg)
+{
+	s->keepalive_timer = 0;
+	if (!(s->options & TWIRC_OPT_KEEPALIVE) || !twirc_is_logged_in(s))
+	{
+		return;
+	}
+
+	// Waiting for the PONG
+	if (s->ping_sent != 0)
+	{
+		uint64_t waited = (libtwirc_now_us() - s->ping_sent) / 1000;
+		if (waited < s->keepalive_timeout)
+		{
+			libtwirc_keepalive_arm(s, s->keepalive_timeout - waited);
+			return;
+		}
+		s->ping_sent = 0;
+		s->error = TWIRC_ERR_CONN_TIMEOUT;
+		libtwirc_disconnected(s);
+		return;
+	}
+
+	// Something came in recently, no need to ask
+	uint64_t idle = libtwirc_now() - s->last_recv;
+	if (idle < s->keepalive_idle)
+	{
+		libtwirc_keepalive_arm(s, s->keepalive_idle - idle);
+		return;
+	}
+
+	snprintf(s->ping_token, sizeof(s->ping_token), "twirc-%08x", libtwirc_random(s));
+	s->ping_sent = libtwirc_now_us();
+	twirc_cmd_ping(s, s->ping_token);
+	libtwirc_keepalive_arm(s, s->keepalive_timeout);
+}
+
+/*
+ * Starts the keepalive timer, if the TWIRC_OPT_KEEPALIVE option is enabled
+ * and we're logged in, or stops it otherwise. Called on login and whenever
+ * the option is changed.
+ */
+void libtwirc_keepalive_start(twirc_state_t *s)
+{
+	if (!(s->options & TWIRC_OPT_KEEPALIVE) || !twirc_is_logged_in(s))
+	{
+		libtwirc_keepalive_stop(s);
+		return;
+	}
+	if (s->keepalive_timer == 0)
+	{
+		s->last_recv = libtwirc_now();
+		libtwirc_keepalive_arm(s, s->keepalive_idle);
+	}
+}
+
+/*
+ * Stops the keepalive timer and forgets about the PING we've sent, if any.
+ * Called when the connection is lost.
+ */
+void libtwirc_keepalive_stop(twirc_state_t *s)
+{
+	if (s->keepalive_timer != 0)
+	{
+		twirc_timer_cancel(s, s->keepalive_timer);
+		s->keepalive_timer = 0;
+	}
+	s->ping_sent = 0;
+}
+
+/*
+ * Takes a round-trip time of us microseconds into account.
+ */
+void libtwirc_add_rtt(twirc_state_t *s, uint64_t us)
+{
+	s->rtt = s->rtt ? (7 * s->rtt + us) / 8 : us;
+
+	uint64_t ms = us / 1000;
+	size_t b = ms ? 64 - __builtin_clzll(ms) : 0;
+	s->rtt_hist[b < TWIRC_RTT_BUCKETS ? b : TWIRC_RTT_BUCKETS - 1] += 1;
+}
+
+/*
+ * Handler for PONG commands. If it answers our PING, we know the round-trip
+ * time now.
+ *
+ * > :tmi.twitch.tv PONG tmi.twitch.tv :<token>
+ */
+void libtwirc_on_pong(twirc_state_t *s, twirc_event_t *evt)
+{
+	if (s->ping_sent == 0 || evt->num_params == 0 ||
+	    strcmp(evt->params[evt->num_params - 1], s->ping_token) != 0)
+	{
+		return;
+	}
+	libtwirc_add_rtt(s, libtwirc_now_us() - s->ping_sent);
+	s->ping_sent = 0;
+}
+
+/*
+ * Sets up the keepalive (see TWIRC_OPT_KEEPALIVE): a PING is sent once the
+ * connection has been quiet for idle_ms milliseconds, and if the PONG doesn't
+ * come back within timeout_ms milliseconds, the connection is considered lost.
+ * The defaults are TWIRC_KEEPALIVE_IDLE and TWIRC_KEEPALIVE_TIMEOUT. Takes
+ * effect with the next PING. Returns 0 on success, -1 if either is 0.
+ */
+int twirc_set_keepalive(twirc_state_t *s, unsigned idle_ms, unsigned timeout_ms)
+{
+	if (idle_ms == 0 || timeout_ms == 0)
+	{
+		return -1;
+	}
+	s->keepalive_idle = idle_ms;
+	s->keepalive_timeout = timeout_ms;
+	return 0;
+}
+
+/*
+ * Returns the connection's smoothed round-trip time, in microseconds, as
+ * measured by the keepalive (see TWIRC_OPT_KEEPALIVE), or 0 if there hasn't
+ * been a measurement yet.
+ */
+uint64_t twirc_get_rtt(const twirc_state_t *s)
+{
+	return s->rtt;
+}
+
+/*
+ * Copies up to n buckets of the round-trip time histogram into counts and
+ * returns the number of buckets there are (TWIRC_RTT_BUCKETS). Bucket 0 holds
+ * the number of round trips that took less than a millisecond, bucket i those
+ * that took 2^(i-1) up to 2^i milliseconds, and the last bucket all those that
+ * took even longer.
+ */
+size_t twirc_get_rtt_histogram(const twirc_state_t *s, uint64_t *counts, size_t n)
+{
+	memcpy(counts, s->rtt_hist, (n < TWIRC_RTT_BUCKETS ? n : TWIRC_RTT_BUCKETS) * sizeof(uint64_t));
+	return TWIRC_RTT_BUCKETS;
+}
@@ -0,0 +1,397 @@
+#include <stdlib.h>     // malloc(), free()
+#include <string.h>     // memcpy(), strncmp(), memchr()
+#include <stdint.h>     // uint64_t
+#include <time.h>       // clock_gettime()
+#include <sys/uio.h>    // struct iovec
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * The rate limiter. Twitch limits how many messages we may send per time
+ * frame: there is one limit for chat messages (per channel, depending on
+ * whether we are a moderator there), one for joining channels and one for
+ * whispers. Going over these will get messages dropped or, worse, the account
+ * locked out for a while. Hence, every outgoing message of these kinds has to
+ * take a token from the matching token bucket. Buckets start full and refill
+ * continuously, at the rate given by their limit. If a bucket is empty, the
+ * message is held back until enough tokens have come in; twirc_tick() and
+ * twirc_reactor_tick() wake up in time to send it. All other messages (PONG,
+ * CAP, PASS, NICK, PART, ...) are not limited and go out right away.
+ */
+
+/*
+ * Returns the current time of the monotonic clock, in milliseconds.
+ */
+uint64_t libtwirc_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Returns the current time of the monotonic clock, in microseconds.
+ */
+uint64_t libtwirc_now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Initializes the given bucket for the given limit (TWIRC_LIMIT_*). For the
+ * chat message buckets, chan is the channel the bucket belongs to, so we know
+ * whether to apply the limit for moderators; it's NULL for the other buckets.
+ */
+void libtwirc_init_bucket(struct libtwirc_bucket *b, int limit, struct libtwirc_chan *chan)
+{
+	memset(b, 0, sizeof(struct libtwirc_bucket));
+	b->limit = limit;
+	b->chan  = chan;
+}
+
+/*
+ * Discards all messages held back by the given bucket and takes it off the
+ * state's list of buckets with held messages.
+ */
+void libtwirc_clear_bucket(twirc_state_t *s, struct libtwirc_bucket *b)
+{
+	while (b->held != NULL)
+	{
+		struct libtwirc_held *next = b->held->next;
+		free(b->held);
+		b->held = next;
+	}
+	b->held_tail = NULL;
+
+	if (b->waiting)
+	{
+		for (struct libtwirc_bucket **it = &s->waiting; *it; it = &(*it)->next_waiting)
+		{
+			if (*it == b)
+			{
+				*it = b->next_waiting;
+				break;
+			}
+		}
+		b->waiting = 0;
+	}
+}
+
+/*
+ * Returns the limit that currently applies to the given bucket.
+ */
+struct libtwirc_limit *libtwirc_bucket_limit(twirc_state_t *s, struct libtwirc_bucket *b)
+{
+	if (b->limit == TWIRC_LIMIT_PRIVMSG && b->chan && b->chan->mod)
+	{
+		return &s->limits[TWIRC_LIMIT_PRIVMSG_MOD];
+	}
+	return &s->limits[b->limit];
+}
+
+/*
+ * Adds the tokens that came in since the bucket was last refilled, but never
+ * more than the bucket can hold. A bucket that has never been used is full.
+ */
+void libtwirc_refill(struct libtwirc_bucket *b, struct libtwirc_limit *l, uint64_t now)
+{
+	if (b->last == 0)
+	{
+		b->tokens = l->count;
+	}
+	else
+	{
+		b->tokens += (double) (now - b->last) * l->count / l->ms;
+	}
+	if (b->tokens > l->count)
+	{
+		b->tokens = l->count;
+	}
+	b->last = now;
+}
+
+/*
+ * Returns the number of tokens needed to send a message that costs cost
+ * tokens. A message that costs more than the bucket can hold (like joining
+ * lots of channels at once) only needs a full bucket, but takes all of cost.
+ */
+double libtwirc_tokens_needed(struct libtwirc_limit *l, unsigned cost)
+{
+	return cost < l->count ? cost : l->count;
+}
+
+/*
+ * Figures out which bucket, if any, an outgoing message of len bytes (without
+ * the "\r\n") has to take tokens from and how many (cost). Chat messages go
+ * to the bucket of their channel, unless they are whispers ("/w" command);
+ * joins cost one token per channel. Returns NULL for unlimited messages.
+ */
+struct libtwirc_bucket *libtwirc_classify(twirc_state_t *s, const char *msg, size_t len, unsigned *cost)
+{
+	*cost = 1;
+
+	if (len > 8 && strncmp(msg, "PRIVMSG ", 8) == 0)
+	{
+		const char *chan = msg + 8;
+		const char *end  = memchr(chan, ' ', len - 8);
+		if (end == NULL)
+		{
+			return NULL;
+		}
+		size_t rest = len - (end - msg);
+		if (rest >= 5 && strncmp(end, " :/w ", 5) == 0)
+		{
+			return &s->whisper;
+		}
+		// If we run out of memory here, the message won't be limited;
+		// better than not sending it at all
+		struct libtwirc_chan *c = libtwirc_get_chan(s, chan, end - chan, 1);
+		return c ? &c->privmsg : NULL;
+	}
+
+	if (len > 5 && strncmp(msg, "JOIN ", 5) == 0)
+	{
+		for (size_t i = 5; i < len && msg[i] != ' '; ++i)
+		{
+			if (msg[i] == ',')
+			{
+				*cost += 1;
+			}
+		}
+		return &s->join;
+	}
+
+	return NULL;
+}
+
+/*
+ * Holds back the message of len bytes (without the "\r\n", which will be
+ * added) in the given bucket, until it has enough tokens to let it go. 
+ * Returns 0 on success, -1 if out of memory.
+ */
+int libtwirc_hold(twirc_state_t *s, struct libtwirc_bucket *b, const char *msg, size_t len, unsigned cost)
+{
+	struct libtwirc_held *h = malloc(sizeof(struct libtwirc_held) + len + 2);
+	if (h == NULL)
+	{
+		return libtwirc_oom(s);
+	}
+	h->next = NULL;
+	h->cost = cost;
+	h->len  = len + 2;
+	memcpy(h->data, msg, len);
+	memcpy(h->data + len, "\r\n", 2);
+
+	if (b->held_tail)
+	{
+		b->held_tail->next = h;
+	}
+	else
+	{
+		b->held = h;
+	}
+	b->held_tail = h;
+
+	// Let the state know this bucket has messages waiting
+	if (!b->waiting)
+	{
+		b->waiting = 1;
+		b->next_waiting = s->waiting;
+		s->waiting = b;
+	}
+	return 0;
+}
+
+/*
+ * Sends the message of len bytes (without the "\r\n", which will be added
+ * without copying the message) right away if the rate limits allow it, 
+ * otherwise holds it back until they do. Returns 0 if the message has been 
+ * sent, queued or held back, -1 on error.
+ */
+int libtwirc_write_limited(twirc_state_t *s, const char *msg, size_t len)
+{
+	struct iovec iov[2] = { { (void *) msg, len }, { "\r\n", 2 } };
+
+	unsigned cost;
+	struct libtwirc_bucket *b = libtwirc_classify(s, msg, len, &cost);
+	if (b == NULL)
+	{
+		return libtwirc_writev(s, iov, 2);
+	}
+
+	struct libtwirc_limit *l = libtwirc_bucket_limit(s, b);
+	if (l->count == 0)
+	{
+		return libtwirc_writev(s, iov, 2);
+	}
+
+	// Messages held back earlier go first, so this one gets in line
+	libtwirc_refill(b, l, libtwirc_now());
+	if (b->held != NULL || b->tokens < libtwirc_tokens_needed(l, cost))
+	{
+		return libtwirc_hold(s, b, msg, len, cost);
+	}
+
+	b->tokens -= cost;
+	return libtwirc_writev(s, iov, 2);
+}
+
+/*
+ * Sends all held back messages that the rate limits allow us to send now. If
+ * a message can't be sent (most likely because the send queue is full), it 
+ * stays where it is, gets its tokens back, and no more messages are released
+ * until the socket is writable again (see libtwirc_handle_event()).
+ */
+void libtwirc_release_held(twirc_state_t *s)
+{
+	if (s->waiting == NULL || s->held_stuck)
+	{
+		return;
+	}
+
+	// Whatever we release now goes out in one go
+	uint64_t now = libtwirc_now();
+	struct libtwirc_bucket **it = &s->waiting;
+	twirc_batch_begin(s);
+
+	while (*it != NULL)
+	{
+		struct libtwirc_bucket *b = *it;
+		struct libtwirc_limit *l = libtwirc_bucket_limit(s, b);
+		libtwirc_refill(b, l, now);
+
+		while (b->held != NULL &&
+		       (l->count == 0 || b->tokens >= libtwirc_tokens_needed(l, b->held->cost)))
+		{
+			struct libtwirc_held *h = b->held;
+			if (libtwirc_write(s, h->data, h->len) == -1)
+			{
+				s->held_stuck = 1;
+				break;
+			}
+			b->tokens -= h->cost;
+			b->held = h->next;
+			free(h);
+		}
+		if (s->held_stuck)
+		{
+			break;
+		}
+
+		// Nothing left, take it off the list
+		if (b->held == NULL)
+		{
+			b->held_tail = NULL;
+			b->waiting = 0;
+			*it = b->next_waiting;
+			continue;
+		}
+		it = &b->next_waiting;
+	}
+	twirc_batch_end(s);
+}
+
+/*
+ * Returns the number of milliseconds until the next held back message can be
+ * sent, but never more than timeout (where -1 means forever, as with epoll).
+ */
+int libtwirc_limit_timeout(twirc_state_t *s, int timeout)
+{
+	// Nothing will be released before the socket is writable again
+	if (s->held_stuck)
+	{
+		return timeout;
+	}
+
+	uint64_t now = libtwirc_now();
+	for (struct libtwirc_bucket *b = s->waiting; b != NULL; b = b->next_waiting)
+	{
+		struct libtwirc_limit *l = libtwirc_bucket_limit(s, b);
+		libtwirc_refill(b, l, now);
+
+		int wait = 0;
+		double missing = libtwirc_tokens_needed(l, b->held->cost) - b->tokens;
+		if (l->count > 0 && missing > 0)
+		{
+			wait = (int) (missing * l->ms / l->count) + 1;
+		}
+		if (timeout < 0 || wait < timeout)
+		{
+			timeout = wait;
+		}
+	}
+	return timeout;
+}
+
+/*
+ * Discards all held back messages of the state.
+ */
+void libtwirc_clear_held(twirc_state_t *s)
+{
+	s->held_stuck = 0;
+	libtwirc_clear_bucket(s, &s->join);
+	libtwirc_clear_bucket(s, &s->whisper);
+	for (size_t i = 0; i < s->chans_size; ++i)
+	{
+		if (s->chans[i] != NULL)
+		{
+			libtwirc_clear_bucket(s, &s->chans[i]->privmsg);
+		}
+	}
+}
+
+/*
+ * Sets the given rate limit (one of TWIRC_LIMIT_*) to count messages per secs
+ * seconds. A count of 0 disables the limit. Returns 0 on success, -1 if limit
+ * is not a valid limit or secs is 0 while count isn't. The defaults are the
+ * ones Twitch applies to regular accounts:
+ *
+ * TWIRC_LIMIT_PRIVMSG:     20 messages per 30 seconds, per channel
+ * TWIRC_LIMIT_PRIVMSG_MOD: 100 messages per 30 seconds, per channel where we
+ *                          are moderator (or broadcaster)
+ * TWIRC_LIMIT_JOIN:        20 channels per 10 seconds
+ * TWIRC_LIMIT_WHISPER:     100 whispers per 60 seconds
+ */
+int twirc_set_rate_limit(twirc_state_t *s, int limit, unsigned count, unsigned secs)
+{
+	if (limit < 0 || limit >= TWIRC_NUM_LIMITS || (count > 0 && secs == 0))
+	{
+		return -1;
+	}
+	s->limits[limit].count = count;
+	s->limits[limit].ms    = secs * 1000;
+	return 0;
+}
+
+/*
+ * Returns the number of messages that are being held back, because sending
+ * them right away would have exceeded the rate limits.
+ */
+size_t twirc_get_held_messages(const twirc_state_t *s)
+{
+	size_t num = 0;
+	for (struct libtwirc_bucket *b = s->waiting; b != NULL; b = b->next_waiting)
+	{
+		for (struct libtwirc_held *h = b->held; h != NULL; h = h->next)
+		{
+			++num;
+		}
+	}
+	return num;
+}
+
+/*
+ * Sets up the rate limits with their defaults and initializes the buckets.
+ */
+void libtwirc_init_limits(twirc_state_t *s)
+{
+	twirc_set_rate_limit(s, TWIRC_LIMIT_PRIVMSG,     20,  30);
+	twirc_set_rate_limit(s, TWIRC_LIMIT_PRIVMSG_MOD, 100, 30);
+	twirc_set_rate_limit(s, TWIRC_LIMIT_JOIN,        20,  10);
+	twirc_set_rate_limit(s, TWIRC_LIMIT_WHISPER,     100, 60);
+	libtwirc_init_bucket(&s->join,    TWIRC_LIMIT_JOIN,    NULL);
+	libtwirc_init_bucket(&s->whisper, TWIRC_LIMIT_WHISPER, NULL);
+	s->waiting = NULL;
+}
@@ -0,0 +1,499 @@
+#include <stdlib.h>     // malloc(), realloc(), free(), qsort()
+#include <string.h>     // strlen(), strcmp(), memcpy()
+#include <stdio.h>      // snprintf()
+#include <stdint.h>     // uint32_t, SIZE_MAX
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * The pool. A single connection only gets so far: it has one socket's worth
+ * of throughput and one JOIN budget. A pool opens any number of connections
+ * (shards) and spreads the channels across them. Which shard a channel goes to
+ * is decided by consistent hashing: every shard is put on a ring of 32 bit
+ * hashes at TWIRC_POOL_VNODES points and a channel goes to the shard of the
+ * first point at or after the channel's hash. Should that shard be down, the
+ * next point of a shard that is logged in wins. This way, when a shard goes
+ * down, only its own channels move, spread evenly over the others, and when
+ * it comes back, exactly these channels move back to it. All shards share one
+ * reactor and one set of callbacks, so events come in as one stream.
+ */
+
+/*
+ * Hashes the first len chars of str onto the ring. FNV-1a alone doesn't
+ * spread keys that only differ in their last chars (like "#chan1", "#chan2")
+ * well enough, so its result is run through MurmurHash3's finalizer.
+ */
+uint32_t libtwirc_pool_hash(const char *str, size_t len)
+{
+	uint32_t h = libtwirc_chan_hash(str, len);
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+/*
+ * Compares two points of the ring by hash, for qsort().
+ */
+int libtwirc_pool_cmp_points(const void *a, const void *b)
+{
+	uint32_t ha = ((const struct libtwirc_pool_point *) a)->hash;
+	uint32_t hb = ((const struct libtwirc_pool_point *) b)->hash;
+	return ha < hb ? -1 : ha > hb;
+}
+
+/*
+ * Puts TWIRC_POOL_VNODES points per shard onto the pool's ring and sorts them.
+ * The hashes only depend on the shard's index, so the ring is the same every
+ * time for the same number of shards. Returns 0 on success, -1 if out of
+ * memory.
+ */
+int libtwirc_pool_init_ring(twirc_pool_t *p)
+{
+	p->ring_size = p->num_shards * TWIRC_POOL_VNODES;
+	p->ring = malloc(p->ring_size * sizeof(struct libtwirc_pool_point));
+	if (p->ring == NULL)
+	{
+		return -1;
+	}
+
+	char key[32];
+	for (size_t i = 0; i < p->num_shards; ++i)
+	{
+		for (size_t v = 0; v < TWIRC_POOL_VNODES; ++v)
+		{
+			int len = snprintf(key, sizeof(key), "shard-%zu-%zu", i, v);
+			struct libtwirc_pool_point *pt = &p->ring[i * TWIRC_POOL_VNODES + v];
+			pt->hash  = libtwirc_pool_hash(key, len);
+			pt->shard = i;
+		}
+	}
+	qsort(p->ring, p->ring_size, sizeof(struct libtwirc_pool_point),
+			libtwirc_pool_cmp_points);
+	return 0;
+}
+
+/*
+ * Returns the index of the shard the channel of the given name belongs on. If
+ * live is 1, shards that aren't logged in are skipped and TWIRC_POOL_NONE is
+ * returned if none of the shards is; if live is 0, the channel's home shard,
+ * the one it goes to when all shards are up, is returned.
+ */
+size_t libtwirc_pool_lookup(twirc_pool_t *p, const char *name, int live)
+{
+	uint32_t hash = libtwirc_pool_hash(name, strlen(name));
+
+	// Binary search for the first point at or after hash
+	size_t lo = 0;
+	size_t hi = p->ring_size;
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (p->ring[mid].hash < hash) { lo = mid + 1; }
+		else                          { hi = mid; }
+	}
+
+	// Walk the ring from there on (wrapping around) to a suitable shard
+	for (size_t i = 0; i < p->ring_size; ++i)
+	{
+		size_t shard = p->ring[(lo + i) % p->ring_size].shard;
+		if (!live || twirc_is_logged_in(p->shards[shard]))
+		{
+			return shard;
+		}
+	}
+	return TWIRC_POOL_NONE;
+}
+
+/*
+ * Returns the pool's channel of the given name, or NULL if there is none.
+ */
+struct libtwirc_pool_chan *libtwirc_pool_find(twirc_pool_t *p, const char *name)
+{
+	for (size_t i = 0; i < p->num_chans; ++i)
+	{
+		if (strcmp(p->chans[i].name, name) == 0)
+		{
+			return &p->chans[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Moves every channel to the shard it should be on right now: channels whose
+ * shard went down, or that have not been joined yet, go to the next shard on
+ * the ring that is logged in; channels whose home shard is back move home.
+ * Channels are left on their old shard (if it's still up) and joined on their
+ * new one, using as few JOIN commands per shard as possible. Returns 0 on
+ * success, -1 if sending failed for any of the shards.
+ */
+int libtwirc_pool_place(twirc_pool_t *p)
+{
+	int ret = 0;
+	size_t moved = 0;
+
+	for (size_t i = 0; i < p->num_chans; ++i)
+	{
+		struct libtwirc_pool_chan *c = &p->chans[i];
+		size_t target = libtwirc_pool_lookup(p, c->name, 1);
+		if (target == c->shard)
+		{
+			continue;
+		}
+		if (c->shard != TWIRC_POOL_NONE && twirc_is_logged_in(p->shards[c->shard]))
+		{
+			twirc_cmd_part(p->shards[c->shard], c->name);
+		}
+		c->shard = target;
+		c->pending = target != TWIRC_POOL_NONE;
+		moved += c->pending;
+	}
+	if (moved == 0)
+	{
+		return 0;
+	}
+
+	// Join the moved channels, shard by shard
+	const char **names = malloc(moved * sizeof(char *));
+	if (names == NULL)
+	{
+		return -1;
+	}
+	for (size_t k = 0; k < p->num_shards; ++k)
+	{
+		size_t n = 0;
+		for (size_t i = 0; i < p->num_chans; ++i)
+		{
+			if (p->chans[i].pending && p->chans[i].shard == k)
+			{
+				names[n++] = p->chans[i].name;
+				p->chans[i].pending = 0;
+			}
+		}
+		if (n > 0 && twirc_cmd_join_many(p->shards[k], names, n) == -1)
+		{
+			ret = -1;
+		}
+	}
+	free(names);
+	return ret;
+}
+
+/*
+ * Installed as the welcome callback of every shard: once a shard has logged
+ * in, it takes over the channels that belong on it, then the user's welcome
+ * callback is called.
+ */
+void libtwirc_pool_on_welcome(twirc_state_t *s, twirc_event_t *evt)
+{
+	libtwirc_pool_place(s->pool);
+	libtwirc_callback(s, s->pool->cbs.welcome, evt);
+}
+
+/*
+ * Installed as the disconnect callback of every shard: the channels of the
+ * shard that went down are spread across the other shards, then the user's
+ * disconnect callback is called.
+ */
+void libtwirc_pool_on_disconnect(twirc_state_t *s, twirc_event_t *evt)
+{
+	twirc_pool_t *p = s->pool;
+	for (size_t i = 0; i < p->num_chans; ++i)
+	{
+		if (p->chans[i].shard < p->num_shards && p->shards[p->chans[i].shard] == s)
+		{
+			p->chans[i].shard = TWIRC_POOL_NONE;
+		}
+	}
+	libtwirc_pool_place(p);
+	p->cbs.disconnect(s, evt);
+}
+
+/*
+ * Returns a pointer to a new pool of num_shards connections, driven by the
+ * given reactor, or by a reactor of the pool's own if r is NULL. Returns NULL
+ * if the pool could not be created. The connections have not been opened yet,
+ * set up the callbacks (see twirc_pool_get_callbacks()), then connect them
+ * with twirc_pool_connect().
+ */
+twirc_pool_t *twirc_pool_init(size_t num_shards, twirc_reactor_t *r)
+{
+	if (num_shards == 0)
+	{
+		return NULL;
+	}
+
+	twirc_pool_t *p = malloc(sizeof(twirc_pool_t));
+	if (p == NULL) { return NULL; }
+	memset(p, 0, sizeof(twirc_pool_t));
+	twirc_init_callbacks(&p->cbs);
+
+	p->reactor = r;
+	if (p->reactor == NULL)
+	{
+		p->reactor = twirc_reactor_init();
+		p->own_reactor = 1;
+	}
+	p->shards = calloc(num_shards, sizeof(twirc_state_t *));
+	if (p->reactor == NULL || p->shards == NULL)
+	{
+		twirc_pool_free(p);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < num_shards; ++i)
+	{
+		twirc_state_t *s = twirc_init();
+		if (s == NULL)
+		{
+			twirc_pool_free(p);
+			return NULL;
+		}
+		s->pool = p;
+		p->shards[p->num_shards++] = s;
+		twirc_reactor_add(p->reactor, s);
+	}
+
+	if (libtwirc_pool_init_ring(p) == -1)
+	{
+		twirc_pool_free(p);
+		return NULL;
+	}
+	return p;
+}
+
+/*
+ * Returns a pointer to the pool's twirc_callbacks structure. These callbacks
+ * will be installed in all shards when they connect, so all events of all
+ * connections end up in the same callbacks. Use twirc_get_pool() from within
+ * a callback to get to the pool the event came in on. Don't change the
+ * callbacks of the shards directly, as they will be overwritten.
+ */
+twirc_callbacks_t *twirc_pool_get_callbacks(twirc_pool_t *p)
+{
+	return &p->cbs;
+}
+
+/*
+ * Connects all shards of the pool that aren't connected, with the given
+ * credentials or, if nick is NULL, anonymously (see twirc_connect_anon()).
+ * Use this to connect the pool initially, but also to bring back shards that
+ * have lost their connection; channels are moved back to them once they have
+ * logged in. Returns 0 if all connections are in progress, -1 if at least one
+ * connection attempt failed (check the errors of the shards).
+ */
+int twirc_pool_connect(twirc_pool_t *p, const char *host, const char *port, const char *nick, const char *pass)
+{
+	int ret = 0;
+	for (size_t i = 0; i < p->num_shards; ++i)
+	{
+		twirc_state_t *s = p->shards[i];
+		if (s->status != TWIRC_STATUS_DISCONNECTED)
+		{
+			continue;
+		}
+
+		// Everything goes to the pool's callbacks, but we need to know
+		// when shards come and go, so we can move the channels around
+		s->cbs = p->cbs;
+		s->cbs.welcome    = libtwirc_pool_on_welcome;
+		s->cbs.disconnect = libtwirc_pool_on_disconnect;
+
+		int res = nick ? twirc_connect(s, host, port, nick, pass)
+		               : twirc_connect_anon(s, host, port);
+		if (res == -1)
+		{
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Adds the channel to the pool and joins it on the shard it belongs on; if
+ * no shard is logged in yet, it will be joined as soon as one is. Returns 0
+ * on success (including if the channel is part of the pool already), -1 if
+ * out of memory or sending the JOIN command failed.
+ */
+int twirc_pool_join(twirc_pool_t *p, const char *chan)
+{
+	return twirc_pool_join_many(p, &chan, 1);
+}
+
+/*
+ * Adds all n channels in chans to the pool and joins them, with as few JOIN
+ * commands as possible, see twirc_pool_join().
+ */
+int twirc_pool_join_many(twirc_pool_t *p, const char **chans, size_t n)
+{
+	if (p->num_chans + n > p->chans_size)
+	{
+		size_t size = p->chans_size ? p->chans_size : TWIRC_CHANS_SIZE;
+		while (size < p->num_chans + n)
+		{
+			size *= 2;
+		}
+		struct libtwirc_pool_chan *c = realloc(p->chans, size * sizeof(struct libtwirc_pool_chan));
+		if (c == NULL)
+		{
+			return -1;
+		}
+		p->chans = c;
+		p->chans_size = size;
+	}
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (libtwirc_pool_find(p, chans[i]) != NULL)
+		{
+			continue;
+		}
+		struct libtwirc_pool_chan *c = &p->chans[p->num_chans];
+		c->name = strdup(chans[i]);
+		if (c->name == NULL)
+		{
+			return -1;
+		}
+		c->shard = TWIRC_POOL_NONE;
+		c->pending = 0;
+		p->num_chans += 1;
+	}
+	return libtwirc_pool_place(p);
+}
+
+/*
+ * Leaves the channel on whichever shard it is on and removes it from the
+ * pool. Returns 0 on success (including if the channel isn't part of the
+ * pool), -1 if sending the PART command failed.
+ */
+int twirc_pool_part(twirc_pool_t *p, const char *chan)
+{
+	struct libtwirc_pool_chan *c = libtwirc_pool_find(p, chan);
+	if (c == NULL)
+	{
+		return 0;
+	}
+
+	int ret = 0;
+	if (c->shard != TWIRC_POOL_NONE && twirc_is_logged_in(p->shards[c->shard]))
+	{
+		ret = twirc_cmd_part(p->shards[c->shard], c->name);
+	}
+
+	// Fill the gap with the last channel
+	free(c->name);
+	*c = p->chans[--p->num_chans];
+	return ret;
+}
+
+/*
+ * Returns the shard that the given channel is on, so it can be used to send
+ * messages to that channel with the regular twirc_cmd_*() functions. If the
+ * channel isn't part of the pool, or not currently joined on any shard, its
+ * home shard (where it goes when all shards are up) is returned.
+ */
+twirc_state_t *twirc_pool_get_shard(twirc_pool_t *p, const char *chan)
+{
+	struct libtwirc_pool_chan *c = libtwirc_pool_find(p, chan);
+	if (c != NULL && c->shard != TWIRC_POOL_NONE)
+	{
+		return p->shards[c->shard];
+	}
+	return p->shards[libtwirc_pool_lookup(p, chan, 0)];
+}
+
+/*
+ * Returns the pool's shard with the given index (0 to the number of shards
+ * minus 1), for example to set its options, or NULL if there is no such shard.
+ */
+twirc_state_t *twirc_pool_get_state(twirc_pool_t *p, size_t i)
+{
+	return i < p->num_shards ? p->shards[i] : NULL;
+}
+
+/*
+ * Returns the number of shards (connections) of the pool.
+ */
+size_t twirc_pool_get_num_shards(const twirc_pool_t *p)
+{
+	return p->num_shards;
+}
+
+/*
+ * Returns the pool the given state is a shard of, or NULL if it isn't part of
+ * a pool. Useful in callbacks, which all pool's shards have in common.
+ */
+twirc_pool_t *twirc_get_pool(twirc_state_t *s)
+{
+	return s->pool;
+}
+
+/*
+ * Sets the pool's context, a pointer to user data.
+ */
+void twirc_pool_set_context(twirc_pool_t *p, void *ctx)
+{
+	p->context = ctx;
+}
+
+/*
+ * Returns the pool's context, see twirc_pool_set_context().
+ */
+void *twirc_pool_get_context(twirc_pool_t *p)
+{
+	return p->context;
+}
+
+/*
+ * Returns the reactor that drives the pool's connections.
+ */
+twirc_reactor_t *twirc_pool_get_reactor(twirc_pool_t *p)
+{
+	return p->reactor;
+}
+
+/*
+ * Waits timeout milliseconds for events on the pool's connections and handles
+ * them, see twirc_reactor_tick(). If the pool shares its reactor with other
+ * states, their events will be handled as well.
+ */
+int twirc_pool_tick(twirc_pool_t *p, int timeout)
+{
+	return twirc_reactor_tick(p->reactor, timeout);
+}
+
+/*
+ * Runs an endless loop that handles the events on the pool's connections,
+ * until none of them is connected anymore, see twirc_reactor_loop().
+ */
+int twirc_pool_loop(twirc_pool_t *p)
+{
+	return twirc_reactor_loop(p->reactor);
+}
+
+/*
+ * Frees the pool, including all of its shards (whose connections had better
+ * be closed already, see twirc_disconnect()) and its own reactor, if any.
+ */
+void twirc_pool_free(twirc_pool_t *p)
+{
+	for (size_t i = 0; i < p->num_shards; ++i)
+	{
+		twirc_free(p->shards[i]);
+	}
+	for (size_t i = 0; i < p->num_chans; ++i)
+	{
+		free(p->chans[i].name);
+	}
+	if (p->own_reactor && p->reactor != NULL)
+	{
+		twirc_reactor_free(p->reactor);
+	}
+	free(p->shards);
+	free(p->chans);
+	free(p->ring);
+	free(p);
+}
@@ -0,0 +1,367 @@
+#include <stdlib.h>     // malloc(), realloc(), free()
+#include <unistd.h>     // close()
+#include <sys/epoll.h>  // epoll_create(), epoll_ctl(), epoll_pwait()
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * The reactor. Usually, every state has its own epoll instance and is driven
+ * by its own twirc_loop(), which means one thread per connection. A reactor
+ * instead owns one epoll instance that any number of states can be added to,
+ * so they can all be driven by a single twirc_reactor_loop(). The epoll events
+ * carry a pointer to their state, so we know whom to hand them to. To make
+ * sure a very busy connection can't keep us from serving the others, every
+ * state may only read so many bytes per round (the read budget); states that
+ * hit their budget are put on a list and get their next turn once all other
+ * events of the round have been handled.
+ */
+
+/*
+ * Returns a pointer to a new reactor or NULL if it could not be created.
+ */
+twirc_reactor_t *twirc_reactor_init()
+{
+	twirc_reactor_t *r = malloc(sizeof(twirc_reactor_t));
+	if (r == NULL) { return NULL; }
+	memset(r, 0, sizeof(twirc_reactor_t));
+
+	r->budget = TWIRC_READ_BUDGET;
+	r->max_events = TWIRC_MAX_EVENTS;
+	r->events = malloc(r->max_events * sizeof(struct epoll_event));
+	if (r->events == NULL)
+	{
+		free(r);
+		return NULL;
+	}
+
+	r->epfd = epoll_create(1);
+	if (r->epfd < 0)
+	{
+		free(r->events);
+		free(r);
+		return NULL;
+	}
+
+	libtwirc_init_sigmask(&r->sigmask);
+	return r;
+}
+
+/*
+ * Registers the state's socket, if it has one, with the reactor's epoll
+ * instance. Returns 0 on success, -1 on error (check the state's error).
+ */
+int libtwirc_reactor_watch(twirc_reactor_t *r, twirc_state_t *s)
+{
+	if (s->socket_fd < 0)
+	{
+		return 0;
+	}
+
+	struct epoll_event eev = { 0 };
+	eev.data.ptr = s;
+	eev.events = EPOLLRDHUP | EPOLLOUT | EPOLLIN | EPOLLET;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, s->socket_fd, &eev) == -1)
+	{
+		s->error = TWIRC_ERR_EPOLL_CTL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Puts the state on the reactor's list of states that have hit their read
+ * budget, unless it is on there already. They will be served, in the order
+ * they were added, at the end of the current round.
+ */
+void libtwirc_reactor_defer(twirc_reactor_t *r, twirc_state_t *s)
+{
+	if (s->deferred)
+	{
+		return;
+	}
+	s->deferred = 1;
+	s->next_deferred = NULL;
+	if (r->deferred_tail)
+	{
+		r->deferred_tail->next_deferred = s;
+	}
+	else
+	{
+		r->deferred = s;
+	}
+	r->deferred_tail = s;
+}
+
+/*
+ * Adds the state to the reactor. If the state is already connected (or in the
+ * process of connecting), its socket will be moved over from the state's own
+ * epoll instance, which will be closed. If it isn't, twirc_connect() will use
+ * the reactor's epoll instance right away. Either way, the state will from now
+ * on be driven by the reactor, so call twirc_reactor_tick() or -loop() instead
+ * of twirc_tick() or twirc_loop(). A state can only be added to one reactor.
+ * Returns 0 on success, -1 on error (check the state's error).
+ */
+int twirc_reactor_add(twirc_reactor_t *r, twirc_state_t *s)
+{
+	if (s->reactor != NULL)
+	{
+		return s->reactor == r ? 0 : -1;
+	}
+
+	if (libtwirc_reactor_watch(r, s) == -1)
+	{
+		return -1;
+	}
+
+	// We don't need the state's own epoll instance anymore
+	if (s->epfd >= 0)
+	{
+		close(s->epfd);
+	}
+	s->epfd = r->epfd;
+	s->reactor = r;
+	if (libtwirc_watch_inbox(s) == -1 || libtwirc_watch_timers(s) == -1)
+	{
+		return -1;
+	}
+
+	// Add it to the front of the list of states
+	s->next_state = r->states;
+	r->states = s;
+	return 0;
+}
+
+/*
+ * Removes the state from the reactor, after which it will have to be driven by
+ * twirc_tick() or twirc_loop() again; if it is connected, its socket will be
+ * moved over to a new epoll instance of its own. Returns 0 on success, -1 if
+ * the state isn't part of this reactor or on error (check the state's error).
+ */
+int twirc_reactor_remove(twirc_reactor_t *r, twirc_state_t *s)
+{
+	if (s->reactor != r)
+	{
+		return -1;
+	}
+
+	// Take it off the list of states
+	for (twirc_state_t **it = &r->states; *it != NULL; it = &(*it)->next_state)
+	{
+		if (*it == s)
+		{
+			*it = s->next_state;
+			break;
+		}
+	}
+
+	// Take it off the list of deferred states, if it is on there
+	if (s->deferred)
+	{
+		twirc_state_t *prev = NULL;
+		for (twirc_state_t *it = r->deferred; it != NULL; it = it->next_deferred)
+		{
+			if (it == s)
+			{
+				if (prev) { prev->next_deferred = s->next_deferred; }
+				else      { r->deferred = s->next_deferred; }
+				if (r->deferred_tail == s) { r->deferred_tail = prev; }
+				break;
+			}
+			prev = it;
+		}
+		s->deferred = 0;
+	}
+
+	s->next_state = NULL;
+	s->reactor = NULL;
+	s->epfd = -1;
+	epoll_ctl(r->epfd, EPOLL_CTL_DEL, s->wake_fd, NULL);
+	if (s->wheel.fd >= 0)
+	{
+		epoll_ctl(r->epfd, EPOLL_CTL_DEL, s->wheel.fd, NULL);
+	}
+
+	// Nothing else to do if there is no connection; twirc_connect() will
+	// create a new epoll instance and add the eventfd and timerfd to it
+	if (s->socket_fd < 0)
+	{
+		return 0;
+	}
+
+	// Move the socket over to an epoll instance of the state's own
+	epoll_ctl(r->epfd, EPOLL_CTL_DEL, s->socket_fd, NULL);
+	s->epfd = epoll_create(1);
+	if (s->epfd < 0)
+	{
+		s->error = TWIRC_ERR_EPOLL_CREATE;
+		return -1;
+	}
+	struct epoll_event eev = { 0 };
+	eev.data.ptr = s;
+	eev.events = EPOLLRDHUP | EPOLLOUT | EPOLLIN | EPOLLET;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->socket_fd, &eev) == -1)
+	{
+		s->error = TWIRC_ERR_EPOLL_CTL;
+		return -1;
+	}
+	if (libtwirc_watch_inbox(s) == -1)
+	{
+		return -1;
+	}
+	return libtwirc_watch_timers(s);
+}
+
+/*
+ * Sets the number of bytes every state may read per round. Once a state has
+ * read that much, it has to wait for all other states that have data ready
+ * before it gets to read more. 0 means no limit. TWIRC_READ_BUDGET by default.
+ */
+void twirc_reactor_set_budget(twirc_reactor_t *r, size_t bytes)
+{
+	r->budget = bytes;
+}
+
+/*
+ * Sets the number of events twirc_reactor_tick() can handle in one go, see
+ * twirc_set_max_events(). Returns 0 on success, -1 on error.
+ */
+int twirc_reactor_set_max_events(twirc_reactor_t *r, int max)
+{
+	if (max < 1)
+	{
+		return -1;
+	}
+	struct epoll_event *events = realloc(r->events, max * sizeof(struct epoll_event));
+	if (events == NULL)
+	{
+		return -1;
+	}
+	r->events = events;
+	r->max_events = max;
+	return 0;
+}
+
+/*
+ * Waits timeout milliseconds for events to happen on any of the reactor's
+ * connections and hands them to their respective states, then gives all the
+ * states that hit their read budget another turn. Should there be states
+ * with data left to read, we don't wait at all. Errors of individual states
+ * (for example, a lost connection) are reported through their callbacks and
+ * error fields; they don't stop the reactor. Returns 0 if all events have
+ * been handled, -1 if epoll_pwait() failed (check errno; EINTR means we have
+ * been interrupted by a signal).
+ */
+int twirc_reactor_tick(twirc_reactor_t *r, int timeout)
+{
+	// Make sure we wake up in time to send held back messages, and free
+	// the connections that have been handed over from (TWIRC_OPT_HANDOVER)
+	for (twirc_state_t *s = r->states; s != NULL; s = s->next_state)
+	{
+		timeout = libtwirc_limit_timeout(s, timeout);
+		libtwirc_handover_reap(s);
+	}
+
+	int num_events = epoll_pwait(r->epfd, r->events, r->max_events,
+			r->deferred ? 0 : timeout, &r->sigmask);
+	if (num_events == -1)
+	{
+		return -1;
+	}
+
+	// From here on, this thread is the one driving the reactor's states
+	const void *prev = libtwirc_tick_begin(r);
+
+	// States that hit their budget during this round will have to wait 
+	// for the next one, so we remember who's last in line right now
+	twirc_state_t *tail = r->deferred_tail;
+
+	for (int i = 0; i < num_events; ++i)
+	{
+		libtwirc_handle_epoll(&r->events[i]);
+	}
+
+	// Serve the states that hit their budget in a previous round
+	while (tail != NULL && r->deferred != NULL)
+	{
+		twirc_state_t *s = r->deferred;
+		r->deferred = s->next_deferred;
+		if (r->deferred == NULL)
+		{
+			r->deferred_tail = NULL;
+		}
+		s->deferred = 0;
+
+		// The connection might have been lost in the meantime
+		if (s->status == TWIRC_STATUS_DISCONNECTED)
+		{
+			if (s == tail) { break; }
+			continue;
+		}
+
+		struct epoll_event epev = { 0 };
+		epev.events = EPOLLIN;
+		epev.data.ptr = s;
+		libtwirc_handle_event(s, &epev);
+
+		if (s == tail)
+		{
+			break;
+		}
+	}
+
+	// Send the held back messages that the rate limits now allow
+	for (twirc_state_t *s = r->states; s != NULL; s = s->next_state)
+	{
+		libtwirc_release_held(s);
+	}
+	libtwirc_tick_end(prev);
+	return 0;
+}
+
+/*
+ * Returns 1 if any of the reactor's states is connected, connecting or about
+ * to reconnect, otherwise 0.
+ */
+int libtwirc_reactor_active(const twirc_reactor_t *r)
+{
+	for (twirc_state_t *s = r->states; s != NULL; s = s->next_state)
+	{
+		if (s->status != TWIRC_STATUS_DISCONNECTED || twirc_is_reconnecting(s))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Runs an endless loop that waits for and processes events on all of the
+ * reactor's connections, until none of them is connected anymore (returns 0)
+ * or epoll_pwait() failed (returns -1, check errno).
+ */
+int twirc_reactor_loop(twirc_reactor_t *r)
+{
+	while (libtwirc_reactor_active(r))
+	{
+		if (twirc_reactor_tick(r, -1) == -1)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Removes all states from the reactor and frees it. The states themselves
+ * will not be freed, but keep running on epoll instances of their own.
+ */
+void twirc_reactor_free(twirc_reactor_t *r)
+{
+	while (r->states != NULL)
+	{
+		twirc_reactor_remove(r, r->states);
+	}
+	close(r->epfd);
+	free(r->events);
+	free(r);
+}
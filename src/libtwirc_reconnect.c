@@ -0,0 +1,158 @@
+#include <stdlib.h>     // malloc(), free()
+#include <stdint.h>     // uint32_t, uintptr_t
+#include <unistd.h>     // getpid()
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * Reconnecting. With the TWIRC_OPT_RECONNECT option, a state that loses its
+ * connection, for whatever reason other than twirc_disconnect(), connects
+ * again by itself, with the login data it used last time. If that fails, it
+ * tries again, waiting twice as long before every attempt, up to a maximum
+ * (see twirc_set_reconnect_delay()). Every delay is jittered: half of it is
+ * fixed, the other half random, so a fleet of clients that all lost their
+ * connection at the same time (say, because Twitch restarted a server) don't
+ * all come back at the same time. Once logged in again, the channels we were
+ * in are joined again, through the rate-limited join path. We know which ones
+ * these are from the JOIN and PART messages the server sends for us.
+ */
+
+/*
+ * Returns the next number of the state's random number generator (xorshift),
+ * which is seeded differently for every state and process; good enough for
+ * jitter, not for anything else.
+ */
+uint32_t libtwirc_random(twirc_state_t *s)
+{
+	if (s->rng == 0)
+	{
+		uint32_t seed = (uint32_t) libtwirc_now() ^ ((uint32_t) getpid() << 16)
+		              ^ (uint32_t) (uintptr_t) s;
+		s->rng = seed ? seed : 1;
+	}
+	s->rng ^= s->rng << 13;
+	s->rng ^= s->rng >> 17;
+	s->rng ^= s->rng << 5;
+	return s->rng;
+}
+
+/*
+ * Returns the number of milliseconds to wait before the next reconnect: the
+ * minimum delay, doubled for every failed attempt so far, but no more than
+ * the maximum delay; of that, half is fixed and half is random.
+ */
+unsigned libtwirc_reconnect_delay(twirc_state_t *s)
+{
+	unsigned cap = s->reconnect_min;
+	for (unsigned i = 0; i < s->reconnect_attempts && cap < s->reconnect_max; ++i)
+	{
+		cap = cap > s->reconnect_max / 2 ? s->reconnect_max : cap * 2;
+	}
+	return cap / 2 + libtwirc_random(s) % (cap - cap / 2 + 1);
+}
+
+/*
+ * Timer callback that connects the state again, with the login data from
+ * last time. Should that fail right away, the next attempt is scheduled.
+ */
+void libtwirc_reconnect_timer(twirc_state_t *s, void *arg)
+{
+	s->reconnect_timer = 0;
+	s->reconnect_attempts += 1;
+
+	twirc_login_t *l = &s->login;
+	if (twirc_connect(s, l->host, l->port, l->nick, l->pass) == -1)
+	{
+		libtwirc_on_disconnect(s);
+	}
+}
+
+/*
+ * Schedules a reconnect, if the TWIRC_OPT_RECONNECT option is enabled, the
+ * connection wasn't closed on purpose, we know where to connect to and there
+ * isn't a reconnect scheduled already. Called whenever a connection is lost.
+ */
+void libtwirc_schedule_reconnect(twirc_state_t *s)
+{
+	if (!(s->options & TWIRC_OPT_RECONNECT) || s->quit ||
+	    s->login.host == NULL || s->reconnect_timer != 0)
+	{
+		return;
+	}
+	s->reconnect_timer = twirc_timer_add(s, libtwirc_reconnect_delay(s), 0,
+			libtwirc_reconnect_timer, NULL);
+}
+
+/*
+ * Timer callback that drops the connection after the server announced that
+ * it is going to close it (RECONNECT), so we don't have to wait for that.
+ */
+void libtwirc_drop_timer(twirc_state_t *s, void *arg)
+{
+	if (s->status == TWIRC_STATUS_DISCONNECTED)
+	{
+		return;
+	}
+	libtwirc_on_disconnect(s);
+	s->cbs.disconnect(s, NULL);
+}
+
+/*
+ * Joins all channels again that we were in when the connection was lost.
+ * Called once we're logged in. Pools and groups take care of their channels
+ * themselves. Returns 0 on success, -1 on error.
+ */
+int libtwirc_rejoin(twirc_state_t *s)
+{
+	if (s->pool != NULL || s->group != NULL || s->num_chans == 0)
+	{
+		return 0;
+	}
+
+	const char **names = malloc(s->num_chans * sizeof(char *));
+	if (names == NULL)
+	{
+		return libtwirc_oom(s);
+	}
+
+	size_t n = 0;
+	for (size_t i = 0; i < s->chans_size; ++i)
+	{
+		if (s->chans[i] != NULL && s->chans[i]->joined)
+		{
+			names[n++] = s->chans[i]->name;
+		}
+	}
+
+	int ret = n ? twirc_cmd_join_many(s, names, n) : 0;
+	free(names);
+	return ret;
+}
+
+/*
+ * Sets how long to wait before reconnecting (see TWIRC_OPT_RECONNECT): min_ms
+ * before the first attempt, twice as long before every further attempt, but
+ * never more than max_ms. The actual delays are random, anywhere between half
+ * of that and all of it. The defaults are TWIRC_RECONNECT_MIN and
+ * TWIRC_RECONNECT_MAX. Returns 0 on success, -1 if min_ms is 0 or max_ms is
+ * less than min_ms.
+ */
+int twirc_set_reconnect_delay(twirc_state_t *s, unsigned min_ms, unsigned max_ms)
+{
+	if (min_ms == 0 || max_ms < min_ms)
+	{
+		return -1;
+	}
+	s->reconnect_min = min_ms;
+	s->reconnect_max = max_ms;
+	return 0;
+}
+
+/*
+ * Returns 1 if the state lost its connection and is waiting to reconnect,
+ * otherwise 0.
+ */
+int twirc_is_reconnecting(const twirc_state_t *s)
+{
+	return s->reconnect_timer != 0;
+}
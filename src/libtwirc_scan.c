@@ -0,0 +1,191 @@
+#include <stdint.h>     // uint16_t
+#include <string.h>     // size_t
+#include <stdatomic.h>  // atomic_load_explicit(), atomic_store_explicit()
+#if defined(__SSE2__)
+#include <immintrin.h>  // SSE2 and AVX2 intrinsics
+#endif
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * The delimiter scanner. It takes a buffer and a set of four characters and
+ * writes the offsets of all occurrences of any of these characters into an
+ * offset table. This is used to find the line feeds in the received data, as
+ * well as the spaces, semicolons and equal signs within an IRC message, which
+ * is all the tokenizers need to slice the message up. Scanning happens 16 or
+ * 32 bytes at a time, using SSE2 or AVX2 (if the CPU supports it) on x86. If
+ * you only need to look for one, two or three characters, simply repeat some
+ * of them in set. As the offsets are 16 bit, only the first 65535 bytes of buf
+ * will be scanned, which is way more than any IRC message ever needs.
+ */
+
+/*
+ * Scans buf from offset off to len for the characters in set, one byte at a
+ * time; writes their offsets into pos, starting at pos[num], until max offsets
+ * have been written. Returns the total number of offsets in pos. This is used
+ * on its own if there is no SIMD support and for the tail end of buf otherwise.
+ */
+size_t libtwirc_scan_bytes(const char *buf, size_t off, size_t len, const char *set, uint16_t *pos, size_t num, size_t max)
+{
+	for (size_t i = off; i < len && num < max; ++i)
+	{
+		if (buf[i] == set[0] || buf[i] == set[1] ||
+		    buf[i] == set[2] || buf[i] == set[3])
+		{
+			pos[num++] = i;
+		}
+	}
+	return num;
+}
+
+#if defined(__SSE2__)
+
+/*
+ * Scans buf for the characters in set, 16 bytes at a time, using SSE2.
+ * See libtwirc_scan() for details.
+ */
+size_t libtwirc_scan_sse2(const char *buf, size_t len, const char *set, uint16_t *pos, size_t max)
+{
+	__m128i c0 = _mm_set1_epi8(set[0]);
+	__m128i c1 = _mm_set1_epi8(set[1]);
+	__m128i c2 = _mm_set1_epi8(set[2]);
+	__m128i c3 = _mm_set1_epi8(set[3]);
+
+	size_t i = 0;
+	size_t num = 0;
+	for (; i + 16 <= len; i += 16)
+	{
+		// Compare 16 bytes against all four chars, get a bit per byte
+		__m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+		__m128i m = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, c0), _mm_cmpeq_epi8(v, c1)),
+				_mm_or_si128(_mm_cmpeq_epi8(v, c2), _mm_cmpeq_epi8(v, c3)));
+		unsigned int mask = _mm_movemask_epi8(m);
+
+		// Turn every set bit into an offset, lowest bit first
+		while (mask)
+		{
+			if (num == max)
+			{
+				return num;
+			}
+			pos[num++] = i + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+	return libtwirc_scan_bytes(buf, i, len, set, pos, num, max);
+}
+
+/*
+ * Scans buf for the characters in set, 32 bytes at a time, using AVX2.
+ * See libtwirc_scan() for details. Only call this if the CPU supports AVX2.
+ */
+__attribute__((target("avx2")))
+size_t libtwirc_scan_avx2(const char *buf, size_t len, const char *set, uint16_t *pos, size_t max)
+{
+	__m256i c0 = _mm256_set1_epi8(set[0]);
+	__m256i c1 = _mm256_set1_epi8(set[1]);
+	__m256i c2 = _mm256_set1_epi8(set[2]);
+	__m256i c3 = _mm256_set1_epi8(set[3]);
+
+	size_t i = 0;
+	size_t num = 0;
+	for (; i + 32 <= len; i += 32)
+	{
+		// Compare 32 bytes against all four chars, get a bit per byte
+		__m256i v = _mm256_loadu_si256((const __m256i *) (buf + i));
+		__m256i m = _mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, c0), _mm256_cmpeq_epi8(v, c1)),
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, c2), _mm256_cmpeq_epi8(v, c3)));
+		unsigned int mask = _mm256_movemask_epi8(m);
+
+		// Turn every set bit into an offset, lowest bit first
+		while (mask)
+		{
+			if (num == max)
+			{
+				return num;
+			}
+			pos[num++] = i + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+	return libtwirc_scan_bytes(buf, i, len, set, pos, num, max);
+}
+
+#else
+
+/*
+ * Scans buf for the characters in set, one byte at a time, for CPUs we have
+ * no SIMD code for. See libtwirc_scan() for details.
+ */
+size_t libtwirc_scan_plain(const char *buf, size_t len, const char *set, uint16_t *pos, size_t max)
+{
+	return libtwirc_scan_bytes(buf, 0, len, set, pos, 0, max);
+}
+
+#endif /* __SSE2__ */
+
+typedef size_t (*libtwirc_scan_fn)(const char *buf, size_t len, const char *set, uint16_t *pos, size_t max);
+
+size_t libtwirc_scan_resolve(const char *buf, size_t len, const char *set, uint16_t *pos, size_t max);
+
+// The scanner to use on this CPU; asking the CPU what it supports isn't free,
+// so we only do it once, on the first scan (see libtwirc_scan_resolve())
+static _Atomic(libtwirc_scan_fn) libtwirc_scan_impl = libtwirc_scan_resolve;
+
+/*
+ * Figures out which scanner to use on this CPU, remembers it for all future
+ * scans and does the scan at hand with it. Several threads might do this at
+ * once, but they will all come to the same conclusion.
+ */
+size_t libtwirc_scan_resolve(const char *buf, size_t len, const char *set, uint16_t *pos, size_t max)
+{
+#if defined(__SSE2__)
+	libtwirc_scan_fn fn = __builtin_cpu_supports("avx2") ?
+		libtwirc_scan_avx2 : libtwirc_scan_sse2;
+#else
+	libtwirc_scan_fn fn = libtwirc_scan_plain;
+#endif
+	atomic_store_explicit(&libtwirc_scan_impl, fn, memory_order_relaxed);
+	return fn(buf, len, set, pos, max);
+}
+
+/*
+ * Scans the first len bytes of buf for occurrences of any of the four chars
+ * in set and writes their offsets (relative to buf) into pos, in ascending
+ * order, but at most max of them. Uses AVX2 if the CPU supports it, SSE2 if
+ * the library was compiled for a CPU that supports it and plain old byte-by-
+ * byte comparison otherwise. Returns the number of offsets written to pos;
+ * if that equals max, there might be more occurrences after the last one.
+ */
+size_t libtwirc_scan(const char *buf, size_t len, const char *set, uint16_t *pos, size_t max)
+{
+	// Make sure all offsets fit into pos
+	if (len > UINT16_MAX)
+	{
+		len = UINT16_MAX;
+	}
+	libtwirc_scan_fn fn = atomic_load_explicit(&libtwirc_scan_impl, memory_order_relaxed);
+	return fn(buf, len, set, pos, max);
+}
+
+/*
+ * Finds the next delimiter in the offset table d that is the character c and 
+ * lies at or after from. All the entries before it will be skipped, as will 
+ * be the found one itself, so the caller is free to overwrite it with a null
+ * terminator. Returns a pointer to the found delimiter within the line that 
+ * d refers to or NULL if there is no such delimiter (left) in d.
+ */
+char *libtwirc_next_delim(struct libtwirc_delims *d, const char *from, char c)
+{
+	while (d->cur < d->num)
+	{
+		char *delim = d->line + d->pos[d->cur++];
+		if (delim >= from && delim[0] == c)
+		{
+			return delim;
+		}
+	}
+	return NULL;
+}
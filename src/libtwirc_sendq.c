@@ -0,0 +1,321 @@
+#include <stdlib.h>     // realloc(), free()
+#include <string.h>     // memcpy(), memmove()
+#include <errno.h>      // errno, EAGAIN, EWOULDBLOCK
+#include <poll.h>       // poll()
+#include <sys/uio.h>    // struct iovec
+#include "tcpsock.h"
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * The send queue. Our socket is non-blocking, so send() might only take part
+ * of what we hand it, or nothing at all, if the kernel's buffer is full. All
+ * the data that couldn't be sent right away goes into the state's send queue,
+ * a buffer that is allocated (and grown) as needed, up to TWIRC_SENDQ_MAX
+ * bytes. Whenever the socket becomes writable again, epoll reports EPOLLOUT
+ * and we send as much of the queue as we can. New data is only ever sent
+ * directly if the queue is empty, so the order of the messages is preserved.
+ * The queue also serves to batch messages: while a batch is open, messages
+ * are only queued, and the whole batch then goes out with one send().
+ */
+
+/*
+ * Makes room for len more bytes at the end of the state's send queue, by 
+ * moving the queued data to the front of the queue or, if that isn't enough,
+ * by growing the queue. Returns 0 on success, -1 if the data would make the 
+ * queue exceed TWIRC_SENDQ_MAX bytes or if we ran out of memory.
+ */
+int libtwirc_reserve(twirc_state_t *s, size_t len)
+{
+	size_t queued = s->sendq_tail - s->sendq_head;
+
+	// Not enough room at the end, move the queued data to the front
+	if (s->sendq_tail + len > s->sendq_size && s->sendq_head > 0)
+	{
+		memmove(s->sendq, s->sendq + s->sendq_head, queued);
+		s->sendq_head = 0;
+		s->sendq_tail = queued;
+	}
+
+	// Still not enough room, we need a bigger queue
+	if (s->sendq_tail + len > s->sendq_size)
+	{
+		if (queued + len > TWIRC_SENDQ_MAX)
+		{
+			s->error = TWIRC_ERR_SENDQ_FULL;
+			return -1;
+		}
+
+		size_t size = s->sendq_size ? s->sendq_size : TWIRC_SENDQ_SIZE;
+		while (size < queued + len)
+		{
+			size *= 2;
+		}
+		if (size > TWIRC_SENDQ_MAX)
+		{
+			size = TWIRC_SENDQ_MAX;
+		}
+
+		char *sendq = realloc(s->sendq, size);
+		if (sendq == NULL)
+		{
+			return libtwirc_oom(s);
+		}
+		s->sendq = sendq;
+		s->sendq_size = size;
+	}
+	return 0;
+}
+
+/*
+ * Sends as much of the state's send queue as the socket will take right now.
+ * Returns 0 if everything went well, even if there is still data left in the
+ * queue (we'll try again once the socket is writable); -1 if sending failed
+ * for any reason other than the socket not being ready for more data.
+ */
+int libtwirc_flush(twirc_state_t *s)
+{
+	// The socket has been closed (see twirc_disconnect())
+	if (s->socket_fd < 0)
+	{
+		return 0;
+	}
+
+	while (s->sendq_head < s->sendq_tail)
+	{
+		int sent = tcpsock_send(s->socket_fd, s->sendq + s->sendq_head,
+				s->sendq_tail - s->sendq_head);
+		if (sent == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				return 0;
+			}
+			s->error = TWIRC_ERR_SOCKET_SEND;
+			return -1;
+		}
+		s->sendq_head += sent;
+	}
+
+	// All sent, start over at the front
+	s->sendq_head = 0;
+	s->sendq_tail = 0;
+	return 0;
+}
+
+/*
+ * Returns the total length of all iovcnt buffers in iov, minus skip bytes.
+ */
+size_t libtwirc_iovlen(const struct iovec *iov, int iovcnt, size_t skip)
+{
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; ++i)
+	{
+		len += iov[i].iov_len;
+	}
+	return len - skip;
+}
+
+/*
+ * Appends the data of all iovcnt buffers in iov, skipping the first skip 
+ * bytes, to the state's send queue. Either all of it is queued or, if there
+ * isn't room for all of it, nothing is, so we never end up with half a 
+ * message in the queue. Returns 0 on success, -1 on error.
+ */
+int libtwirc_enqueuev(twirc_state_t *s, const struct iovec *iov, int iovcnt, size_t skip)
+{
+	if (libtwirc_reserve(s, libtwirc_iovlen(iov, iovcnt, skip)) == -1)
+	{
+		return -1;
+	}
+	for (int i = 0; i < iovcnt; ++i)
+	{
+		if (skip >= iov[i].iov_len)
+		{
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		size_t len = iov[i].iov_len - skip;
+		memcpy(s->sendq + s->sendq_tail, (char *) iov[i].iov_base + skip, len);
+		s->sendq_tail += len;
+		skip = 0;
+	}
+	return 0;
+}
+
+/*
+ * Sends the data of all iovcnt buffers in iov, which together have to make up
+ * one or more complete IRC messages, including their "\r\n", to the server.
+ * This allows callers to add the "\r\n" without copying the message. If the
+ * send queue is empty, we're connected and not in the middle of a batch (see
+ * twirc_batch_begin()), we try to send the data right away, with a single 
+ * writev(); whatever doesn't go out will be queued. Otherwise, the data is 
+ * queued behind the data already waiting, and, unless we're batching, we try 
+ * to send some of that. Returns 0 if the data has been sent or queued, -1 on 
+ * error (check the state's error field), in which case none of it has been.
+ */
+int libtwirc_writev(twirc_state_t *s, const struct iovec *iov, int iovcnt)
+{
+	// There is data waiting already, we're still connecting or we're in
+	// a batch, in which case the data will have to get in line; it will
+	// go out right after, at the end of the batch or on EPOLLOUT
+	if (s->sendq_head < s->sendq_tail || s->batch > 0 || 
+	    s->status & TWIRC_STATUS_CONNECTING)
+	{
+		if (libtwirc_enqueuev(s, iov, iovcnt, 0) == -1)
+		{
+			return -1;
+		}
+		if (s->batch > 0 || s->status & TWIRC_STATUS_CONNECTING)
+		{
+			return 0;
+		}
+		return libtwirc_flush(s);
+	}
+
+	// Nothing is waiting, so try to send it right away; but make sure 
+	// the queue can take whatever the socket won't before sending any of
+	// it, or we might leave the server with a truncated message
+	if (libtwirc_reserve(s, libtwirc_iovlen(iov, iovcnt, 0)) == -1)
+	{
+		return -1;
+	}
+	int sent = tcpsock_sendv(s->socket_fd, iov, iovcnt);
+	if (sent == -1)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			s->error = TWIRC_ERR_SOCKET_SEND;
+			return -1;
+		}
+		sent = 0;
+	}
+
+	// Queue whatever the socket didn't take
+	return libtwirc_enqueuev(s, iov, iovcnt, sent);
+}
+
+/*
+ * Sends len bytes of data, which have to be one or more complete IRC messages,
+ * including their "\r\n", to the server; see libtwirc_writev().
+ */
+int libtwirc_write(twirc_state_t *s, const char *data, size_t len)
+{
+	struct iovec iov = { (void *) data, len };
+	return libtwirc_writev(s, &iov, 1);
+}
+
+/*
+ * Starts a batch: until the matching twirc_batch_end(), all messages will be
+ * collected in the send queue instead of being sent one by one, so they can
+ * all go out with a single system call (and in as few packets as possible).
+ * Batches can be nested, only the end of the outermost one sends the data.
+ * If the TWIRC_OPT_CORK option is enabled, TCP_CORK will be set on the socket
+ * for the duration of the batch. libtwirc batches the messages sent from 
+ * within callbacks on its own, so this is mostly useful for sending lots of 
+ * messages from elsewhere, like a moderation sweep from a timer. With the
+ * TWIRC_OPT_THREADSAFE option, batches started from threads other than the
+ * one driving the state do nothing; the messages go through the inbox, which
+ * is sent in batches anyway (see libtwirc_drain_inbox()).
+ */
+void twirc_batch_begin(twirc_state_t *s)
+{
+	// The batch, the send queue and the socket belong to the thread
+	// driving us
+	if ((s->options & TWIRC_OPT_THREADSAFE) && !libtwirc_in_tick(s))
+	{
+		return;
+	}
+	if (s->batch++ == 0 && twirc_get_option(s, TWIRC_OPT_CORK))
+	{
+		tcpsock_cork(s->socket_fd, 1);
+	}
+}
+
+/*
+ * Ends a batch (see twirc_batch_begin()); if it's the outermost one, sends
+ * all the messages collected during the batch. Returns 0 on success, -1 if 
+ * sending failed (check the state's error field).
+ */
+int twirc_batch_end(twirc_state_t *s)
+{
+	if ((s->options & TWIRC_OPT_THREADSAFE) && !libtwirc_in_tick(s))
+	{
+		return 0;
+	}
+	if (s->batch == 0 || --s->batch > 0)
+	{
+		return 0;
+	}
+
+	// The socket has been closed in the meantime (see twirc_disconnect())
+	if (s->socket_fd < 0)
+	{
+		return 0;
+	}
+
+	int ret = 0;
+	if (!(s->status & TWIRC_STATUS_CONNECTING))
+	{
+		ret = libtwirc_flush(s);
+	}
+	if (twirc_get_option(s, TWIRC_OPT_CORK))
+	{
+		tcpsock_cork(s->socket_fd, 0);
+	}
+	return ret;
+}
+
+/*
+ * Discards all data in the state's send queue.
+ */
+void libtwirc_clear_sendq(twirc_state_t *s)
+{
+	s->sendq_head = 0;
+	s->sendq_tail = 0;
+}
+
+/*
+ * Sends everything in the state's send queue, whether we're in the middle of
+ * a batch or not, waiting up to timeout ms for the socket to take it all. 
+ * Used right before the socket gets closed, so whatever is still left in the
+ * queue after that is discarded. Returns 0 if everything went out, -1 if not.
+ */
+int libtwirc_drain(twirc_state_t *s, int timeout)
+{
+	// Data held back by TCP_CORK would only go out after a delay
+	if (s->batch > 0 && twirc_get_option(s, TWIRC_OPT_CORK))
+	{
+		tcpsock_cork(s->socket_fd, 0);
+	}
+
+	uint64_t deadline = libtwirc_now() + timeout;
+	while (s->socket_fd >= 0 && libtwirc_flush(s) == 0 &&
+	       s->sendq_head < s->sendq_tail)
+	{
+		uint64_t now = libtwirc_now();
+		if (now >= deadline)
+		{
+			break;
+		}
+		struct pollfd pfd = { s->socket_fd, POLLOUT, 0 };
+		if (poll(&pfd, 1, (int) (deadline - now)) <= 0)
+		{
+			break;
+		}
+	}
+
+	int ret = s->sendq_head < s->sendq_tail ? -1 : 0;
+	libtwirc_clear_sendq(s);
+	return ret;
+}
+
+/*
+ * Returns the number of bytes that are waiting in the state's send queue,
+ * because the socket couldn't take them yet. If this keeps growing, we're
+ * sending faster than the connection can handle.
+ */
+size_t twirc_get_queued_bytes(const twirc_state_t *s)
+{
+	return s->sendq_tail - s->sendq_head;
+}
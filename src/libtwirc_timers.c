@@ -0,0 +1,465 @@
+#include <stdlib.h>     // realloc(), free()
+#include <stdint.h>     // uint32_t, uint64_t, UINT64_MAX
+#include <errno.h>      // errno, EEXIST
+#include <unistd.h>     // read(), close()
+#include <time.h>       // struct timespec, CLOCK_MONOTONIC
+#include <sys/epoll.h>  // epoll_ctl()
+#include <sys/timerfd.h> // timerfd_create(), timerfd_settime()
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * Timers. Every state has a hierarchical timer wheel: TWIRC_WHEEL_LEVELS
+ * levels of TWIRC_WHEEL_SLOTS buckets each, where a bucket of level 0 holds
+ * the timers due in one particular millisecond, a bucket of level 1 those due
+ * in one particular stretch of 64 ms, and so on. Which level a timer goes to
+ * depends on the highest group of bits in which its due time differs from the
+ * wheel's current time, so timers far out sit in the upper levels and move
+ * down (cascade) as their time draws near; each timer moves at most once per
+ * level. Adding and cancelling a timer doesn't depend on how many there are,
+ * as every bucket is a doubly linked list. A bitmap per level tells which of
+ * its buckets are non-empty, which is all we need to know to tell when the
+ * wheel next has to do something. The wheel is driven by a timerfd in the
+ * state's epoll set, which is set to go off exactly then, so twirc_tick() and
+ * twirc_loop() wake up in time for the timers, but not any earlier.
+ */
+
+/*
+ * Sets up an empty timer wheel. The timerfd won't be created until the first
+ * timer is added, as most states will never have any.
+ */
+void libtwirc_wheel_init(struct libtwirc_wheel *w)
+{
+	w->fd = -1;
+	w->now = 0;
+	w->armed = 0;
+	w->timers = NULL;
+	w->size = 0;
+	w->num = 0;
+	w->free = LIBTWIRC_TIMER_NIL;
+	for (size_t i = 0; i < TWIRC_WHEEL_LEVELS * TWIRC_WHEEL_SLOTS + 1; ++i)
+	{
+		w->buckets[i] = LIBTWIRC_TIMER_NIL;
+	}
+	for (size_t i = 0; i < TWIRC_WHEEL_LEVELS; ++i)
+	{
+		w->used[i] = 0;
+	}
+}
+
+/*
+ * Returns the index of the bucket that a timer due at the given time belongs
+ * in, given the wheel's current time.
+ */
+int libtwirc_wheel_bucket(const struct libtwirc_wheel *w, uint64_t expires)
+{
+	uint64_t diff = expires ^ w->now;
+	if (diff >= TWIRC_WHEEL_SPAN)
+	{
+		return TWIRC_WHEEL_LEVELS * TWIRC_WHEEL_SLOTS;
+	}
+
+	int level = 0;
+	while (diff >> (TWIRC_WHEEL_BITS * (level + 1)))
+	{
+		++level;
+	}
+	return level * TWIRC_WHEEL_SLOTS +
+		((expires >> (TWIRC_WHEEL_BITS * level)) & (TWIRC_WHEEL_SLOTS - 1));
+}
+
+/*
+ * Puts the timer with index i into the bucket it belongs in. Timers that are
+ * overdue are treated as being due right now.
+ */
+void libtwirc_wheel_link(struct libtwirc_wheel *w, uint32_t i)
+{
+	struct libtwirc_timer *t = &w->timers[i];
+	if (t->expires < w->now)
+	{
+		t->expires = w->now;
+	}
+
+	int b = libtwirc_wheel_bucket(w, t->expires);
+	t->bucket = b;
+	t->prev = LIBTWIRC_TIMER_NIL;
+	t->next = w->buckets[b];
+	if (t->next != LIBTWIRC_TIMER_NIL)
+	{
+		w->timers[t->next].prev = i;
+	}
+	w->buckets[b] = i;
+
+	if (b < TWIRC_WHEEL_LEVELS * TWIRC_WHEEL_SLOTS)
+	{
+		w->used[b / TWIRC_WHEEL_SLOTS] |= 1ULL << (b % TWIRC_WHEEL_SLOTS);
+	}
+}
+
+/*
+ * Takes the timer with index i out of its bucket.
+ */
+void libtwirc_wheel_unlink(struct libtwirc_wheel *w, uint32_t i)
+{
+	struct libtwirc_timer *t = &w->timers[i];
+	int b = t->bucket;
+
+	if (t->prev != LIBTWIRC_TIMER_NIL)
+	{
+		w->timers[t->prev].next = t->next;
+	}
+	else
+	{
+		w->buckets[b] = t->next;
+	}
+	if (t->next != LIBTWIRC_TIMER_NIL)
+	{
+		w->timers[t->next].prev = t->prev;
+	}
+
+	if (w->buckets[b] == LIBTWIRC_TIMER_NIL && b < TWIRC_WHEEL_LEVELS * TWIRC_WHEEL_SLOTS)
+	{
+		w->used[b / TWIRC_WHEEL_SLOTS] &= ~(1ULL << (b % TWIRC_WHEEL_SLOTS));
+	}
+	t->bucket = -1;
+}
+
+/*
+ * Returns the time at which the wheel next has work to do, which is either
+ * when the next timers are due or when the next timers have to move down to
+ * a lower level, or UINT64_MAX if there are no timers at all. Buckets of the
+ * upper levels are emptied at the start of the stretch of time they cover;
+ * until then, they sit just ahead of the wheel's current time on their level.
+ */
+uint64_t libtwirc_wheel_next(const struct libtwirc_wheel *w)
+{
+	// Buckets whose stretch begins right now have to be emptied before
+	// anything else, even if there are timers due soon on lower levels
+	for (int level = 1; level < TWIRC_WHEEL_LEVELS; ++level)
+	{
+		int shift = TWIRC_WHEEL_BITS * level;
+		unsigned cur = (w->now >> shift) & (TWIRC_WHEEL_SLOTS - 1);
+		if ((w->now & ((1ULL << shift) - 1)) == 0 && (w->used[level] >> cur) & 1)
+		{
+			return w->now;
+		}
+	}
+	if ((w->now & (TWIRC_WHEEL_SPAN - 1)) == 0 &&
+	    w->buckets[TWIRC_WHEEL_LEVELS * TWIRC_WHEEL_SLOTS] != LIBTWIRC_TIMER_NIL)
+	{
+		return w->now;
+	}
+
+	for (int level = 0; level < TWIRC_WHEEL_LEVELS; ++level)
+	{
+		int shift = TWIRC_WHEEL_BITS * level;
+		unsigned cur = (w->now >> shift) & (TWIRC_WHEEL_SLOTS - 1);
+
+		// The current bucket counts if it hasn't been emptied yet, which
+		// is the case on level 0 and at the very start of its stretch
+		if (level > 0 && (w->now & ((1ULL << shift) - 1)) != 0)
+		{
+			cur += 1;
+		}
+		uint64_t bits = cur < TWIRC_WHEEL_SLOTS ? w->used[level] & (~0ULL << cur) : 0;
+		if (bits)
+		{
+			uint64_t start = w->now & ~((1ULL << (shift + TWIRC_WHEEL_BITS)) - 1);
+			return start | ((uint64_t) __builtin_ctzll(bits) << shift);
+		}
+	}
+
+	// Timers beyond the wheel's reach move into it once per span
+	if (w->buckets[TWIRC_WHEEL_LEVELS * TWIRC_WHEEL_SLOTS] != LIBTWIRC_TIMER_NIL)
+	{
+		return (w->now | (TWIRC_WHEEL_SPAN - 1)) + 1;
+	}
+	return UINT64_MAX;
+}
+
+/*
+ * Moves all timers of the given bucket to the buckets they belong in now,
+ * which are on lower levels.
+ */
+void libtwirc_wheel_cascade(struct libtwirc_wheel *w, int b)
+{
+	uint32_t i = w->buckets[b];
+	w->buckets[b] = LIBTWIRC_TIMER_NIL;
+	if (b < TWIRC_WHEEL_LEVELS * TWIRC_WHEEL_SLOTS)
+	{
+		w->used[b / TWIRC_WHEEL_SLOTS] &= ~(1ULL << (b % TWIRC_WHEEL_SLOTS));
+	}
+
+	while (i != LIBTWIRC_TIMER_NIL)
+	{
+		uint32_t next = w->timers[i].next;
+		libtwirc_wheel_link(w, i);
+		i = next;
+	}
+}
+
+/*
+ * Sets the timerfd to go off at the given time, or disarms it if that is
+ * UINT64_MAX. Returns 0 on success, -1 on error.
+ */
+int libtwirc_wheel_arm(struct libtwirc_wheel *w, uint64_t when)
+{
+	struct itimerspec its = { 0 };
+	if (when != UINT64_MAX)
+	{
+		// A time of 0 would disarm the timer instead
+		its.it_value.tv_sec  = when / 1000;
+		its.it_value.tv_nsec = (when % 1000) * 1000000 + 1;
+	}
+	if (timerfd_settime(w->fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+	{
+		return -1;
+	}
+	w->armed = when == UINT64_MAX ? 0 : when;
+	return 0;
+}
+
+/*
+ * Handles the millisecond the wheel's current time points to: moves down the
+ * timers whose stretch of time begins now, then calls the callbacks of all
+ * timers that are due. Repeating timers are put back in before their callback
+ * is called, so the callback can cancel them; one-shot timers are freed.
+ */
+void libtwirc_wheel_tick(twirc_state_t *s, struct libtwirc_wheel *w)
+{
+	uint64_t now = w->now;
+
+	// Start at the top, as timers might move down more than one level
+	if ((now & (TWIRC_WHEEL_SPAN - 1)) == 0)
+	{
+		libtwirc_wheel_cascade(w, TWIRC_WHEEL_LEVELS * TWIRC_WHEEL_SLOTS);
+	}
+	for (int level = TWIRC_WHEEL_LEVELS - 1; level > 0; --level)
+	{
+		int shift = TWIRC_WHEEL_BITS * level;
+		if ((now & ((1ULL << shift) - 1)) == 0)
+		{
+			libtwirc_wheel_cascade(w, level * TWIRC_WHEEL_SLOTS +
+					((now >> shift) & (TWIRC_WHEEL_SLOTS - 1)));
+		}
+	}
+
+	// Timers added by the callbacks will go into later buckets
+	w->now = now + 1;
+
+	int b = now & (TWIRC_WHEEL_SLOTS - 1);
+	uint32_t i;
+	while ((i = w->buckets[b]) != LIBTWIRC_TIMER_NIL)
+	{
+		// The callback might add timers, which can move the array
+		struct libtwirc_timer *t = &w->timers[i];
+		twirc_timer_callback cb = t->cb;
+		void *arg = t->arg;
+
+		libtwirc_wheel_unlink(w, i);
+		if (t->interval > 0)
+		{
+			t->expires += t->interval;
+			libtwirc_wheel_link(w, i);
+		}
+		else
+		{
+			t->gen += 1;
+			t->next = w->free;
+			w->free = i;
+			w->num -= 1;
+		}
+		cb(s, arg);
+	}
+}
+
+/*
+ * Calls the callbacks of all timers that are due, then sets the timerfd to
+ * go off when the wheel next has something to do. Called when the timerfd
+ * went off.
+ */
+void libtwirc_handle_timers(twirc_state_t *s)
+{
+	struct libtwirc_wheel *w = &s->wheel;
+	uint64_t val;
+	if (read(w->fd, &val, sizeof(val)) == -1)
+	{
+		// Not expired (anymore), we'll look at the wheel anyway
+	}
+
+	uint64_t now = libtwirc_now();
+	uint64_t next;
+	while ((next = libtwirc_wheel_next(w)) <= now)
+	{
+		// Nothing to do in between, so we can skip right to it
+		w->now = next;
+		libtwirc_wheel_tick(s, w);
+	}
+	if (w->now <= now)
+	{
+		w->now = now + 1;
+	}
+	libtwirc_wheel_arm(w, libtwirc_wheel_next(w));
+}
+
+/*
+ * Adds the state's timerfd to its current epoll instance, if both exist. The
+ * epoll event carries the state's address with the second lowest bit set (see
+ * libtwirc_handle_epoll()). It's fine if it has been added already. Returns 0
+ * on success, -1 on error.
+ */
+int libtwirc_watch_timers(twirc_state_t *s)
+{
+	if (s->epfd < 0 || s->wheel.fd < 0)
+	{
+		return 0;
+	}
+	struct epoll_event eev = { 0 };
+	eev.data.ptr = (void *) ((uintptr_t) s | 2);
+	eev.events = EPOLLIN | EPOLLET;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wheel.fd, &eev) == -1 && errno != EEXIST)
+	{
+		s->error = TWIRC_ERR_EPOLL_CTL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Creates the state's timerfd and adds it to the state's epoll instance, if
+ * it has one; otherwise, that happens once it does. Returns 0 on success, -1
+ * on error.
+ */
+int libtwirc_wheel_start(twirc_state_t *s)
+{
+	struct libtwirc_wheel *w = &s->wheel;
+	w->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (w->fd < 0)
+	{
+		s->error = TWIRC_ERR_TIMER;
+		return -1;
+	}
+	if (libtwirc_watch_timers(s) == -1)
+	{
+		close(w->fd);
+		w->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Makes room for more timers. Returns 0 on success, -1 if out of memory.
+ */
+int libtwirc_wheel_grow(twirc_state_t *s)
+{
+	struct libtwirc_wheel *w = &s->wheel;
+	uint32_t size = w->size ? w->size * 2 : TWIRC_TIMERS_SIZE;
+	struct libtwirc_timer *timers = realloc(w->timers, size * sizeof(struct libtwirc_timer));
+	if (timers == NULL)
+	{
+		return libtwirc_oom(s);
+	}
+
+	// Chain the new timers up into the free list, first one first
+	for (uint32_t i = size; i-- > w->size; )
+	{
+		timers[i].gen = 1;
+		timers[i].bucket = -1;
+		timers[i].next = w->free;
+		w->free = i;
+	}
+	w->timers = timers;
+	w->size = size;
+	return 0;
+}
+
+/*
+ * Adds a timer that calls cb, with the state and arg, in ms milliseconds and,
+ * if interval isn't 0, every interval milliseconds after that, until it is
+ * cancelled with twirc_timer_cancel(). Callbacks are called from within
+ * twirc_tick() (or twirc_reactor_tick()), so timers only run while the state
+ * is being driven and has an epoll instance, which it gets by connecting or
+ * by being added to a reactor. Timers may be added and cancelled from within
+ * their callbacks, but only from the thread driving the state. Returns the
+ * ID of the timer (which is never 0), or 0 on error (check the state's error).
+ */
+uint64_t twirc_timer_add(twirc_state_t *s, unsigned ms, unsigned interval, twirc_timer_callback cb, void *arg)
+{
+	struct libtwirc_wheel *w = &s->wheel;
+	if (cb == NULL)
+	{
+		return 0;
+	}
+	if (w->fd < 0 && libtwirc_wheel_start(s) == -1)
+	{
+		return 0;
+	}
+	if (w->free == LIBTWIRC_TIMER_NIL && libtwirc_wheel_grow(s) == -1)
+	{
+		return 0;
+	}
+
+	// With no timers running, the wheel's time might be way behind, which
+	// would make new timers start out on higher levels than needed
+	uint64_t now = libtwirc_now();
+	if (w->num == 0 && w->now < now)
+	{
+		w->now = now;
+	}
+
+	uint32_t i = w->free;
+	struct libtwirc_timer *t = &w->timers[i];
+	w->free = t->next;
+	w->num += 1;
+
+	t->expires  = now + ms;
+	t->interval = interval;
+	t->cb       = cb;
+	t->arg      = arg;
+	libtwirc_wheel_link(w, i);
+
+	// Make sure we wake up in time for it; if the timerfd should have gone
+	// off already, its expiry might have gone unhandled, in which case it
+	// would never go off again, so we set it anew either way
+	if (w->armed == 0 || w->armed <= now || t->expires < w->armed)
+	{
+		libtwirc_wheel_arm(w, libtwirc_wheel_next(w));
+	}
+	return ((uint64_t) t->gen << 32) | i;
+}
+
+/*
+ * Cancels the timer with the given ID, as returned by twirc_timer_add(), so
+ * its callback won't be called (again). Returns 0 on success, -1 if there is
+ * no such timer, for example because it was a one-shot timer that has run.
+ */
+int twirc_timer_cancel(twirc_state_t *s, uint64_t id)
+{
+	struct libtwirc_wheel *w = &s->wheel;
+	uint32_t i = (uint32_t) id;
+	if (i >= w->size || w->timers[i].gen != (uint32_t) (id >> 32) || w->timers[i].bucket < 0)
+	{
+		return -1;
+	}
+
+	libtwirc_wheel_unlink(w, i);
+	w->timers[i].gen += 1;
+	w->timers[i].next = w->free;
+	w->free = i;
+	w->num -= 1;
+	return 0;
+}
+
+/*
+ * Frees all of the state's timers and closes its timerfd.
+ */
+void libtwirc_free_timers(twirc_state_t *s)
+{
+	if (s->wheel.fd >= 0)
+	{
+		close(s->wheel.fd);
+	}
+	free(s->wheel.timers);
+	libtwirc_wheel_init(&s->wheel);
+}
@@ -1,5 +1,9 @@
 #include <stdio.h>      // NULL, fprintf(), perror()
+#include <stdlib.h>     // strtol(), strtoull()
+#include <string.h>     // strcmp(), memset()
+#include <stddef.h>     // offsetof()
 #include "libtwirc.h"
+#include "libtwirc_internal.h"
 
 /*
  * Returns 1 if state is currently connecting to Twitch IRC, otherwise 0.
@@ -41,10 +45,26 @@ twirc_login_t *twirc_get_login(twirc_state_t *state)
 	return &state->login;
 }
 
+/*
+ * Returns the value of the given tag. If the tag's value has not been 
+ * unescaped yet (see TWIRC_OPT_LAZY_TAGS), this will be done now, in place,
+ * so it only ever happens once per tag. Use this instead of accessing the
+ * tag's value member directly if you have lazy tags enabled.
+ */
+char const *twirc_tag_value(twirc_tag_t *tag)
+{
+	if (tag->escaped)
+	{
+		libtwirc_unescape(tag->value);
+		tag->escaped = 0;
+	}
+	return tag->value;
+}
+
 /*
  * Searches the provided array of twirc_tag structs for a tag with the 
- * provided key, then returns a pointer to that tag. If no tag with the
- * given key was found, NULL will be returned.
+ * provided key, then returns a pointer to that tag, with its value 
+ * unescaped. If no tag with the given key was found, NULL will be returned.
  */
 twirc_tag_t *twirc_get_tag(twirc_tag_t **tags, const char *key)
 {
@@ -52,12 +72,137 @@ twirc_tag_t *twirc_get_tag(twirc_tag_t **tags, const char *key)
 	{
 		if (strcmp(tags[i]->key, key) == 0)
 		{
+			twirc_tag_value(tags[i]);
 			return tags[i];
 		}
 	}
 	return NULL;
 }
 
+/*
+ * Returns a pointer to the tag of the given event that has the given key, 
+ * which has to be one of the TWIRC_TAG_* constants, with its value unescaped.
+ * Unlike twirc_get_tag(), this doesn't have to search through the tags, as 
+ * the parser has already put all the well-known ones into the event's tag 
+ * index. Returns NULL if the event doesn't have such a tag. For tags without 
+ * a TWIRC_TAG_* constant, use twirc_get_tag() instead.
+ */
+twirc_tag_t *twirc_get_tag_fast(twirc_event_t *evt, int key)
+{
+	if (evt->tag_index == NULL || key <= TWIRC_TAG_UNKNOWN || key >= TWIRC_NUM_TAG_KEYS)
+	{
+		return NULL;
+	}
+	twirc_tag_t *tag = evt->tag_index[key];
+	if (tag != NULL)
+	{
+		twirc_tag_value(tag);
+	}
+	return tag;
+}
+
+/*
+ * Type and twirc_tags member of every well-known tag, indexed by the tag's 
+ * TWIRC_TAG_* key. This is all twirc_get_tags() needs to decode the tags.
+ */
+const struct libtwirc_tag_field libtwirc_tag_fields[TWIRC_NUM_TAG_KEYS] =
+{
+	[TWIRC_TAG_BADGE_INFO]                       = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, badge_info) },
+	[TWIRC_TAG_BADGES]                           = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, badges) },
+	[TWIRC_TAG_BAN_DURATION]                     = { LIBTWIRC_TAG_TYPE_INT, offsetof(twirc_tags_t, ban_duration) },
+	[TWIRC_TAG_BITS]                             = { LIBTWIRC_TAG_TYPE_INT, offsetof(twirc_tags_t, bits) },
+	[TWIRC_TAG_BROADCASTER_LANG]                 = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, broadcaster_lang) },
+	[TWIRC_TAG_CLIENT_NONCE]                     = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, client_nonce) },
+	[TWIRC_TAG_COLOR]                            = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, color) },
+	[TWIRC_TAG_DISPLAY_NAME]                     = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, display_name) },
+	[TWIRC_TAG_EMOTE_ONLY]                       = { LIBTWIRC_TAG_TYPE_INT, offsetof(twirc_tags_t, emote_only) },
+	[TWIRC_TAG_EMOTE_SETS]                       = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, emote_sets) },
+	[TWIRC_TAG_EMOTES]                           = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, emotes) },
+	[TWIRC_TAG_FIRST_MSG]                        = { LIBTWIRC_TAG_TYPE_INT, offsetof(twirc_tags_t, first_msg) },
+	[TWIRC_TAG_FLAGS]                            = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, flags) },
+	[TWIRC_TAG_FOLLOWERS_ONLY]                   = { LIBTWIRC_TAG_TYPE_INT, offsetof(twirc_tags_t, followers_only) },
+	[TWIRC_TAG_ID]                               = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, id) },
+	[TWIRC_TAG_LOGIN]                            = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, login) },
+	[TWIRC_TAG_MOD]                              = { LIBTWIRC_TAG_TYPE_INT, offsetof(twirc_tags_t, mod) },
+	[TWIRC_TAG_MSG_ID]                           = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, msg_id) },
+	[TWIRC_TAG_MSG_PARAM_CUMULATIVE_MONTHS]      = { LIBTWIRC_TAG_TYPE_INT, offsetof(twirc_tags_t, msg_param_cumulative_months) },
+	[TWIRC_TAG_MSG_PARAM_DISPLAY_NAME]           = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, msg_param_display_name) },
+	[TWIRC_TAG_MSG_PARAM_LOGIN]                  = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, msg_param_login) },
+	[TWIRC_TAG_MSG_PARAM_MONTHS]                 = { LIBTWIRC_TAG_TYPE_INT, offsetof(twirc_tags_t, msg_param_months) },
+	[TWIRC_TAG_MSG_PARAM_RECIPIENT_DISPLAY_NAME] = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, msg_param_recipient_display_name) },
+	[TWIRC_TAG_MSG_PARAM_RECIPIENT_ID]           = { LIBTWIRC_TAG_TYPE_U64, offsetof(twirc_tags_t, msg_param_recipient_id) },
+	[TWIRC_TAG_MSG_PARAM_RECIPIENT_USER_NAME]    = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, msg_param_recipient_user_name) },
+	[TWIRC_TAG_MSG_PARAM_RITUAL_NAME]            = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, msg_param_ritual_name) },
+	[TWIRC_TAG_MSG_PARAM_SHOULD_SHARE_STREAK]    = { LIBTWIRC_TAG_TYPE_INT, offsetof(twirc_tags_t, msg_param_should_share_streak) },
+	[TWIRC_TAG_MSG_PARAM_STREAK_MONTHS]          = { LIBTWIRC_TAG_TYPE_INT, offsetof(twirc_tags_t, msg_param_streak_months) },
+	[TWIRC_TAG_MSG_PARAM_SUB_PLAN]               = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, msg_param_sub_plan) },
+	[TWIRC_TAG_MSG_PARAM_SUB_PLAN_NAME]          = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, msg_param_sub_plan_name) },
+	[TWIRC_TAG_MSG_PARAM_VIEWER_COUNT]           = { LIBTWIRC_TAG_TYPE_INT, offsetof(twirc_tags_t, msg_param_viewer_count) },
+	[TWIRC_TAG_R9K]                              = { LIBTWIRC_TAG_TYPE_INT, offsetof(twirc_tags_t, r9k) },
+	[TWIRC_TAG_REPLY_PARENT_MSG_ID]              = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, reply_parent_msg_id) },
+	[TWIRC_TAG_ROOM_ID]                          = { LIBTWIRC_TAG_TYPE_U64, offsetof(twirc_tags_t, room_id) },
+	[TWIRC_TAG_SLOW]                             = { LIBTWIRC_TAG_TYPE_INT, offsetof(twirc_tags_t, slow) },
+	[TWIRC_TAG_SUBS_ONLY]                        = { LIBTWIRC_TAG_TYPE_INT, offsetof(twirc_tags_t, subs_only) },
+	[TWIRC_TAG_SUBSCRIBER]                       = { LIBTWIRC_TAG_TYPE_INT, offsetof(twirc_tags_t, subscriber) },
+	[TWIRC_TAG_SYSTEM_MSG]                       = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, system_msg) },
+	[TWIRC_TAG_TARGET_MSG_ID]                    = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, target_msg_id) },
+	[TWIRC_TAG_TARGET_USER_ID]                   = { LIBTWIRC_TAG_TYPE_U64, offsetof(twirc_tags_t, target_user_id) },
+	[TWIRC_TAG_TMI_SENT_TS]                      = { LIBTWIRC_TAG_TYPE_U64, offsetof(twirc_tags_t, tmi_sent_ts) },
+	[TWIRC_TAG_TURBO]                            = { LIBTWIRC_TAG_TYPE_INT, offsetof(twirc_tags_t, turbo) },
+	[TWIRC_TAG_USER_ID]                          = { LIBTWIRC_TAG_TYPE_U64, offsetof(twirc_tags_t, user_id) },
+	[TWIRC_TAG_USER_TYPE]                        = { LIBTWIRC_TAG_TYPE_STR, offsetof(twirc_tags_t, user_type) },
+	[TWIRC_TAG_VIP]                              = { LIBTWIRC_TAG_TYPE_INT, offsetof(twirc_tags_t, vip) },
+};
+
+/*
+ * Returns the well-known tags of the given event, decoded into a twirc_tags 
+ * struct: string values are unescaped, integers, booleans, IDs and the time
+ * stamp are converted to numbers. Decoding happens on the first call only, 
+ * after that, the same struct is returned. Like all of the event's data, the 
+ * struct is only valid until the callback returns. Returns NULL if the event
+ * doesn't come with memory for decoded tags (which libtwirc's own events do).
+ */
+twirc_tags_t *twirc_get_tags(twirc_event_t *evt)
+{
+	twirc_tags_t *tags = evt->decoded;
+	if (tags == NULL || tags->decoded)
+	{
+		return tags;
+	}
+
+	memset(tags, 0, sizeof(twirc_tags_t));
+	for (int key = TWIRC_TAG_UNKNOWN + 1; key < TWIRC_NUM_TAG_KEYS; ++key)
+	{
+		twirc_tag_t *tag = evt->tag_index[key];
+		if (tag == NULL)
+		{
+			continue;
+		}
+
+		const struct libtwirc_tag_field *field = &libtwirc_tag_fields[key];
+		char *member = (char *) tags + field->offset;
+		char *value  = (char *) twirc_tag_value(tag);
+
+		switch (field->type)
+		{
+			case LIBTWIRC_TAG_TYPE_STR:
+				*(char **) member = value;
+				break;
+			case LIBTWIRC_TAG_TYPE_INT:
+				*(int *) member = (int) strtol(value, NULL, 10);
+				break;
+			case LIBTWIRC_TAG_TYPE_U64:
+				*(uint64_t *) member = strtoull(value, NULL, 10);
+				break;
+			default:
+				continue;
+		}
+		tags->present |= (uint64_t) 1 << key;
+	}
+	tags->decoded = 1;
+	return tags;
+}
+
 /*
  * Deprecated alias of twirc_get_tag(), use that instead.
  */
@@ -77,7 +222,7 @@ char const *twirc_get_tag_value(twirc_tag_t **tags, const char *key)
 	{
 		if (strcmp(tags[i]->key, key) == 0)
 		{
-			return tags[i]->value;
+			return twirc_tag_value(tags[i]);
 		}
 	}
 	return NULL;
@@ -100,3 +245,57 @@ void *twirc_get_context(twirc_state_t *s)
 {
 	return s->context;
 }
+
+/*
+ * Enables (on = 1) or disables (on = 0) the given option, which has to be one
+ * of the TWIRC_OPT_* constants:
+ *
+ * TWIRC_OPT_LAZY_TAGS:  Don't unescape tag values while parsing, but only when
+ *                       they are requested with twirc_get_tag(), 
+ *                       twirc_get_tag_value() or twirc_tag_value(). Saves some
+ *                       work if you are only interested in a few of the tags.
+ * TWIRC_OPT_CORK:       Set TCP_CORK on the socket while a batch of messages is
+ *                       being sent (see twirc_batch_begin()), so they go out in
+ *                       as few packets as possible.
+ * TWIRC_OPT_THREADSAFE: Allow messages to be sent from threads other than the
+ *                       one driving the state; they are passed on to that
+ *                       thread, which then sends them.
+ * TWIRC_OPT_RECONNECT:  Reconnect when the connection is lost (other than by
+ *                       twirc_disconnect()) or the server asks us to, and
+ *                       rejoin the channels we were in (see
+ *                       twirc_set_reconnect_delay()).
+ * TWIRC_OPT_HANDOVER:   When the server announces a restart, connect again
+ *                       right away and join all channels there, then switch
+ *                       over to the new connection and close the old one, so
+ *                       no messages are missed; those that come in over both
+ *                       are only passed on once (by their id tag).
+ * TWIRC_OPT_KEEPALIVE:  Send a PING once the connection has been quiet for a
+ *                       while and consider it lost if the PONG doesn't come
+ *                       back in time (see twirc_set_keepalive()); measures the
+ *                       round-trip time along the way (see twirc_get_rtt()).
+ */
+void twirc_set_option(twirc_state_t *s, int opt, int on)
+{
+	if (on)
+	{
+		s->options |= opt;
+	}
+	else
+	{
+		s->options &= ~opt;
+	}
+
+	// Start or stop keeping an eye on the connection
+	if (opt & TWIRC_OPT_KEEPALIVE)
+	{
+		libtwirc_keepalive_start(s);
+	}
+}
+
+/*
+ * Returns 1 if the given option (one of TWIRC_OPT_*) is enabled, otherwise 0.
+ */
+int twirc_get_option(const twirc_state_t *s, int opt)
+{
+	return s->options & opt ? 1 : 0;
+}
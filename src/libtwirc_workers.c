@@ -0,0 +1,216 @@
+#include <stdlib.h>     // malloc(), calloc(), free()
+#include <string.h>     // memset()
+#include <errno.h>      // errno, EINTR
+#include <unistd.h>     // sysconf()
+#include <pthread.h>    // pthread_create(), pthread_join(), pthread_setaffinity_np()
+#include <sched.h>      // cpu_set_t, CPU_ZERO(), CPU_SET()
+#include <stdatomic.h>  // atomic_int, atomic_load(), atomic_store()
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * The workers. A reactor drives any number of connections, but only with one
+ * thread, hence one core. Workers run K reactors in K threads, each pinned to
+ * a core of its own. Every connection belongs to exactly one worker and is
+ * only ever touched by that worker's thread, so nothing is shared between
+ * the threads and no locks are needed: every state brings its own buffers,
+ * send queue and event arena, every worker its own epoll instance. The flip
+ * side is that, once the workers are running, states must not be used from
+ * any other thread, including the one that started the workers; everything
+ * has to happen from within the callbacks. To spread channels across many
+ * connections per worker, create one pool per worker, on its reactor (see
+ * twirc_workers_get_reactor()).
+ */
+
+/*
+ * Returns the number of CPU cores that are online, at least 1.
+ */
+int libtwirc_num_cpus()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int) n : 1;
+}
+
+/*
+ * Thread function of a worker: drives the worker's reactor until the workers
+ * are told to stop. The reactor wakes up at least every TWIRC_WORKER_TICK ms
+ * to check for that, even when there is nothing else to do.
+ */
+void *libtwirc_worker_run(void *arg)
+{
+	struct libtwirc_worker *wk = arg;
+
+	if (wk->cpu >= 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(wk->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+	}
+
+	while (atomic_load(&wk->workers->running))
+	{
+		if (twirc_reactor_tick(wk->reactor, TWIRC_WORKER_TICK) == -1 && errno != EINTR)
+		{
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Returns a pointer to num_workers new workers, or NULL if they could not be
+ * created. If num_workers is 0, there will be one worker per CPU core. If pin
+ * is 1, worker i will be pinned to core i (modulo the number of cores). The
+ * workers don't run until twirc_workers_start() is called; add the states
+ * (or pools) they should drive before that.
+ */
+twirc_workers_t *twirc_workers_init(size_t num_workers, int pin)
+{
+	int num_cpus = libtwirc_num_cpus();
+	if (num_workers == 0)
+	{
+		num_workers = num_cpus;
+	}
+
+	twirc_workers_t *w = malloc(sizeof(twirc_workers_t));
+	if (w == NULL) { return NULL; }
+	memset(w, 0, sizeof(twirc_workers_t));
+	atomic_init(&w->running, 0);
+
+	w->workers = calloc(num_workers, sizeof(struct libtwirc_worker));
+	if (w->workers == NULL)
+	{
+		free(w);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < num_workers; ++i)
+	{
+		struct libtwirc_worker *wk = &w->workers[i];
+		wk->workers = w;
+		wk->cpu = pin ? (int) (i % num_cpus) : -1;
+		wk->reactor = twirc_reactor_init();
+		if (wk->reactor == NULL)
+		{
+			twirc_workers_free(w);
+			return NULL;
+		}
+		w->num_workers += 1;
+	}
+	return w;
+}
+
+/*
+ * Adds the state to the worker that has the fewest states so far. This has
+ * to happen before the workers are started. Returns the index of the worker
+ * the state has been added to, or -1 on error (check the state's error).
+ */
+int twirc_workers_add(twirc_workers_t *w, twirc_state_t *s)
+{
+	if (w->started)
+	{
+		return -1;
+	}
+
+	size_t min = 0;
+	for (size_t i = 1; i < w->num_workers; ++i)
+	{
+		if (w->workers[i].num_states < w->workers[min].num_states)
+		{
+			min = i;
+		}
+	}
+
+	if (twirc_reactor_add(w->workers[min].reactor, s) == -1)
+	{
+		return -1;
+	}
+	w->workers[min].num_states += 1;
+	return (int) min;
+}
+
+/*
+ * Returns the reactor of the worker with the given index, or NULL if there is
+ * no such worker. States added to it (directly or, for example, by creating a
+ * pool with it) will be driven by that worker's thread.
+ */
+twirc_reactor_t *twirc_workers_get_reactor(twirc_workers_t *w, size_t i)
+{
+	return i < w->num_workers ? w->workers[i].reactor : NULL;
+}
+
+/*
+ * Returns the number of workers (threads).
+ */
+size_t twirc_workers_get_num(const twirc_workers_t *w)
+{
+	return w->num_workers;
+}
+
+/*
+ * Starts the worker threads. From now on, the states added to the workers
+ * must only be used from within their callbacks. Returns 0 on success, -1 if
+ * the workers are running already or a thread could not be created (in which
+ * case the ones that have been created are stopped again).
+ */
+int twirc_workers_start(twirc_workers_t *w)
+{
+	if (w->started)
+	{
+		return -1;
+	}
+
+	atomic_store(&w->running, 1);
+	for (size_t i = 0; i < w->num_workers; ++i)
+	{
+		struct libtwirc_worker *wk = &w->workers[i];
+		if (pthread_create(&wk->thread, NULL, libtwirc_worker_run, wk) != 0)
+		{
+			atomic_store(&w->running, 0);
+			for (size_t k = 0; k < i; ++k)
+			{
+				pthread_join(w->workers[k].thread, NULL);
+			}
+			return -1;
+		}
+	}
+	w->started = 1;
+	return 0;
+}
+
+/*
+ * Tells the worker threads to stop and waits for them to do so, which takes
+ * at most TWIRC_WORKER_TICK ms. The connections stay as they are; after this
+ * returns, the states may be used from the calling thread again.
+ */
+void twirc_workers_stop(twirc_workers_t *w)
+{
+	if (!w->started)
+	{
+		return;
+	}
+
+	atomic_store(&w->running, 0);
+	for (size_t i = 0; i < w->num_workers; ++i)
+	{
+		pthread_join(w->workers[i].thread, NULL);
+	}
+	w->started = 0;
+}
+
+/*
+ * Stops the workers, if they are running, and frees them, including their
+ * reactors. The states will not be freed, but keep running on epoll instances
+ * of their own (see twirc_reactor_free()).
+ */
+void twirc_workers_free(twirc_workers_t *w)
+{
+	twirc_workers_stop(w);
+	for (size_t i = 0; i < w->num_workers; ++i)
+	{
+		twirc_reactor_free(w->workers[i].reactor);
+	}
+	free(w->workers);
+	free(w);
+}
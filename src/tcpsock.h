@@ -7,6 +7,9 @@
 #include <fcntl.h>      // fcntl()
 #include <sys/types.h>  // ssize_t
 #include <sys/socket.h> // socket(), connect(), send(), recv()
+#include <sys/uio.h>    // writev(), struct iovec
+#include <netinet/in.h> // IPPROTO_TCP
+#include <netinet/tcp.h> // TCP_CORK
 #include <netdb.h>      // getaddrinfo()
 
 //
@@ -67,6 +70,22 @@ int tcpsock_status(int sockfd);
  */
 int tcpsock_send(int sockfd, const char *msg, size_t len);
 
+/*
+ * Sends the data of all iovcnt buffers in iov, in order, with one writev().
+ * On success, this function returns the number of bytes sent.
+ * On error, -1 is returned and errno is set appropriately.
+ * See the man page of writev() for more details.
+ */
+int tcpsock_sendv(int sockfd, const struct iovec *iov, int iovcnt);
+
+/*
+ * Enables (cork = 1) or disables (cork = 0) TCP_CORK on the given socket: 
+ * while enabled, the kernel will hold back partial frames, so data sent with
+ * several calls can go out in as few packets as possible. Disabling it sends
+ * whatever has been held back. Returns 0 on success, -1 on error (see errno).
+ */
+int tcpsock_cork(int sockfd, int cork);
+
 /*
  * Reads the buffer of the given socket using recv().
  * On success, this function returns the number of bytes received.
@@ -77,6 +96,14 @@ int tcpsock_send(int sockfd, const char *msg, size_t len);
  */
 int tcpsock_receive(int sockfd, char *buf, size_t len);
 
+/*
+ * Shuts down the sending side of the given socket, so the other side will
+ * get an end-of-file once it has read everything that has been sent.
+ * Returns 0 on success, -1 on error (see errno).
+ * See the man page of shutdown() for more details.
+ */
+int tcpsock_shutdown(int sockfd);
+
 /*
  * Closes the given socket.
  * Returns 0 on success, -1 on error (see errno).
@@ -108,8 +135,8 @@ int tcpsock_create(int ip_type, int block)
 		return -1;
 	}
 
-	// Nonblocking, we're done
-	if (block == 0)
+	// Blocking, we're done
+	if (block == TCPSOCK_BLOCK)
 	{
 		// All done, return socket file descriptor
 		return sfd;
@@ -231,11 +258,26 @@ int tcpsock_send(int sockfd, const char *msg, size_t len)
 	return send(sockfd, msg, len, 0);
 }
 
+int tcpsock_sendv(int sockfd, const struct iovec *iov, int iovcnt)
+{
+	return writev(sockfd, iov, iovcnt);
+}
+
+int tcpsock_cork(int sockfd, int cork)
+{
+	return setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+}
+
 int tcpsock_receive(int sockfd, char *buf, size_t len)
 {
 	return recv(sockfd, buf, len, 0);
 }
 
+int tcpsock_shutdown(int sockfd)
+{
+	return shutdown(sockfd, SHUT_WR);
+}
+
 int tcpsock_close(int sockfd)
 {
 	return close(sockfd);